@@ -1,5 +1,6 @@
 // Server code for TCP socket
 // Compile and run this before client.c
+//   gcc server.c ../event_loop.c -o server
 // Credit to geeksforgeeks.com for the code
 #include <netdb.h>
 #include <netinet/in.h>
@@ -8,6 +9,10 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include "../event_loop.h"
+
 #define MAX 80
 #define PORT 8080
 #define SA struct sockaddr
@@ -40,8 +45,8 @@ void func(int connfd) {
     }
 }
 
-// Driver function
-int main() {
+// Interactive server: one client, and every reply is typed in on stdin.
+void chat_server() {
     int sockfd, connfd, len;
     struct sockaddr_in servaddr, cli;
 
@@ -90,3 +95,50 @@ int main() {
     // After chatting close the socket
     close(sockfd);
 }
+
+// client.c always sends MAX-byte messages; each complete one is echoed back.
+static ssize_t echo_data(struct conn *c, const unsigned char *data, size_t len, void *user) {
+    size_t used = 0;
+
+    (void)user;
+    while (len - used >= MAX) {
+        if (conn_send(c, data + used, MAX) != 0)
+            return -1;
+        if (strncmp("exit", (const char *)data + used, 4) == 0)
+            conn_close(c);
+        used += MAX;
+    }
+    return (ssize_t)used;
+}
+
+// Echo server for any number of clients at once, using epoll or io_uring
+int echo_server(int uring) {
+    static const struct event_loop_ops ops = {NULL, echo_data, NULL};
+    struct event_loop *loop = NULL;
+    int sockfd = tcp_listen(PORT, 1024);
+
+    raise_fd_limit();
+    if (uring && !(loop = event_loop_new_uring(&ops, NULL, 64 * 1024)))
+        printf("io_uring is not available, using epoll..\n");
+    if (!loop)
+        loop = event_loop_new(&ops, NULL, 64 * 1024);
+
+    if (!loop || sockfd < 0 || event_loop_listen(loop, sockfd) != 0) {
+        printf("Listen failed...\n");
+        return 1;
+    }
+    printf("Server listening (%s)..\n", event_loop_backend(loop));
+    int ret = event_loop_run(loop);
+    event_loop_free(loop);
+    close(sockfd);
+    return ret == 0 ? 0 : 1;
+}
+
+// Driver function, --chat for the original interactive server, --uring for io_uring
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--chat") == 0) {
+        chat_server();
+        return 0;
+    }
+    return echo_server(argc > 1 && strcmp(argv[1], "--uring") == 0);
+}
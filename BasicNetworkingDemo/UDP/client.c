@@ -33,9 +33,10 @@ int main() {
     serveraddr.sin_family = AF_INET;
     // INADDR_ANY tells it to send the packets to any socket with the correct PORT
     serveraddr.sin_addr.s_addr = INADDR_ANY;
-    serveraddr.sin_port = PORT;
+    serveraddr.sin_port = htons(PORT);
 
-    int n, len;
+    int n;
+    socklen_t len = sizeof(serveraddr);
 
     // Send and recieve messages
     sendto(sockfd, (const char *)message, strlen(message), MSG_CONFIRM, (const struct sockaddr *)&serveraddr, sizeof(serveraddr));
@@ -1,55 +1,731 @@
 // Server side implementation of UDP client-server model
+//
+// Receives continuously with recvmmsg() into preallocated message slots and answers with
+// sendmmsg(), so one system call moves a whole batch of datagrams.
+//   gcc server.c -o server -pthread
+//   ./server [--threads N] [--reuseport] [--batch N] [--reply message|echo|none] [--gro]
+//            [--uring] [--stats SEC] [-v]
+// --uring receives through io_uring instead: a multishot recvmsg stays armed on each socket
+// and the kernel fills provided buffers without a system call per batch. Kernels without
+// it (before 6.0) fall back to recvmmsg().
+// --threads N opens N sockets on the same port with SO_REUSEPORT, one per thread, and
+// the kernel spreads the senders over them. --gro lets the kernel hand over runs of
+// datagrams from one sender as one buffer (UDP GRO); --reply echo sends such a run back
+// in one go with UDP GSO. Every SEC seconds (default 1) the server prints packets/s,
+// MB/s, the mean batch size and the datagrams the kernel dropped because the socket
+// buffer was full.
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define UDP_URING 1
+#endif
+#endif
+#ifndef UDP_URING
+#define UDP_URING 0
+#endif
+
+#if UDP_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #define PORT 8080
 #define MAXLINE 1024
+#define SLOT_SIZE 2048          // one datagram
+#define GRO_SLOT_SIZE 65536     // a GRO run of datagrams
+#define MAX_BATCH 1024
+#define MAX_THREADS 64
+#define RCVBUF_SIZE (8 << 20)
 
-int main() {
-    int sockfd;
-    char buffer[MAXLINE];  // Create buffer of size MAXLINE to hold 1024 characters
-    char *message = "This is a test message from server";
+enum reply_mode { REPLY_MESSAGE, REPLY_ECHO, REPLY_NONE };
 
-    // Socket addresses to hold the server address and client address
-    struct sockaddr_in serveraddr, clientaddr;
+struct options {
+    int threads;
+    int reuseport;
+    int batch;
+    enum reply_mode reply;
+    int gro;
+    int uring;
+    int stats_interval;
+    int verbose;
+};
 
-    // AF_INET means IPv4 address and SOCK_DGRAM means UDP Connection
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        printf("ERROR creating socket");
-        exit(1);
-    }
+// Control data of one datagram: the GRO segment size and the socket's drop counter on
+// receive, the GSO segment size on send.
+union control {
+    char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct cmsghdr align;
+};
 
-    // Clear garbage memory of both address variables
-    memset(&serveraddr, 0, sizeof(serveraddr));
-    memset(&clientaddr, 0, sizeof(clientaddr));
+struct slot {
+    struct sockaddr_in addr;
+    struct iovec rx_iov, tx_iov;
+    union control rx_control, tx_control;
+};
+
+struct uring;
+
+// One receiving thread and its socket. The counters are written by the thread and read
+// by the main thread for the statistics, each receiver on its own cache lines.
+struct receiver {
+    pthread_t tid;
+    int fd;
+    int gro;               // UDP_GRO was accepted by the kernel
+    size_t slot_size;
+    struct mmsghdr *rx, *tx;
+    struct slot *slots;
+    unsigned char *buffers;
+    struct uring *uring;   // NULL when receiving with recvmmsg()
+    _Atomic uint64_t packets;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t batches;
+    _Atomic uint32_t drops;  // the socket's SO_RXQ_OVFL counter
+} __attribute__((aligned(64)));
+
+static const char *message = "This is a test message from server";
+static struct options opt = {1, 0, 64, REPLY_MESSAGE, 0, 0, 1, 0};
+static volatile sig_atomic_t stop;
 
-    // Configure the server address, INADDR_ANY means that sockets from any IP can connect to it
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int open_socket(struct receiver *r) {
+    struct sockaddr_in serveraddr;
+    struct timeval timeout = {1, 0};  // so the thread notices stop
+    int one = 1, rcvbuf = RCVBUF_SIZE;
+
+    r->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (r->fd < 0)
+        return -1;
+    if ((opt.threads > 1 || opt.reuseport) && setsockopt(r->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+        return -1;
+    // Best effort: a larger buffer absorbs bursts, the drop counter reports what it could not.
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(r->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    r->gro = opt.gro && setsockopt(r->fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_addr.s_addr = INADDR_ANY;
-    serveraddr.sin_port = PORT;
+    serveraddr.sin_port = htons(PORT);
+    return bind(r->fd, (const struct sockaddr *)&serveraddr, sizeof(serveraddr));
+}
+
+// Allocates the slots once; every batch is received into the same memory.
+static int setup_slots(struct receiver *r) {
+    int n = opt.batch;
+
+    r->slot_size = r->gro ? GRO_SLOT_SIZE : SLOT_SIZE;
+    r->rx = calloc(n, sizeof(*r->rx));
+    r->tx = calloc(n, sizeof(*r->tx));
+    r->slots = calloc(n, sizeof(*r->slots));
+    r->buffers = aligned_alloc(64, (size_t)n * r->slot_size);
+    if (!r->rx || !r->tx || !r->slots || !r->buffers)
+        return -1;
+    for (int i = 0; i < n; ++i) {
+        struct slot *s = &r->slots[i];
+        s->rx_iov.iov_base = r->buffers + (size_t)i * r->slot_size;
+        s->rx_iov.iov_len = r->slot_size;
+        r->rx[i].msg_hdr.msg_iov = &s->rx_iov;
+        r->rx[i].msg_hdr.msg_iovlen = 1;
+        r->tx[i].msg_hdr.msg_name = &s->addr;
+        r->tx[i].msg_hdr.msg_namelen = sizeof(s->addr);
+        r->tx[i].msg_hdr.msg_iov = &s->tx_iov;
+        r->tx[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+// Reads the control messages of a received datagram. Returns the GRO segment size, 0 if
+// the buffer holds a single datagram.
+static int parse_control(struct receiver *r, struct msghdr *msg) {
+    int gso_size = 0;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            atomic_store_explicit(&r->drops, drops, memory_order_relaxed);
+        } else if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+        }
+    }
+    return gso_size;
+}
+
+// Sends the first n entries of r->tx, retrying on partial sends.
+static void send_batch(struct receiver *r, int n) {
+    int sent = 0;
+
+    while (sent < n) {
+        int k = sendmmsg(r->fd, r->tx + sent, n - sent, 0);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            // The datagram at sent was refused (e.g. unreachable); skip it.
+            ++sent;
+            continue;
+        }
+        sent += k;
+    }
+}
+
+// Sets up r->tx[i] to answer the datagram (or GRO run) of len bytes at data, which came
+// from r->slots[i].addr. Returns the number of datagrams it held.
+static uint64_t prepare_reply(struct receiver *r, int i, void *data, size_t len, int gso_size) {
+    struct slot *s = &r->slots[i];
+    struct msghdr *tx = &r->tx[i].msg_hdr;
+
+    if (opt.verbose) {
+        int shown = len < MAXLINE ? (int)len : MAXLINE;
+        printf("CLIENT SAID: %.*s\n", shown, (char *)data);
+    }
+
+    tx->msg_control = NULL;
+    tx->msg_controllen = 0;
+    if (opt.reply == REPLY_ECHO) {
+        s->tx_iov.iov_base = data;
+        s->tx_iov.iov_len = len;
+        if (gso_size > 0 && (size_t)gso_size < len) {
+            // Split back into the original datagrams by the kernel (or the NIC).
+            struct cmsghdr *cm;
+            tx->msg_control = s->tx_control.buf;
+            tx->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cm = CMSG_FIRSTHDR(tx);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = (uint16_t)gso_size;
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+    } else {
+        s->tx_iov.iov_base = (void *)message;
+        s->tx_iov.iov_len = strlen(message);
+    }
+    return gso_size > 0 ? (len + gso_size - 1) / gso_size : 1;
+}
+
+static void count_batch(struct receiver *r, uint64_t packets, uint64_t bytes) {
+    atomic_fetch_add_explicit(&r->packets, packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->batches, 1, memory_order_relaxed);
+}
+
+#if UDP_URING
+static int uring_receive_loop(struct receiver *r);
+static void uring_free(struct uring *u);
+#endif
+
+static void *receive_loop(void *arg) {
+    struct receiver *r = arg;
+
+#if UDP_URING
+    if (r->uring) {
+        if (uring_receive_loop(r) == 0)
+            return NULL;
+        printf("multishot recvmsg is not supported by this kernel, using recvmmsg\n");
+        uring_free(r->uring);
+        r->uring = NULL;
+    }
+#endif
+    while (!stop) {
+        // Re-arm the slots: recvmmsg overwrites the lengths.
+        for (int i = 0; i < opt.batch; ++i) {
+            struct msghdr *h = &r->rx[i].msg_hdr;
+            h->msg_name = &r->slots[i].addr;
+            h->msg_namelen = sizeof(r->slots[i].addr);
+            h->msg_control = r->slots[i].rx_control.buf;
+            h->msg_controllen = sizeof(r->slots[i].rx_control.buf);
+        }
+        // Blocks for the first datagram, then takes whatever else is already queued.
+        int n = recvmmsg(r->fd, r->rx, opt.batch, MSG_WAITFORONE, NULL);
+        if (n <= 0)
+            continue;
+
+        uint64_t packets = 0, bytes = 0;
+        for (int i = 0; i < n; ++i) {
+            size_t len = r->rx[i].msg_len;
+            int gso_size = parse_control(r, &r->rx[i].msg_hdr);
+            packets += prepare_reply(r, i, r->slots[i].rx_iov.iov_base, len, gso_size);
+            bytes += len;
+        }
+        if (opt.reply != REPLY_NONE)
+            send_batch(r, n);
+        count_batch(r, packets, bytes);
+    }
+    return NULL;
+}
+
+#if UDP_URING
+/* io_uring receive path */
+// Each receiver has its own ring with one multishot recvmsg armed on its socket (Linux
+// 6.0). Every datagram completes into a buffer the kernel picks from a ring of provided
+// buffers, laid out as struct io_uring_recvmsg_out, the sender's address, the control
+// data and the payload. A thread thus collects a whole batch per io_uring_enter() and
+// never re-arms the receive while it keeps up. The ring is set up with the raw system
+// calls, like in event_loop.c, so there is no liburing dependency.
+#define URING_ENTRIES 64
+#define URING_BGID 0
+
+// Kind of request in user_data.
+enum { REQ_RECV = 1, REQ_TICK };
+
+struct uring {
+    int fd;
+    // Submission ring: the kernel consumes from khead, we produce at tail.
+    unsigned *sq_khead, *sq_ktail, *sq_array, sq_mask, sq_entries;
+    unsigned sq_tail;
+    struct io_uring_sqe *sqes;
+    // Completion ring.
+    unsigned *cq_khead, *cq_ktail, cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // Provided buffers, twice the batch so that the kernel can fill one half while the
+    // thread answers from the other.
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size, buf_size;
+    unsigned buf_count;
+    unsigned short buf_tail;
+    unsigned char *buffers;
+    // Only its name and control lengths count: the room the kernel leaves for them.
+    struct msghdr msg;
+    // Wakes the thread once a second so that it notices stop.
+    struct __kernel_timespec tick;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct uring *u) {
+    if (u->buf_ring) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = URING_BGID;
+        sys_io_uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(u->buf_ring, u->buf_ring_size);
+    }
+    free(u->buffers);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u);
+}
+
+static void uring_provide(struct uring *u, unsigned short bid) {
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (u->buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * u->buf_size);
+    b->len = (unsigned)u->buf_size;
+    b->bid = bid;
+    ++u->buf_tail;
+}
+
+// Hands the buffers given back since the last call to the kernel.
+static void uring_publish_buffers(struct uring *u) {
+    atomic_store_explicit((_Atomic unsigned short *)&u->buf_ring->tail, u->buf_tail, memory_order_release);
+}
+
+// Returns NULL when the kernel has no io_uring (before 5.5, or blocked by seccomp) or no
+// provided buffer rings (before 5.19).
+static struct uring *uring_new(struct receiver *r) {
+    struct uring *u = calloc(1, sizeof(*u));
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+
+    if (!u)
+        return NULL;
+    u->fd = -1;
+    u->buf_count = 1;
+    while (u->buf_count < 2u * (unsigned)opt.batch)
+        u->buf_count *= 2;
+    // Multishot requests post many completions each; CQSIZE and COOP_TASKRUN only exist
+    // on newer kernels, so retry without them.
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = u->buf_count * 2;
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    // Without NODROP (5.5) overflowing completions would be lost.
+    if (u->fd < 0 || !(p.features & IORING_FEAT_NODROP))
+        goto fail;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    unsigned char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_khead = (unsigned *)(sq + p.sq_off.head);
+    u->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_tail = *u->sq_ktail;
+    u->cq_khead = (unsigned *)(cq + p.cq_off.head);
+    u->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    u->msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->msg.msg_controllen = sizeof(union control);
+    u->buf_size = sizeof(struct io_uring_recvmsg_out) + u->msg.msg_namelen + u->msg.msg_controllen + r->slot_size;
+    u->buf_ring_size = u->buf_count * sizeof(struct io_uring_buf);
+    u->buffers = malloc(u->buf_count * u->buf_size);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!u->buffers || u->buf_ring == MAP_FAILED) {
+        u->buf_ring = NULL;
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = u->buf_count;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(u->buf_ring, u->buf_ring_size);
+        u->buf_ring = NULL;
+        goto fail;
+    }
+    for (unsigned i = 0; i < u->buf_count; ++i)
+        uring_provide(u, (unsigned short)i);
+    uring_publish_buffers(u);
+    u->tick.tv_sec = 1;
+    return u;
+
+fail:
+    uring_free(u);
+    return NULL;
+}
+
+// Submits the queued requests; with wait, also blocks for at least one completion.
+static int uring_enter(struct uring *u, int wait) {
+    unsigned to_submit = u->sq_tail - *u->sq_ktail;
+
+    atomic_store_explicit((_Atomic unsigned *)u->sq_ktail, u->sq_tail, memory_order_release);
+    if (to_submit == 0 && !wait)
+        return 0;
+    int ret = sys_io_uring_enter(u->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? -errno : 0;
+}
+
+// Only two requests are ever in flight, so the submission ring cannot be full.
+static struct io_uring_sqe *uring_prep(struct uring *u, unsigned char opcode, uint64_t req) {
+    unsigned index = u->sq_tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    ++u->sq_tail;
+    sqe->opcode = opcode;
+    sqe->user_data = req;
+    return sqe;
+}
+
+static void uring_arm_recv(struct receiver *r) {
+    struct io_uring_sqe *sqe = uring_prep(r->uring, IORING_OP_RECVMSG, REQ_RECV);
+
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->uring->msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+}
+
+static void uring_arm_tick(struct uring *u) {
+    struct io_uring_sqe *sqe = uring_prep(u, IORING_OP_TIMEOUT, REQ_TICK);
+
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&u->tick;
+    sqe->len = 1;
+}
 
-    if (bind(sockfd, (const struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
-        printf("BIND failed");
+// Answers the datagram in the provided buffer bid as slot i. Returns 0 and adds to
+// *packets and *bytes, or -1 when the kernel cut off the address.
+static int uring_datagram(struct receiver *r, int i, unsigned short bid, uint64_t *packets, uint64_t *bytes) {
+    struct uring *u = r->uring;
+    unsigned char *buf = u->buffers + (size_t)bid * u->buf_size;
+    struct io_uring_recvmsg_out out;
+    struct msghdr control;
+    unsigned char *name = buf + sizeof(out);
+    unsigned char *payload = name + u->msg.msg_namelen + u->msg.msg_controllen;
+    size_t room = u->buf_size - (size_t)(payload - buf);
+
+    memcpy(&out, buf, sizeof(out));
+    if (out.namelen > sizeof(r->slots[i].addr))
+        return -1;
+    memcpy(&r->slots[i].addr, name, out.namelen);
+
+    memset(&control, 0, sizeof(control));
+    control.msg_control = name + u->msg.msg_namelen;
+    control.msg_controllen = out.controllen;
+    size_t len = out.payloadlen < room ? out.payloadlen : room;
+    *packets += prepare_reply(r, i, payload, len, parse_control(r, &control));
+    *bytes += len;
+    return 0;
+}
+
+// Runs until stop. Returns -1 at once when the kernel has no multishot recvmsg, so the
+// caller can use recvmmsg() instead.
+static int uring_receive_loop(struct receiver *r) {
+    struct uring *u = r->uring;
+    unsigned short *bids = calloc(opt.batch, sizeof(*bids));
+    int received = 0;
+
+    if (!bids)
+        return -1;
+    uring_arm_recv(r);
+    uring_arm_tick(u);
+    while (!stop) {
+        unsigned head = *u->cq_khead;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)u->cq_ktail, memory_order_acquire);
+
+        if (head == tail) {
+            int ret = uring_enter(u, 1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+                break;
+            continue;
+        }
+
+        uint64_t packets = 0, bytes = 0;
+        int n = 0, rearm = 0;
+        for (; head != tail && n < opt.batch; ++head) {
+            struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+            int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+            if (cqe->user_data == REQ_TICK) {
+                if (!stop)
+                    uring_arm_tick(u);
+                continue;
+            }
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe->res >= 0 && uring_datagram(r, n, bid, &packets, &bytes) == 0)
+                    bids[n++] = bid;
+                else
+                    uring_provide(u, bid);
+                received = 1;
+            } else if (cqe->res == -EINVAL && !received) {
+                free(bids);
+                return -1;
+            }
+            // Ends on errors, and with ENOBUFS when the thread fell behind and the kernel
+            // ran out of buffers; armed again once this batch has given them back.
+            rearm |= !more;
+        }
+        atomic_store_explicit((_Atomic unsigned *)u->cq_khead, head, memory_order_release);
+
+        if (n > 0) {
+            if (opt.reply != REPLY_NONE)
+                send_batch(r, n);
+            count_batch(r, packets, bytes);
+        }
+        // The replies have gone out of these buffers, so the kernel may fill them again.
+        for (int i = 0; i < n; ++i)
+            uring_provide(u, bids[i]);
+        uring_publish_buffers(u);
+        if (rearm && !stop)
+            uring_arm_recv(r);
+    }
+    free(bids);
+    return 0;
+}
+#endif // UDP_URING
+
+struct totals {
+    uint64_t packets, bytes, batches, drops;
+};
+
+static struct totals sum(struct receiver *r, int n) {
+    struct totals t = {0, 0, 0, 0};
+    for (int i = 0; i < n; ++i) {
+        t.packets += atomic_load_explicit(&r[i].packets, memory_order_relaxed);
+        t.bytes += atomic_load_explicit(&r[i].bytes, memory_order_relaxed);
+        t.batches += atomic_load_explicit(&r[i].batches, memory_order_relaxed);
+        t.drops += atomic_load_explicit(&r[i].drops, memory_order_relaxed);
+    }
+    return t;
+}
+
+static void print_rate(const char *label, struct totals now, struct totals then, double seconds) {
+    uint64_t packets = now.packets - then.packets;
+    uint64_t batches = now.batches - then.batches;
+    printf("%s: %.0f packets/s, %.2f MB/s, %.1f datagrams per batch, %llu dropped\n", label,
+           packets / seconds, (now.bytes - then.bytes) / seconds / 1e6,
+           batches ? (double)(now.packets - then.packets) / batches : 0.0,
+           (unsigned long long)(now.drops - then.drops));
+    fflush(stdout);
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--threads") && v) {
+            opt.threads = atoi(v);
+            ++i;
+        } else if (!strcmp(a, "--batch") && v) {
+            opt.batch = atoi(v);
+            ++i;
+        } else if (!strcmp(a, "--stats") && v) {
+            opt.stats_interval = atoi(v);
+            ++i;
+        } else if (!strcmp(a, "--reply") && v) {
+            opt.reply = !strcmp(v, "echo") ? REPLY_ECHO : !strcmp(v, "none") ? REPLY_NONE : REPLY_MESSAGE;
+            ++i;
+        } else if (!strcmp(a, "--reuseport")) {
+            opt.reuseport = 1;
+        } else if (!strcmp(a, "--gro")) {
+            opt.gro = 1;
+        } else if (!strcmp(a, "--uring")) {
+            opt.uring = 1;
+        } else if (!strcmp(a, "-v")) {
+            opt.verbose = 1;
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--reuseport] [--batch N] [--reply message|echo|none] "
+                            "[--gro] [--uring] [--stats SEC] [-v]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (opt.threads < 1 || opt.threads > MAX_THREADS || opt.batch < 1 || opt.batch > MAX_BATCH) {
+        fprintf(stderr, "threads must be 1..%d and batch 1..%d\n", MAX_THREADS, MAX_BATCH);
+        return -1;
+    }
+    if (opt.stats_interval < 1)
+        opt.stats_interval = 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct receiver *receivers;
+    struct sigaction sa;
+
+    if (parse_args(argc, argv) != 0)
+        return 1;
+    receivers = aligned_alloc(64, sizeof(*receivers) * opt.threads);
+    if (!receivers) {
+        printf("ERROR allocating receivers");
         exit(1);
     }
+    memset(receivers, 0, sizeof(*receivers) * opt.threads);
 
-    int len, n;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    // Recieve a message from the client and store the client address
-    n = recvfrom(sockfd, (char *)buffer, MAXLINE, MSG_WAITALL, (struct sockaddr *)&clientaddr, &len);
-    buffer[n] = '\0';
-    printf("CLIENT SAID: %s\n", buffer);
+    for (int i = 0; i < opt.threads; ++i) {
+        if (open_socket(&receivers[i]) != 0) {
+            printf("BIND failed");
+            exit(1);
+        }
+        if (setup_slots(&receivers[i]) != 0) {
+            printf("ERROR allocating message slots");
+            exit(1);
+        }
+#if UDP_URING
+        if (opt.uring && !(receivers[i].uring = uring_new(&receivers[i]))) {
+            printf("io_uring with provided buffers is not available, using recvmmsg\n");
+            opt.uring = 0;
+        }
+#endif
+    }
+    printf("Receiving on port %d with %d thread(s), batches of %d%s%s\n", PORT, opt.threads, opt.batch,
+           receivers[0].gro ? ", UDP GRO" : "", receivers[0].uring ? ", io_uring" : "");
+    for (int i = 0; i < opt.threads; ++i)
+        pthread_create(&receivers[i].tid, NULL, receive_loop, &receivers[i]);
 
-    // Send a message back to the client using the given client address
-    sendto(sockfd, (const char *)message, strlen(message), MSG_CONFIRM, (struct sockaddr *)&clientaddr, len);
-    printf("MESSAGE SENT TO CLIENT\n");
+    double start = now_seconds(), last = start;
+    struct totals previous = {0, 0, 0, 0};
+    while (!stop) {
+        sleep(opt.stats_interval);
+        double t = now_seconds();
+        struct totals current = sum(receivers, opt.threads);
+        print_rate("last interval", current, previous, t - last);
+        previous = current;
+        last = t;
+    }
 
+    for (int i = 0; i < opt.threads; ++i)
+        pthread_join(receivers[i].tid, NULL);
+    struct totals zero = {0, 0, 0, 0};
+    print_rate("overall", sum(receivers, opt.threads), zero, now_seconds() - start);
+    for (int i = 0; i < opt.threads; ++i) {
+#if UDP_URING
+        if (receivers[i].uring)
+            uring_free(receivers[i].uring);
+#endif
+        close(receivers[i].fd);
+        free(receivers[i].rx);
+        free(receivers[i].tx);
+        free(receivers[i].slots);
+        free(receivers[i].buffers);
+    }
+    free(receivers);
     return 0;
 }
@@ -0,0 +1,966 @@
+// Event loop with an epoll and an io_uring backend, see event_loop.h
+//
+// epoll: every socket is registered once with EPOLLIN | EPOLLOUT | EPOLLET, so an event
+// only says that something changed: reads and writes then go on until they hit EAGAIN.
+//
+// io_uring: the loop keeps requests armed instead (accept, recv, send and poll) and
+// collects their completions, submitting all new requests and waiting for the next
+// completions in one io_uring_enter() call. The setup is done with the raw system calls,
+// so there is no liburing dependency.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define EVENT_LOOP_URING 1
+#endif
+#endif
+#ifndef EVENT_LOOP_URING
+#define EVENT_LOOP_URING 0
+#endif
+
+#if EVENT_LOOP_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "event_loop.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 4096
+
+struct buffer {
+    unsigned char *data;
+    size_t start;  // first unconsumed byte
+    size_t len;    // bytes from start on
+    size_t cap;
+};
+
+enum conn_kind { CONN_CLIENT, CONN_LISTENER, CONN_WATCH };
+
+struct conn {
+    int fd;
+    enum conn_kind kind;
+    int closing;
+    int holds;     // conn_hold() references; the connection outlives them
+    int dead;      // fd closed, freed at the end of the current batch of events
+    struct conn *next_dead;
+    int paused;    // CONN_LISTENER out of fds, see listener_pause()
+    struct conn *next_paused;
+    struct event_loop *loop;
+    struct buffer in, out;
+    void *data;
+    void (*on_ready)(void *arg);   // CONN_WATCH
+
+    // io_uring only. The kernel reads out while a send is in flight, so conn_send()
+    // appends to out_next meanwhile.
+    struct buffer out_next;
+    int ops;         // requests in flight; the struct is freed once they are all done
+    int sending;
+    struct conn *next_rearm;
+};
+
+struct uring;
+
+struct event_loop {
+    int epfd;
+    struct uring *uring;   // NULL for epoll
+    volatile sig_atomic_t stop;
+    size_t max_buffer;
+    const struct event_loop_ops *ops;
+    void *user;
+    struct conn *dead;
+    struct conn *paused;
+};
+
+#if EVENT_LOOP_URING
+static int uring_arm(struct conn *c);
+static void uring_send(struct conn *c);
+static void uring_free(struct uring *u);
+static int uring_run(struct event_loop *loop);
+#endif
+
+// Makes room for at least want more bytes (or whatever max still allows) behind the
+// buffered data, moving it to the front first. Returns the room, 0 when the buffer is full.
+static size_t buffer_reserve(struct buffer *b, size_t want, size_t max) {
+    if (b->start + b->len + want > b->cap && b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len);
+        b->start = 0;
+    }
+    if (b->len + want > b->cap && b->cap < max) {
+        size_t cap = b->cap ? b->cap * 2 : READ_CHUNK;
+        while (cap < b->len + want)
+            cap *= 2;
+        if (cap > max)
+            cap = max;
+        unsigned char *data = realloc(b->data, cap);
+        if (!data)
+            return 0;
+        b->data = data;
+        b->cap = cap;
+    }
+    return b->cap - b->start - b->len;
+}
+
+static void buffer_consume(struct buffer *b, size_t n) {
+    b->start += n;
+    b->len -= n;
+    if (b->len == 0)
+        b->start = 0;
+}
+
+struct event_loop *event_loop_new(const struct event_loop_ops *ops, void *user, size_t max_buffer) {
+    struct event_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    loop->ops = ops;
+    loop->user = user;
+    loop->max_buffer = max_buffer;
+    return loop;
+}
+
+void event_loop_free(struct event_loop *loop) {
+    if (!loop)
+        return;
+#if EVENT_LOOP_URING
+    if (loop->uring)
+        uring_free(loop->uring);
+#endif
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    free(loop);
+}
+
+const char *event_loop_backend(const struct event_loop *loop) {
+    return loop->uring ? "io_uring" : "epoll";
+}
+
+static struct conn *conn_add(struct event_loop *loop, int fd, enum conn_kind kind) {
+    struct conn *c = calloc(1, sizeof(*c));
+    struct epoll_event ev;
+
+    if (!c)
+        return NULL;
+    c->fd = fd;
+    c->kind = kind;
+    c->loop = loop;
+#if EVENT_LOOP_URING
+    if (loop->uring) {
+        // io_uring waits for connections itself; a non-blocking socket would just fail.
+        if (kind == CONN_LISTENER)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        // Nothing is armed for a client before on_open has set it up.
+        if (kind != CONN_CLIENT && uring_arm(c) != 0) {
+            free(c);
+            return NULL;
+        }
+        return c;
+    }
+#endif
+    ev.events = kind != CONN_CLIENT ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Out of file descriptors (EMFILE/ENFILE) the pending connection stays in the backlog,
+// so a level-triggered listener, or an accept re-armed at once, would report it again
+// right away and spin. Instead the listener is left alone until a connection closes.
+static void listener_pause(struct conn *l) {
+    struct event_loop *loop = l->loop;
+
+    if (l->paused)
+        return;
+    l->paused = 1;
+    l->next_paused = loop->paused;
+    loop->paused = l;
+    if (!loop->uring)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, l->fd, NULL);
+}
+
+static void listeners_resume(struct event_loop *loop) {
+    while (loop->paused) {
+        struct conn *l = loop->paused;
+        loop->paused = l->next_paused;
+        l->paused = 0;
+#if EVENT_LOOP_URING
+        if (loop->uring) {
+            if (!loop->stop)
+                uring_arm(l);
+            continue;
+        }
+#endif
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, l->fd, &ev);
+    }
+}
+
+// Closes a connection that is done: closing, nothing left to send and not held. The
+// struct stays around until the end of the batch, which may still hold events for it.
+static void conn_retire(struct conn *c) {
+    struct event_loop *loop = c->loop;
+
+    if (c->dead || !c->closing || c->out.len > 0 || c->out_next.len > 0 || c->holds > 0)
+        return;
+    if (loop->ops->on_close)
+        loop->ops->on_close(c, loop->user);
+    // Closing the fd also takes it out of the epoll set. A pending io_uring recv holds
+    // its own reference to the socket, so shut it down to make that complete.
+    if (loop->uring)
+        shutdown(c->fd, SHUT_RDWR);
+    close(c->fd);
+    c->dead = 1;
+    c->next_dead = loop->dead;
+    loop->dead = c;
+    listeners_resume(loop);
+}
+
+static void free_dead(struct event_loop *loop) {
+    struct conn **p = &loop->dead;
+
+    while (*p) {
+        struct conn *c = *p;
+        if (c->ops > 0) {
+            // io_uring still has requests of it; they complete with an error soon.
+            p = &c->next_dead;
+            continue;
+        }
+        *p = c->next_dead;
+        free(c->in.data);
+        free(c->out.data);
+        free(c->out_next.data);
+        free(c);
+    }
+}
+
+int event_loop_listen(struct event_loop *loop, int listen_fd) {
+    return conn_add(loop, listen_fd, CONN_LISTENER) ? 0 : -1;
+}
+
+int event_loop_watch(struct event_loop *loop, int fd, void (*on_ready)(void *arg), void *arg) {
+    struct conn *c = conn_add(loop, fd, CONN_WATCH);
+    if (!c)
+        return -1;
+    c->on_ready = on_ready;
+    c->data = arg;
+    return 0;
+}
+
+void conn_hold(struct conn *c) {
+    ++c->holds;
+}
+
+void conn_release(struct conn *c) {
+    --c->holds;
+    conn_retire(c);
+}
+
+int conn_closing(const struct conn *c) {
+    return c->closing;
+}
+
+void event_loop_stop(struct event_loop *loop) {
+    loop->stop = 1;
+}
+
+int conn_fd(const struct conn *c) {
+    return c->fd;
+}
+
+void conn_set_data(struct conn *c, void *data) {
+    c->data = data;
+}
+
+void *conn_data(const struct conn *c) {
+    return c->data;
+}
+
+void conn_close(struct conn *c) {
+    c->closing = 1;
+}
+
+// Writes queued output until the socket would block. Returns -1 on a socket error.
+static int conn_flush(struct conn *c) {
+    while (c->out.len > 0) {
+        ssize_t n = send(c->fd, c->out.data + c->out.start, c->out.len, MSG_NOSIGNAL);
+        if (n > 0) {
+            buffer_consume(&c->out, (size_t)n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int conn_send(struct conn *c, const void *buf, size_t len) {
+#if EVENT_LOOP_URING
+    if (c->loop->uring) {
+        struct buffer *b = c->sending ? &c->out_next : &c->out;
+        if (c->out.len + c->out_next.len + len > c->loop->max_buffer)
+            return -1;
+        if (buffer_reserve(b, len, c->loop->max_buffer) < len)
+            return -1;
+        memcpy(b->data + b->start + b->len, buf, len);
+        b->len += len;
+        // Goes out with the next io_uring_enter().
+        if (!c->sending)
+            uring_send(c);
+        return 0;
+    }
+#endif
+    if (c->out.len + len > c->loop->max_buffer)
+        return -1;
+    if (buffer_reserve(&c->out, len, c->loop->max_buffer) < len)
+        return -1;
+    memcpy(c->out.data + c->out.start + c->out.len, buf, len);
+    c->out.len += len;
+    // Try right away; EPOLLOUT only fires again once the socket buffer had been full.
+    if (conn_flush(c) != 0) {
+        c->closing = 1;
+        c->out.len = 0;
+    }
+    return 0;
+}
+
+static void accept_all(struct event_loop *loop, struct conn *l) {
+    for (;;) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+                listener_pause(l);
+            // EAGAIN: backlog drained. ENOBUFS and friends: retry on the next event.
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct conn *c = conn_add(loop, fd, CONN_CLIENT);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        if (loop->ops->on_open)
+            loop->ops->on_open(c, loop->user);
+    }
+}
+
+// Reads until EAGAIN, handing the buffered bytes to on_data after every read.
+static void conn_readable(struct conn *c) {
+    struct event_loop *loop = c->loop;
+
+    while (!c->closing) {
+        size_t room = buffer_reserve(&c->in, READ_CHUNK, loop->max_buffer);
+        if (room == 0) {
+            // A message larger than max_buffer can never complete.
+            c->closing = 1;
+            return;
+        }
+        ssize_t n = read(c->fd, c->in.data + c->in.start + c->in.len, room);
+        if (n > 0) {
+            c->in.len += (size_t)n;
+            // Held so that nothing the callback does can close c under it.
+            ++c->holds;
+            ssize_t used = loop->ops->on_data(c, c->in.data + c->in.start, c->in.len, loop->user);
+            --c->holds;
+            if (used < 0)
+                c->closing = 1;
+            else
+                buffer_consume(&c->in, (size_t)used);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (n == 0) {
+            // The client is done sending; queued replies still go out.
+            c->closing = 1;
+        } else {
+            c->closing = 1;
+            c->out.len = 0;
+        }
+    }
+}
+
+int event_loop_run(struct event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+#if EVENT_LOOP_URING
+    if (loop->uring)
+        return uring_run(loop);
+#endif
+    while (!loop->stop) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            struct conn *c = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if (c->dead)
+                continue;
+            if (c->kind == CONN_LISTENER) {
+                accept_all(loop, c);
+                continue;
+            }
+            if (c->kind == CONN_WATCH) {
+                c->on_ready(c->data);
+                continue;
+            }
+            if (ev & EPOLLERR) {
+                c->closing = 1;
+                c->out.len = 0;
+            }
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                conn_readable(c);
+            if ((ev & EPOLLOUT) && conn_flush(c) != 0)
+                c->out.len = 0;
+            // A closing connection still gets its last replies out first.
+            conn_retire(c);
+        }
+        free_dead(loop);
+    }
+    return 0;
+}
+
+#if EVENT_LOOP_URING
+/*****************************************************************************/
+/* io_uring backend                                                          */
+/*****************************************************************************/
+#define URING_ENTRIES 1024
+// Provided buffers that multishot recv picks from, shared by all connections.
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_BGID 0
+
+// Kind of request, in the low bits of user_data next to the conn pointer.
+enum { REQ_ACCEPT, REQ_RECV, REQ_SEND, REQ_POLL, REQ_MASK = 7 };
+
+struct uring {
+    int fd;
+    unsigned features;
+    // Submission ring: the kernel consumes from khead, we produce at tail.
+    unsigned *sq_khead, *sq_ktail, *sq_array, sq_mask, sq_entries;
+    unsigned sq_tail;
+    struct io_uring_sqe *sqes;
+    // Completion ring.
+    unsigned *cq_khead, *cq_ktail, cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // What the running kernel turned out to support.
+    int multishot_accept;
+    int multishot_recv;
+    struct io_uring_buf_ring *buf_ring;   // NULL without provided buffers (before 5.19)
+    unsigned char *buffers;
+    unsigned short buf_tail;
+
+    struct conn *rearm;   // recv requests to arm again once buffers are back
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct uring *u) {
+    if (u->buf_ring) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = URING_BGID;
+        sys_io_uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(u->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(u->buffers);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u);
+}
+
+static void uring_provide(struct uring *u, unsigned short bid) {
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    b->len = URING_BUFFER_SIZE;
+    b->bid = bid;
+    ++u->buf_tail;
+}
+
+// Hands the buffers given back since the last call to the kernel.
+static void uring_publish_buffers(struct uring *u) {
+    if (u->buf_ring)
+        atomic_store_explicit((_Atomic unsigned short *)&u->buf_ring->tail, u->buf_tail, memory_order_release);
+}
+
+// Registers a ring of provided buffers (Linux 5.19); without it recv goes straight into
+// each connection's own buffer and multishot recv is off.
+static void uring_setup_buffers(struct uring *u) {
+    size_t ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    struct io_uring_buf_reg reg;
+
+    u->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    u->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!u->buffers || u->buf_ring == MAP_FAILED)
+        goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        goto fail;
+    u->buf_tail = 0;
+    for (unsigned i = 0; i < URING_BUFFERS; ++i)
+        uring_provide(u, (unsigned short)i);
+    uring_publish_buffers(u);
+    return;
+
+fail:
+    if (u->buf_ring != MAP_FAILED && u->buf_ring)
+        munmap(u->buf_ring, ring_size);
+    u->buf_ring = NULL;
+    free(u->buffers);
+    u->buffers = NULL;
+}
+
+static struct uring *uring_new(void) {
+    struct uring *u = calloc(1, sizeof(*u));
+    struct io_uring_params p;
+
+    if (!u)
+        return NULL;
+    u->fd = -1;
+    // A completion ring larger than the submission ring, since multishot requests post many
+    // completions each; the flags only exist on newer kernels, so retry without them.
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd < 0)
+        goto fail;
+    // Without NODROP (5.5) overflowing completions would be lost.
+    if (!(p.features & IORING_FEAT_NODROP))
+        goto fail;
+    u->features = p.features;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    unsigned char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_khead = (unsigned *)(sq + p.sq_off.head);
+    u->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_tail = *u->sq_ktail;
+    u->cq_khead = (unsigned *)(cq + p.cq_off.head);
+    u->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    uring_setup_buffers(u);
+    // Multishot accept (5.19) and recv (6.0) cannot be probed; they are tried and turned
+    // off again when the first request fails with EINVAL.
+    u->multishot_accept = 1;
+    u->multishot_recv = u->buf_ring != NULL;
+    return u;
+
+fail:
+    uring_free(u);
+    return NULL;
+}
+
+// Submits the queued requests; with wait, also blocks for at least one completion.
+static int uring_enter(struct uring *u, int wait) {
+    unsigned to_submit = u->sq_tail - *u->sq_ktail;
+
+    atomic_store_explicit((_Atomic unsigned *)u->sq_ktail, u->sq_tail, memory_order_release);
+    if (to_submit == 0 && !wait)
+        return 0;
+    int ret = sys_io_uring_enter(u->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? -errno : 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)u->sq_khead, memory_order_acquire);
+
+    if (u->sq_tail - head >= u->sq_entries) {
+        // Full: push what is queued to the kernel first.
+        uring_enter(u, 0);
+        head = atomic_load_explicit((_Atomic unsigned *)u->sq_khead, memory_order_acquire);
+        if (u->sq_tail - head >= u->sq_entries)
+            return NULL;
+    }
+    unsigned index = u->sq_tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    ++u->sq_tail;
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep(struct conn *c, unsigned char opcode, unsigned req) {
+    struct io_uring_sqe *sqe = uring_sqe(c->loop->uring);
+
+    if (!sqe)
+        return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = c->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)c | req;
+    ++c->ops;
+    return sqe;
+}
+
+static int uring_arm_recv(struct conn *c) {
+    struct uring *u = c->loop->uring;
+    struct io_uring_sqe *sqe = uring_prep(c, IORING_OP_RECV, REQ_RECV);
+
+    if (!sqe)
+        return -1;
+    if (u->buf_ring) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        if (u->multishot_recv)
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+    } else {
+        // The buffer must not move while the kernel holds it; it only changes when the
+        // completion is handled.
+        size_t room = buffer_reserve(&c->in, READ_CHUNK, c->loop->max_buffer);
+        if (room == 0) {
+            --c->ops;
+            --u->sq_tail;
+            c->closing = 1;
+            return 0;
+        }
+        sqe->addr = (uint64_t)(uintptr_t)(c->in.data + c->in.start + c->in.len);
+        sqe->len = (unsigned)room;
+    }
+    return 0;
+}
+
+static int uring_arm(struct conn *c) {
+    struct uring *u = c->loop->uring;
+    struct io_uring_sqe *sqe;
+
+    switch (c->kind) {
+    case CONN_LISTENER:
+        if (!(sqe = uring_prep(c, IORING_OP_ACCEPT, REQ_ACCEPT)))
+            return -1;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        if (u->multishot_accept)
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        return 0;
+    case CONN_WATCH:
+        if (!(sqe = uring_prep(c, IORING_OP_POLL_ADD, REQ_POLL)))
+            return -1;
+        sqe->poll32_events = POLLIN;
+        return 0;
+    case CONN_CLIENT:
+        return uring_arm_recv(c);
+    }
+    return -1;
+}
+
+static void uring_send(struct conn *c) {
+    struct io_uring_sqe *sqe = uring_prep(c, IORING_OP_SEND, REQ_SEND);
+
+    if (!sqe) {
+        c->closing = 1;
+        c->out.len = 0;
+        c->out_next.len = 0;
+        return;
+    }
+    sqe->addr = (uint64_t)(uintptr_t)(c->out.data + c->out.start);
+    sqe->len = (unsigned)c->out.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->sending = 1;
+}
+
+// Appends received bytes to the connection's buffer and lets the server consume them.
+// With an empty buffer they are handed over in place, and only a partial message at the
+// end is copied.
+static void uring_deliver(struct conn *c, const unsigned char *data, size_t n) {
+    struct event_loop *loop = c->loop;
+    ssize_t used;
+
+    ++c->holds;
+    if (c->in.len == 0 && data != c->in.data + c->in.start) {
+        used = loop->ops->on_data(c, data, n, loop->user);
+        if (used >= 0 && (size_t)used < n) {
+            if (buffer_reserve(&c->in, n - (size_t)used, loop->max_buffer) < n - (size_t)used) {
+                used = -1;
+            } else {
+                memcpy(c->in.data + c->in.start, data + used, n - (size_t)used);
+                c->in.len = n - (size_t)used;
+            }
+        }
+    } else {
+        if (data != c->in.data + c->in.start + c->in.len) {
+            if (buffer_reserve(&c->in, n, loop->max_buffer) < n) {
+                --c->holds;
+                c->closing = 1;
+                return;
+            }
+            memcpy(c->in.data + c->in.start + c->in.len, data, n);
+        }
+        c->in.len += n;
+        used = loop->ops->on_data(c, c->in.data + c->in.start, c->in.len, loop->user);
+        if (used >= 0)
+            buffer_consume(&c->in, (size_t)used);
+    }
+    --c->holds;
+    if (used < 0)
+        c->closing = 1;
+}
+
+static void uring_complete(struct event_loop *loop, struct io_uring_cqe *cqe) {
+    struct uring *u = loop->uring;
+    struct conn *c = (struct conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)REQ_MASK);
+    unsigned req = (unsigned)(cqe->user_data & REQ_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    int res = cqe->res;
+
+    if (!more)
+        --c->ops;
+
+    switch (req) {
+    case REQ_ACCEPT:
+        if (res >= 0) {
+            int one = 1;
+            setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            struct conn *client = conn_add(loop, res, CONN_CLIENT);
+            if (!client) {
+                close(res);
+            } else {
+                if (loop->ops->on_open)
+                    loop->ops->on_open(client, loop->user);
+                if (uring_arm_recv(client) != 0)
+                    client->closing = 1;
+                conn_retire(client);
+            }
+        } else if (res == -EINVAL && u->multishot_accept) {
+            u->multishot_accept = 0;
+        } else if ((res == -EMFILE || res == -ENFILE) && !more) {
+            listener_pause(c);
+            return;
+        }
+        if (!more && !loop->stop)
+            uring_arm(c);
+        return;
+
+    case REQ_POLL:
+        if (!c->dead)
+            c->on_ready(c->data);
+        if (!more && !loop->stop)
+            uring_arm(c);
+        return;
+
+    case REQ_SEND:
+        c->sending = 0;
+        if (res < 0) {
+            c->closing = 1;
+            c->out.len = 0;
+            c->out_next.len = 0;
+        } else {
+            buffer_consume(&c->out, (size_t)res < c->out.len ? (size_t)res : c->out.len);
+            if (c->out.len == 0 && c->out_next.len > 0) {
+                struct buffer t = c->out;
+                c->out = c->out_next;
+                c->out_next = t;
+            }
+            if (c->out.len > 0 && !c->dead)
+                uring_send(c);
+        }
+        break;
+
+    case REQ_RECV:
+        if (res > 0) {
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if (!c->dead && !c->closing)
+                    uring_deliver(c, u->buffers + (size_t)bid * URING_BUFFER_SIZE, (size_t)res);
+                uring_provide(u, bid);
+            } else if (!c->dead && !c->closing) {
+                uring_deliver(c, c->in.data + c->in.start + c->in.len, (size_t)res);
+            }
+            if (!more && !c->dead && !c->closing && uring_arm_recv(c) != 0)
+                c->closing = 1;
+        } else if (res == -ENOBUFS || (res == -EINVAL && u->multishot_recv)) {
+            // Out of provided buffers, or no multishot recv on this kernel: try again
+            // after this batch, when buffers have been given back.
+            if (res == -EINVAL)
+                u->multishot_recv = 0;
+            if (!more && !c->dead && !c->closing) {
+                c->next_rearm = u->rearm;
+                u->rearm = c;
+                ++c->ops;   // keeps c alive until it is re-armed
+            }
+        } else if (!c->dead) {
+            // EOF: queued replies still go out. Errors: nothing more can be sent.
+            c->closing = 1;
+            if (res < 0) {
+                c->out.len = 0;
+                c->out_next.len = 0;
+            }
+        }
+        break;
+    }
+    if (!c->dead)
+        conn_retire(c);
+}
+
+static int uring_run(struct event_loop *loop) {
+    struct uring *u = loop->uring;
+
+    while (!loop->stop) {
+        int ret = uring_enter(u, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+            return -1;
+
+        unsigned head = *u->cq_khead;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)u->cq_ktail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            uring_complete(loop, &u->cqes[head & u->cq_mask]);
+            // Hand slots back as we go, callbacks may queue many new requests.
+            atomic_store_explicit((_Atomic unsigned *)u->cq_khead, head + 1, memory_order_release);
+        }
+        uring_publish_buffers(u);
+
+        while (u->rearm) {
+            struct conn *c = u->rearm;
+            u->rearm = c->next_rearm;
+            --c->ops;
+            if (!c->dead && !c->closing && uring_arm_recv(c) != 0)
+                c->closing = 1;
+            if (!c->dead)
+                conn_retire(c);
+        }
+        free_dead(loop);
+    }
+    return 0;
+}
+
+struct event_loop *event_loop_new_uring(const struct event_loop_ops *ops, void *user, size_t max_buffer) {
+    struct event_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+    loop->epfd = -1;
+    loop->uring = uring_new();
+    if (!loop->uring) {
+        free(loop);
+        return NULL;
+    }
+    loop->ops = ops;
+    loop->user = user;
+    loop->max_buffer = max_buffer;
+    return loop;
+}
+#else
+struct event_loop *event_loop_new_uring(const struct event_loop_ops *ops, void *user, size_t max_buffer) {
+    (void)ops;
+    (void)user;
+    (void)max_buffer;
+    return NULL;
+}
+#endif
+
+long raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return -1;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur == RLIM_INFINITY ? LONG_MAX : (long)rl.rlim_cur;
+}
+
+int tcp_listen(uint16_t port, int backlog) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
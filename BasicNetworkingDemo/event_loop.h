@@ -0,0 +1,68 @@
+// Edge-triggered epoll loop for TCP servers with many concurrent clients
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct event_loop;
+struct conn;
+
+// Callbacks of a server. on_data gets every byte received on a connection and not yet
+// consumed, starting at a message boundary, and returns how many bytes it consumed (a
+// whole number of messages; the rest is kept and handed over again with the next bytes),
+// or -1 to close the connection. on_open and on_close may be NULL.
+struct event_loop_ops {
+    void (*on_open)(struct conn *c, void *user);
+    ssize_t (*on_data)(struct conn *c, const unsigned char *data, size_t len, void *user);
+    void (*on_close)(struct conn *c, void *user);
+};
+
+// max_buffer bounds what a connection may have buffered in either direction; a client
+// that exceeds it (a message that is too large, or not reading its replies) is dropped.
+struct event_loop *event_loop_new(const struct event_loop_ops *ops, void *user, size_t max_buffer);
+// Same loop on io_uring: accept and recv stay armed (multishot, with a shared ring of
+// provided buffers, where the kernel has them) and every round trip to the kernel submits
+// all new requests and collects all completions in one system call. Returns NULL when
+// io_uring is not available (kernels before 5.5, or blocked by seccomp) so the caller can
+// fall back to event_loop_new().
+struct event_loop *event_loop_new_uring(const struct event_loop_ops *ops, void *user, size_t max_buffer);
+void event_loop_free(struct event_loop *loop);
+// "epoll" or "io_uring".
+const char *event_loop_backend(const struct event_loop *loop);
+
+// Adds a listening socket; accepted connections are made non-blocking.
+int event_loop_listen(struct event_loop *loop, int listen_fd);
+// Calls on_ready(arg) on the loop thread whenever fd is readable (level-triggered), e.g.
+// an eventfd that other threads signal or a timerfd.
+int event_loop_watch(struct event_loop *loop, int fd, void (*on_ready)(void *arg), void *arg);
+// Runs until event_loop_stop() is called from a callback or a signal handler. Returns 0,
+// or -1 if epoll itself fails.
+int event_loop_run(struct event_loop *loop);
+void event_loop_stop(struct event_loop *loop);
+
+// Queues bytes for the client; whatever the socket does not take at once is sent when it
+// becomes writable. Returns -1 if that would exceed max_buffer.
+int conn_send(struct conn *c, const void *buf, size_t len);
+// Closes the connection once the callback that asked for it returns.
+void conn_close(struct conn *c);
+int conn_fd(const struct conn *c);
+int conn_closing(const struct conn *c);
+// Keeps c valid past its close, e.g. while a worker thread has a message of it. The
+// connection is released, and on_close called, once every hold is given back. Both are
+// only called on the loop thread.
+void conn_hold(struct conn *c);
+void conn_release(struct conn *c);
+// Per-connection pointer for the server's own state.
+void conn_set_data(struct conn *c, void *data);
+void *conn_data(const struct conn *c);
+
+// Raises the soft limit on open files to the hard limit, since every client takes one
+// (the default of 1024 is far below what the loop can serve). Returns the limit now in
+// force, or -1. When it is reached anyway, listeners pause until a connection closes.
+long raise_fd_limit(void);
+// Creates a non-blocking IPv4 TCP socket listening on port, with SO_REUSEADDR.
+int tcp_listen(uint16_t port, int backlog);
+
+#endif // EVENT_LOOP_H
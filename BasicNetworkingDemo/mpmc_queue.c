@@ -0,0 +1,79 @@
+// Bounded MPMC queue after Dmitry Vyukov's design, see mpmc_queue.h
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mpmc_queue.h"
+
+int mpmc_init(struct mpmc_queue *q, size_t capacity) {
+    size_t n = 2;
+
+    while (n < capacity)
+        n *= 2;
+    q->cells = aligned_alloc(MPMC_CACHE_LINE, (n * sizeof(*q->cells) + MPMC_CACHE_LINE - 1) / MPMC_CACHE_LINE * MPMC_CACHE_LINE);
+    if (!q->cells)
+        return -1;
+    for (size_t i = 0; i < n; ++i)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = n - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    return 0;
+}
+
+void mpmc_destroy(struct mpmc_queue *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+int mpmc_push(struct mpmc_queue *q, void *data) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    for (;;) {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // The cell is free for this ticket; claim the ticket.
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            // Still holds an item from one lap ago: full.
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+void *mpmc_pop(struct mpmc_queue *q) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    for (;;) {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                void *data = cell->data;
+                // Hand the cell to the producer of the next lap.
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return data;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+size_t mpmc_size(struct mpmc_queue *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,37 @@
+// Bounded lock-free multi-producer multi-consumer queue of pointers
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+// Every cell carries a sequence number that says whose turn it is: a producer may fill
+// cell i when its sequence equals the producer's ticket, a consumer may empty it when it
+// equals the ticket + 1. Producers and consumers only contend on their own counter, and
+// the two counters live on separate cache lines.
+struct mpmc_cell {
+    atomic_size_t seq;
+    void *data;
+};
+
+struct mpmc_queue {
+    struct mpmc_cell *cells;
+    size_t mask;
+    alignas(MPMC_CACHE_LINE) atomic_size_t tail;   // next ticket for producers
+    alignas(MPMC_CACHE_LINE) atomic_size_t head;   // next ticket for consumers
+};
+
+// capacity is rounded up to a power of two.
+int mpmc_init(struct mpmc_queue *q, size_t capacity);
+void mpmc_destroy(struct mpmc_queue *q);
+// Both return at once: push fails (-1) when the queue is full, pop returns NULL when it is
+// empty.
+int mpmc_push(struct mpmc_queue *q, void *data);
+void *mpmc_pop(struct mpmc_queue *q);
+// Number of queued items; only a snapshot while other threads are using the queue.
+size_t mpmc_size(struct mpmc_queue *q);
+
+#endif // MPMC_QUEUE_H
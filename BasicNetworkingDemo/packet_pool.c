@@ -0,0 +1,77 @@
+// Packet buffer pool, see packet_pool.h
+#include <stdlib.h>
+
+#include "packet_pool.h"
+
+struct packet_pool *packet_pool_new(size_t buf_size, size_t count) {
+    struct packet_pool *pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+    // Each buffer starts on a cache line, so neighbours never share one.
+    pool->stride = (sizeof(struct packet_buf) + buf_size + MPMC_CACHE_LINE - 1) / MPMC_CACHE_LINE * MPMC_CACHE_LINE;
+    pool->buf_size = buf_size;
+    pool->count = count;
+    pool->slab = aligned_alloc(MPMC_CACHE_LINE, pool->stride * count);
+    if (!pool->slab || mpmc_init(&pool->free_list, count) != 0) {
+        free(pool->slab);
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        struct packet_buf *b = (struct packet_buf *)(pool->slab + i * pool->stride);
+        b->pool = pool;
+        b->size = buf_size;
+        atomic_init(&b->refs, 0);
+        mpmc_push(&pool->free_list, b);
+    }
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    return pool;
+}
+
+void packet_pool_free(struct packet_pool *pool) {
+    if (!pool)
+        return;
+    mpmc_destroy(&pool->free_list);
+    free(pool->slab);
+    free(pool);
+}
+
+struct packet_buf *packet_get(struct packet_pool *pool, size_t size) {
+    struct packet_buf *b = NULL;
+
+    if (size <= pool->buf_size)
+        b = mpmc_pop(&pool->free_list);
+    if (b) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    } else {
+        b = aligned_alloc(MPMC_CACHE_LINE, (sizeof(*b) + size + MPMC_CACHE_LINE - 1) / MPMC_CACHE_LINE * MPMC_CACHE_LINE);
+        if (!b)
+            return NULL;
+        b->pool = NULL;
+        b->size = size;
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+    atomic_init(&b->refs, 1);
+    b->len = 0;
+    return b;
+}
+
+void packet_hold(struct packet_buf *b) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+void packet_put(struct packet_buf *b) {
+    // Release so that the next owner sees every write made under any reference.
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    if (b->pool)
+        mpmc_push(&b->pool->free_list, b);  // cannot be full: it holds at most count buffers
+    else
+        free(b);
+}
+
+size_t packet_pool_in_use(struct packet_pool *pool) {
+    return pool->count - mpmc_size(&pool->free_list);
+}
@@ -0,0 +1,47 @@
+// Pool of fixed-size, cache-line-aligned packet buffers with reference counts
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mpmc_queue.h"
+
+// A buffer is handed out with one reference; whoever holds a reference may read it, and
+// the last packet_put() gives it back. Its bytes are not cleared, neither when it is
+// taken nor when it is returned, so a message costs no memset. data starts on a cache
+// line. Larger requests than the pool's buffer size, and requests while every buffer is
+// out, get a buffer from malloc that behaves the same way.
+struct packet_buf {
+    struct packet_pool *pool;   // NULL for a buffer from malloc
+    atomic_uint refs;
+    size_t size;                // bytes available at data
+    size_t len;                 // bytes in use, for the owner's bookkeeping
+    alignas(MPMC_CACHE_LINE) unsigned char data[];
+};
+
+struct packet_pool {
+    struct mpmc_queue free_list;
+    unsigned char *slab;
+    size_t buf_size;
+    size_t stride;
+    size_t count;
+    atomic_size_t hits;         // served from the slab
+    atomic_size_t misses;       // served from malloc
+};
+
+// Allocates count buffers of buf_size bytes in one slab. Returns NULL when out of memory.
+struct packet_pool *packet_pool_new(size_t buf_size, size_t count);
+// Every buffer of the slab must have been put back.
+void packet_pool_free(struct packet_pool *pool);
+// Returns a buffer of at least size bytes with len 0, or NULL when out of memory. Safe to
+// call from any thread, as are packet_hold() and packet_put().
+struct packet_buf *packet_get(struct packet_pool *pool, size_t size);
+void packet_hold(struct packet_buf *b);
+void packet_put(struct packet_buf *b);
+// Buffers currently handed out from the slab; a snapshot while other threads use the pool.
+size_t packet_pool_in_use(struct packet_pool *pool);
+
+#endif // PACKET_POOL_H
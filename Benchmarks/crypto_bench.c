@@ -0,0 +1,518 @@
+// Throughput benchmark for the TinyAES modes, the OpenSSL encrypt()/decrypt() helpers and
+// the hex codec of the server path. For the hex ops the size is the number of decoded bytes.
+//
+// Every (operation, key size, message size, thread count) combination is timed for at
+// least --min-time seconds and reported as one CSV line or JSON object on stdout:
+// MB/s over all threads, and TSC cycles per byte on x86. Build instructions are in
+// README.md next to this file.
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "../TinyAESEncryption/aes.h"
+#include "../TinyAESEncryption/aes_keyring.h"
+#include "../OpenSSLEncryption/encryption_functions/encrypt.h"
+
+#define MAX_SIZES 32
+#define MAX_THREADS_LIST 16
+#define MIN_SIZE 16
+#define MAX_SIZE ((size_t)64 << 20)
+#define KEYRING_KEYS 64
+#define BATCH_JOBS 64
+#define BATCH_MAX_SIZE ((size_t)64 << 10)   // the batch ops are for small messages
+
+enum op_kind {
+    OP_ECB_ENC,
+    OP_CBC_ENC,
+    OP_CBC_DEC,
+    OP_CTR,
+    OP_CBC_REKEY,
+    OP_CBC_KEYRING,
+    OP_CBC_ENC_BATCH,
+    OP_CBC_DEC_BATCH,
+    OP_OPENSSL_ENC,
+    OP_OPENSSL_DEC,
+    OP_SESSION_ENC,
+    OP_SESSION_DEC,
+    OP_HEX_SET_WORDS,
+    OP_HEX_DECODE,
+    OP_HEX_ENCODE,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "tinyaes-ecb-enc", "tinyaes-cbc-enc", "tinyaes-cbc-dec", "tinyaes-ctr",
+    "tinyaes-cbc-rekey", "tinyaes-cbc-keyring", "tinyaes-cbc-enc-batch", "tinyaes-cbc-dec-batch",
+    "openssl-cbc-enc", "openssl-cbc-dec", "openssl-session-enc", "openssl-session-dec",
+    "hex-set-words", "hex-decode", "hex-encode"
+};
+
+struct options {
+    size_t sizes[MAX_SIZES];
+    int nsizes;
+    int threads[MAX_THREADS_LIST];
+    int nthreads;
+    int ops[OP_COUNT];
+    double min_time;
+    int json;
+};
+
+// State of one benchmark thread. Each thread owns its buffers and context, so the
+// threads only share the memory bus.
+struct worker {
+    pthread_t tid;
+    int op;
+    int key_bits;
+    size_t size;
+    long iterations;
+    unsigned char *in;
+    unsigned char *out;
+    char *hex;           // 2 * size digits for the hex ops
+    size_t in_len;       // ciphertext length for the OpenSSL decrypt case
+    struct AES_ctx ctx;
+    struct crypto_session *session;   // shared by all threads of a run
+    struct AES_keyring *keyring;      // likewise
+    uint32_t key_id;     // next key of the keyring op
+    struct AES_batch_job *jobs;   // BATCH_JOBS messages of size bytes for the batch ops
+    pthread_barrier_t *start;
+    double t0, t1;       // when this thread started and finished its iterations
+    uint64_t tsc0, tsc1;
+};
+
+static const unsigned char bench_key[32] = "0123456789abcdef0123456789abcdef";
+static const unsigned char bench_iv[AES_BLOCKLEN] = "fedcba9876543210";
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t read_tsc(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int tinyaes_init(struct AES_ctx *ctx, int key_bits)
+{
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+    return AES_init_ctx_iv_keylen(ctx, bench_key, key_bits / 8, bench_iv);
+#else
+    if (key_bits != AES_KEYLEN * 8)
+        return -1;
+    AES_init_ctx_iv(ctx, bench_key, bench_iv);
+    return 0;
+#endif
+}
+
+// KEYRING_KEYS keys of key_bits bits that differ in their first byte, so the keyring ops
+// switch key on every message like a server with one key per link.
+static struct AES_keyring *keyring_open(int key_bits)
+{
+    struct AES_keyring *kr = AES_keyring_new(KEYRING_KEYS);
+    unsigned char key[32];
+
+    if (!kr)
+        return NULL;
+    memcpy(key, bench_key, sizeof(key));
+    for (uint32_t id = 0; id < KEYRING_KEYS; ++id) {
+        key[0] = (unsigned char)id;
+        if (AES_keyring_set(kr, id, key, key_bits / 8) != 0) {
+            AES_keyring_free(kr);
+            return NULL;
+        }
+    }
+    return kr;
+}
+
+// The batch ops process BATCH_JOBS messages of the given size per run, each under the
+// next key of the keyring; everything else one message.
+static size_t messages_per_run(int op)
+{
+    return (op == OP_CBC_ENC_BATCH || op == OP_CBC_DEC_BATCH) ? BATCH_JOBS : 1;
+}
+
+// Runs the operation once over the worker's buffer.
+static void run_once(struct worker *w)
+{
+    size_t i;
+
+    switch (w->op) {
+    case OP_ECB_ENC:
+        for (i = 0; i + AES_BLOCKLEN <= w->size; i += AES_BLOCKLEN)
+            AES_ECB_encrypt(&w->ctx, w->out + i);
+        break;
+    case OP_CBC_ENC:
+        AES_CBC_encrypt_buffer_to(&w->ctx, w->out, w->in, w->size);
+        break;
+    case OP_CBC_DEC:
+        AES_CBC_decrypt_buffer_to(&w->ctx, w->out, w->in, w->size);
+        break;
+    case OP_CTR:
+        AES_CTR_xcrypt_buffer_to(&w->ctx, w->out, w->in, w->size);
+        break;
+    case OP_CBC_REKEY:
+        tinyaes_init(&w->ctx, w->key_bits);
+        AES_CBC_decrypt_buffer_to(&w->ctx, w->out, w->in, w->size);
+        break;
+    case OP_CBC_KEYRING:
+        AES_keyring_load_iv(w->keyring, w->key_id++ % KEYRING_KEYS, &w->ctx, bench_iv);
+        AES_CBC_decrypt_buffer_to(&w->ctx, w->out, w->in, w->size);
+        break;
+    case OP_CBC_ENC_BATCH:
+        AES_keyring_bind(w->keyring, w->jobs, BATCH_JOBS);
+        AES_CBC_encrypt_batch(w->jobs, BATCH_JOBS);
+        break;
+    case OP_CBC_DEC_BATCH:
+        AES_keyring_bind(w->keyring, w->jobs, BATCH_JOBS);
+        AES_CBC_decrypt_batch(w->jobs, BATCH_JOBS);
+        break;
+    case OP_OPENSSL_ENC:
+        encrypt(w->in, (int)w->size, (unsigned char *)bench_key, (unsigned char *)bench_iv, w->out);
+        break;
+    case OP_OPENSSL_DEC:
+        decrypt(w->in, (int)w->in_len, (unsigned char *)bench_key, (unsigned char *)bench_iv, w->out);
+        break;
+    case OP_SESSION_ENC:
+        session_encrypt(w->session, bench_iv, w->in, (int)w->size, w->out);
+        break;
+    case OP_SESSION_DEC:
+        session_decrypt(w->session, bench_iv, w->in, (int)w->in_len, w->out);
+        break;
+    case OP_HEX_SET_WORDS:
+        set_words(w->out, w->hex, (int)(2 * w->size));
+        break;
+    case OP_HEX_DECODE:
+        hex_decode(w->out, w->hex, 2 * w->size);
+        break;
+    case OP_HEX_ENCODE:
+        hex_encode(w->hex, w->in, w->size);
+        break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    long i;
+
+    pthread_barrier_wait(w->start);
+    w->t0 = now_seconds();
+    w->tsc0 = read_tsc();
+    for (i = 0; i < w->iterations; ++i)
+        run_once(w);
+    w->tsc1 = read_tsc();
+    w->t1 = now_seconds();
+    return NULL;
+}
+
+static int worker_setup(struct worker *w, int op, int key_bits, size_t size, struct crypto_session *session,
+                        struct AES_keyring *keyring)
+{
+    size_t total = size * messages_per_run(op);
+
+    memset(w, 0, sizeof(*w));
+    w->op = op;
+    w->session = session;
+    w->keyring = keyring;
+    w->key_bits = key_bits;
+    w->size = size;
+    // Room for the padding block encrypt() appends.
+    w->in = malloc(total + AES_BLOCKLEN);
+    w->out = malloc(total + 2 * AES_BLOCKLEN);
+    if (!w->in || !w->out)
+        return -1;
+    for (size_t i = 0; i < total; ++i)
+        w->in[i] = (unsigned char)(i * 131 + 7);
+    memset(w->out, 0, total + 2 * AES_BLOCKLEN);   // fault the pages in before timing
+
+    if (op >= OP_HEX_SET_WORDS) {
+        if (!(w->hex = malloc(2 * size + 1)))
+            return -1;
+        hex_encode(w->hex, w->in, size);
+    }
+    if (op == OP_OPENSSL_DEC || op == OP_SESSION_DEC) {
+        // decrypt() checks the padding, so it needs real ciphertext.
+        w->in_len = encrypt(w->in, (int)size, (unsigned char *)bench_key, (unsigned char *)bench_iv, w->out);
+        memcpy(w->in, w->out, w->in_len);
+    }
+    if (messages_per_run(op) > 1) {
+        if (!(w->jobs = calloc(BATCH_JOBS, sizeof(*w->jobs))))
+            return -1;
+        for (size_t j = 0; j < BATCH_JOBS; ++j) {
+            w->jobs[j].key_id = (uint32_t)(j % KEYRING_KEYS);
+            w->jobs[j].iv = bench_iv;
+            w->jobs[j].in = w->in + j * size;
+            w->jobs[j].out = w->out + j * size;
+            w->jobs[j].length = size;
+        }
+    }
+    if (op < OP_OPENSSL_ENC)
+        return tinyaes_init(&w->ctx, key_bits);
+    return 0;
+}
+
+static void worker_free(struct worker *w)
+{
+    free(w->in);
+    free(w->out);
+    free(w->hex);
+    free(w->jobs);
+}
+
+// Picks an iteration count that runs for about min_time. The probe doubles until it runs
+// long enough for the clock to be meaningful, which also warms up caches and the CPU.
+static long calibrate(struct worker *w, double min_time)
+{
+    long n = 1, i;
+    double t;
+
+    for (;;) {
+        t = now_seconds();
+        for (i = 0; i < n; ++i)
+            run_once(w);
+        t = now_seconds() - t;
+        if (t >= min_time / 16 || n >= (1L << 30))
+            break;
+        n *= 2;
+    }
+    if (t <= 0)
+        t = 1e-9;
+    double scaled = n * (min_time / t);
+    return scaled < 1 ? 1 : (scaled > 1e9 ? 1000000000L : (long)scaled);
+}
+
+static void report(const struct options *opt, int op, int key_bits, size_t size, int threads,
+                   long iterations, double seconds, uint64_t cycles, int *first)
+{
+    double per_run = (double)size * messages_per_run(op);
+    double bytes = per_run * iterations * threads;
+    double mbps = bytes / seconds / 1e6;
+    // TSC cycles per byte as seen by one thread; 0 when there is no TSC.
+    double cpb = HAVE_TSC ? (double)cycles / (per_run * iterations) : 0.0;
+
+    if (opt->json) {
+        printf("%s  {\"op\": \"%s\", \"key_bits\": %d, \"size\": %zu, \"threads\": %d, "
+               "\"iterations\": %ld, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"cycles_per_byte\": %.3f}",
+               *first ? "" : ",\n", op_names[op], key_bits, size, threads, iterations, seconds, mbps, cpb);
+    } else {
+        printf("%s,%d,%zu,%d,%ld,%.6f,%.2f,%.3f\n",
+               op_names[op], key_bits, size, threads, iterations, seconds, mbps, cpb);
+    }
+    *first = 0;
+    fflush(stdout);
+}
+
+static int bench_one(const struct options *opt, int op, int key_bits, size_t size, int threads, int *first)
+{
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    struct crypto_session *session = session_open(bench_key);
+    int keyed = op == OP_CBC_KEYRING || op == OP_CBC_ENC_BATCH || op == OP_CBC_DEC_BATCH;
+    struct AES_keyring *keyring = keyed ? keyring_open(key_bits) : NULL;
+    pthread_barrier_t start;
+    long iterations;
+    int i, err = 0;
+
+    if (!workers || !session || (keyed && !keyring)) {
+        free(workers);
+        session_close(session);
+        AES_keyring_free(keyring);
+        return -1;
+    }
+    for (i = 0; i < threads; ++i) {
+        if (worker_setup(&workers[i], op, key_bits, size, session, keyring) != 0) {
+            err = -1;
+            threads = i + 1;
+            goto out;
+        }
+    }
+
+    iterations = calibrate(&workers[0], opt->min_time);
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; ++i) {
+        workers[i].iterations = iterations;
+        workers[i].start = &start;
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < threads; ++i)
+        pthread_join(workers[i].tid, NULL);
+    pthread_barrier_destroy(&start);
+
+    // Wall time from the first thread starting to the last one finishing; cycles are
+    // averaged over the threads.
+    double t0 = workers[0].t0, t1 = workers[0].t1;
+    uint64_t cycles = 0;
+    for (i = 0; i < threads; ++i) {
+        t0 = workers[i].t0 < t0 ? workers[i].t0 : t0;
+        t1 = workers[i].t1 > t1 ? workers[i].t1 : t1;
+        cycles += (workers[i].tsc1 - workers[i].tsc0) / threads;
+    }
+
+    report(opt, op, key_bits, size, threads, iterations, t1 - t0, cycles, first);
+
+out:
+    for (i = 0; i < threads; ++i)
+        worker_free(&workers[i]);
+    free(workers);
+    session_close(session);
+    AES_keyring_free(keyring);
+    return err;
+}
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        v <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        v <<= 20;
+    return (size_t)v;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--sizes 16,1k,64m] [--max-size N] [--threads 1,2,4] [--ops name,...]\n"
+            "          [--min-time seconds] [--csv | --json]\n"
+            "ops: tinyaes-ecb-enc tinyaes-cbc-enc tinyaes-cbc-dec tinyaes-ctr tinyaes-cbc-rekey tinyaes-cbc-keyring\n"
+            "     tinyaes-cbc-enc-batch tinyaes-cbc-dec-batch openssl-cbc-enc openssl-cbc-dec openssl-session-enc openssl-session-dec hex-set-words hex-decode\n"
+            "     hex-encode\n",
+            prog);
+}
+
+static int parse_args(int argc, char **argv, struct options *opt)
+{
+    size_t max_size = MAX_SIZE;
+    size_t s;
+    int i, k;
+
+    memset(opt, 0, sizeof(*opt));
+    opt->min_time = 0.2;
+    opt->threads[opt->nthreads++] = 1;
+    for (k = 0; k < OP_COUNT; ++k)
+        opt->ops[k] = 1;
+
+    for (i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--json")) {
+            opt->json = 1;
+        } else if (!strcmp(a, "--csv")) {
+            opt->json = 0;
+        } else if (!strcmp(a, "--min-time") && v) {
+            opt->min_time = atof(v);
+            ++i;
+        } else if (!strcmp(a, "--max-size") && v) {
+            max_size = parse_size(v);
+            ++i;
+        } else if (!strcmp(a, "--sizes") && v) {
+            char *list = strdup(v);
+            opt->nsizes = 0;
+            for (char *t = strtok(list, ","); t && opt->nsizes < MAX_SIZES; t = strtok(NULL, ","))
+                opt->sizes[opt->nsizes++] = parse_size(t);
+            free(list);
+            ++i;
+        } else if (!strcmp(a, "--threads") && v) {
+            char *list = strdup(v);
+            opt->nthreads = 0;
+            for (char *t = strtok(list, ","); t && opt->nthreads < MAX_THREADS_LIST; t = strtok(NULL, ","))
+                opt->threads[opt->nthreads++] = atoi(t) > 0 ? atoi(t) : 1;
+            free(list);
+            ++i;
+        } else if (!strcmp(a, "--ops") && v) {
+            char *list = strdup(v);
+            memset(opt->ops, 0, sizeof(opt->ops));
+            for (char *t = strtok(list, ","); t; t = strtok(NULL, ",")) {
+                for (k = 0; k < OP_COUNT; ++k)
+                    if (!strcmp(t, op_names[k]))
+                        break;
+                if (k == OP_COUNT) {
+                    fprintf(stderr, "unknown op %s\n", t);
+                    free(list);
+                    return -1;
+                }
+                opt->ops[k] = 1;
+            }
+            free(list);
+            ++i;
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (opt->nsizes == 0) {
+        // 16 B to 64 MiB in steps of 4x.
+        for (s = MIN_SIZE; s <= max_size && opt->nsizes < MAX_SIZES; s <<= 2)
+            opt->sizes[opt->nsizes++] = s;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt;
+    int key_sizes[] = { 128, 192, 256 };
+    int first = 1;
+    int op, k, s, t;
+
+    if (parse_args(argc, argv, &opt) != 0)
+        return EXIT_FAILURE;
+
+    if (opt.json)
+        printf("[\n");
+    else
+        printf("op,key_bits,size,threads,iterations,seconds,mb_per_s,cycles_per_byte\n");
+
+    for (op = 0; op < OP_COUNT; ++op) {
+        if (!opt.ops[op])
+            continue;
+        for (k = 0; k < 3; ++k) {
+            // The OpenSSL helpers are fixed to AES-128-CBC and the hex ops have no key, so
+            // both run once, as 128; TinyAES only has the compiled-in key size unless it was
+            // built with AES_RUNTIME_KEYLEN=1.
+            if (op >= OP_OPENSSL_ENC && key_sizes[k] != 128)
+                continue;
+            if (op < OP_OPENSSL_ENC && AES_RUNTIME_KEYLEN != 1 && key_sizes[k] != AES_KEYLEN * 8)
+                continue;
+            for (s = 0; s < opt.nsizes; ++s) {
+                // The TinyAES ECB and CBC ops (all but CTR) work on whole blocks.
+                size_t size = opt.sizes[s];
+                if (op < OP_OPENSSL_ENC && op != OP_CTR)
+                    size = (size + AES_BLOCKLEN - 1) / AES_BLOCKLEN * AES_BLOCKLEN;
+                if (messages_per_run(op) > 1 && size > BATCH_MAX_SIZE)
+                    continue;
+                for (t = 0; t < opt.nthreads; ++t) {
+                    if (bench_one(&opt, op, key_sizes[k], size, opt.threads[t], &first) != 0) {
+                        // Not every failure sets errno (a bad key size, a full keyring).
+                        fprintf(stderr, "%s: setup failed for %d-bit keys, %zu bytes, %d threads\n",
+                                op_names[op], key_sizes[k], size, opt.threads[t]);
+                        return EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+
+    if (opt.json)
+        printf("\n]\n");
+    return EXIT_SUCCESS;
+}
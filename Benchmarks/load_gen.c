@@ -0,0 +1,605 @@
+// Load generator for the servers of this repo, on localhost: the TCP echo server
+// (BasicNetworkingDemo/TCP), the UDP server (BasicNetworkingDemo/UDP, started with
+// --reply echo) and the encrypted frame server (OpenSSLEncryption).
+//
+// N connections (or UDP flows) are spread over worker threads, each running its own epoll
+// loop. In closed loop every connection keeps --depth messages outstanding and sends the
+// next one as soon as a reply arrives. In open loop (--rate) messages are sent on a fixed
+// schedule whatever the replies do, and latency is measured from the time a message was
+// due, not from when it could be sent, so a stalled server shows up in the percentiles
+// instead of slowing the generator down. Latencies go into a log-linear histogram with 64
+// sub-buckets per power of two (better than 1.6% resolution), as in HdrHistogram. Build
+// instructions are in README.md next to this file.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../OpenSSLEncryption/encryption_functions/frame.h"
+
+#define TCP_RECORD 80           // the echo server works on 80-byte records
+#define MAX_THREADS 64
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+#define DRAIN_NS 1000000000ull  // how long to wait for replies after the run
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum target { TARGET_TCP, TARGET_UDP, TARGET_FRAME };
+
+static const char *target_names[] = { "tcp", "udp", "frame" };
+
+struct options {
+    enum target target;
+    int port;
+    int conns;
+    int threads;
+    size_t size;
+    double duration;
+    double warmup;
+    double rate;        // messages/s over all connections, 0 for closed loop
+    int depth;
+    int tag_len;
+};
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t n, sum, min, max;
+};
+
+// One connection or UDP flow. Stream replies come back in order, so the send times of
+// the unanswered messages are a FIFO; a UDP reply carries its send time instead.
+struct flow {
+    int fd;
+    int want_write;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len, out_cap;
+    uint64_t *pending;
+    size_t head, count, cap;
+};
+
+struct worker {
+    pthread_t tid;
+    struct flow *flows;
+    int nflows;
+    int epfd;
+    int tfd;                    // wakes the open loop when the next message is due
+    const unsigned char *msg;   // what every message looks like
+    size_t msg_len;
+    size_t reply_len;           // 0 for frames, which carry their own length
+    uint64_t start, measure_from, stop;
+    double rate;
+    struct histogram hist;
+    uint64_t sent, received, measured, dropped, errors;
+};
+
+static struct options opt = { TARGET_TCP, 8080, 1, 1, 0, 10.0, 0.0, 0.0, 1, 0 };
+static const unsigned char *frame_key = (const unsigned char *)"My 16 Bit key ad";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (unsigned)v;
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (unsigned)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Lowest value that falls into bucket i.
+static uint64_t hist_bucket_low(unsigned i)
+{
+    if (i < HIST_SUB)
+        return i;
+    unsigned e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static void hist_record(struct histogram *h, uint64_t v)
+{
+    ++h->counts[hist_index(v)];
+    if (h->n == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    ++h->n;
+    h->sum += v;
+}
+
+static void hist_merge(struct histogram *to, const struct histogram *from)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i)
+        to->counts[i] += from->counts[i];
+    if (from->n && (to->n == 0 || from->min < to->min))
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->n += from->n;
+    to->sum += from->sum;
+}
+
+// The highest value equivalent to the p-th percentile, i.e. the top of its bucket.
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100.0 * h->n + 0.5), seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t top = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) - 1 : h->max;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int pending_push(struct flow *f, uint64_t t)
+{
+    if (f->count == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 64;
+        uint64_t *p = malloc(cap * sizeof(*p));
+        if (!p)
+            return -1;
+        for (size_t i = 0; i < f->count; ++i)
+            p[i] = f->pending[(f->head + i) % f->cap];
+        free(f->pending);
+        f->pending = p;
+        f->head = 0;
+        f->cap = cap;
+    }
+    f->pending[(f->head + f->count++) % f->cap] = t;
+    return 0;
+}
+
+static uint64_t pending_pop(struct flow *f)
+{
+    uint64_t t = f->pending[f->head];
+    f->head = (f->head + 1) % f->cap;
+    --f->count;
+    return t;
+}
+
+static int watch_writable(struct worker *w, struct flow *f, int on)
+{
+    struct epoll_event ev;
+
+    if (f->want_write == on)
+        return 0;
+    f->want_write = on;
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.ptr = f;
+    return epoll_ctl(w->epfd, EPOLL_CTL_MOD, f->fd, &ev);
+}
+
+static int flush_out(struct worker *w, struct flow *f)
+{
+    size_t done = 0;
+
+    while (done < f->out_len) {
+        ssize_t n = send(f->fd, f->out + done, f->out_len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        done += (size_t)n;
+    }
+    memmove(f->out, f->out + done, f->out_len - done);
+    f->out_len -= done;
+    return watch_writable(w, f, f->out_len > 0);
+}
+
+// Sends one message that was due at time due.
+static void send_message(struct worker *w, struct flow *f, uint64_t due)
+{
+    if (opt.target == TARGET_UDP) {
+        unsigned char buf[65536];
+        memcpy(buf, w->msg, w->msg_len);
+        memcpy(buf, &due, sizeof(due));
+        if (send(f->fd, buf, w->msg_len, 0) != (ssize_t)w->msg_len) {
+            ++w->dropped;
+            return;
+        }
+        ++w->sent;
+        return;
+    }
+    if (f->out_len + w->msg_len > f->out_cap) {
+        size_t cap = (f->out_len + w->msg_len) * 2;
+        unsigned char *p = realloc(f->out, cap);
+        if (!p) {
+            ++w->errors;
+            return;
+        }
+        f->out = p;
+        f->out_cap = cap;
+    }
+    memcpy(f->out + f->out_len, w->msg, w->msg_len);
+    f->out_len += w->msg_len;
+    if (pending_push(f, due) != 0 || (!f->want_write && flush_out(w, f) != 0)) {
+        ++w->errors;
+        return;
+    }
+    ++w->sent;
+}
+
+static void record_reply(struct worker *w, struct flow *f, uint64_t sent_at, uint64_t now)
+{
+    ++w->received;
+    if (sent_at >= w->measure_from && sent_at < w->stop) {
+        hist_record(&w->hist, now - sent_at);
+        ++w->measured;
+    }
+    // Closed loop: every reply lets the next message go.
+    if (w->rate == 0 && now < w->stop)
+        send_message(w, f, now);
+}
+
+// Length of the first complete reply in the buffer, 0 if there is none yet.
+static size_t reply_size(struct worker *w, const unsigned char *p, size_t len)
+{
+    struct frame_header h;
+
+    if (w->reply_len)
+        return len >= w->reply_len ? w->reply_len : 0;
+    if (len < FRAME_HEADER_LEN)
+        return 0;
+    if (frame_parse_header(p, &h) != 0)
+        return (size_t)-1;
+    size_t total = FRAME_HEADER_LEN + (size_t)h.length + h.tag_len;
+    return len >= total ? total : 0;
+}
+
+static int read_replies(struct worker *w, struct flow *f)
+{
+    for (;;) {
+        if (opt.target == TARGET_UDP) {
+            unsigned char buf[65536];
+            uint64_t sent_at;
+            ssize_t n = recv(f->fd, buf, sizeof(buf), 0);
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED ? 0 : -1;
+            if ((size_t)n != w->msg_len) {
+                ++w->errors;    // not an echo: the server has to run with --reply echo
+                continue;
+            }
+            memcpy(&sent_at, buf, sizeof(sent_at));
+            record_reply(w, f, sent_at, now_ns());
+            continue;
+        }
+        ssize_t n = recv(f->fd, f->in + f->in_len, READ_CHUNK - f->in_len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        f->in_len += (size_t)n;
+
+        uint64_t now = now_ns();
+        size_t used = 0, k;
+        while ((k = reply_size(w, f->in + used, f->in_len - used)) > 0) {
+            if (k == (size_t)-1 || f->count == 0)
+                return -1;
+            record_reply(w, f, pending_pop(f), now);
+            used += k;
+        }
+        memmove(f->in, f->in + used, f->in_len - used);
+        f->in_len -= used;
+        if (f->in_len == READ_CHUNK)
+            return -1;  // a reply larger than the buffer
+    }
+}
+
+static int outstanding(struct worker *w)
+{
+    if (opt.target == TARGET_UDP)
+        return w->sent > w->received + w->errors;
+    for (int i = 0; i < w->nflows; ++i)
+        if (w->flows[i].fd >= 0 && w->flows[i].count)
+            return 1;
+    return 0;
+}
+
+static void close_flow(struct worker *w, struct flow *f)
+{
+    if (f->fd < 0)
+        return;
+    ++w->errors;
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, f->fd, NULL);
+    close(f->fd);
+    f->fd = -1;
+    f->count = 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t interval = w->rate > 0 ? (uint64_t)(1e9 / w->rate) : 0;
+    uint64_t next_due = w->start;
+    int rr = 0;
+
+    if (w->rate == 0) {
+        for (int i = 0; i < w->nflows; ++i)
+            for (int d = 0; d < opt.depth; ++d)
+                send_message(w, &w->flows[i], w->start);
+    }
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= w->stop && (!outstanding(w) || now >= w->stop + DRAIN_NS))
+            break;
+        // Open loop: send everything that is due, each stamped with its due time, then
+        // sleep until the next one rather than spinning, which would steal the CPU from
+        // the server when both share a machine.
+        if (interval) {
+            while (next_due <= now && next_due < w->stop) {
+                struct flow *f = &w->flows[rr++ % w->nflows];
+                if (f->fd >= 0)
+                    send_message(w, f, next_due);
+                next_due += interval;
+            }
+            if (next_due < w->stop) {
+                struct itimerspec its = { { 0, 0 }, { (time_t)(next_due / 1000000000ull), (long)(next_due % 1000000000ull) } };
+                timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+            }
+        }
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; ++i) {
+            struct flow *f = events[i].data.ptr;
+            if (!f) {
+                uint64_t expirations;
+                ssize_t r = read(w->tfd, &expirations, sizeof(expirations));
+                (void)r;
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && flush_out(w, f) != 0)
+                close_flow(w, f);
+            if (f->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && read_replies(w, f) != 0)
+                close_flow(w, f);
+        }
+    }
+    return NULL;
+}
+
+static int open_flow(struct worker *w, struct flow *f)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int one = 1;
+
+    memset(f, 0, sizeof(*f));
+    f->fd = socket(AF_INET, opt.target == TARGET_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (f->fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)opt.port);
+    if (connect(f->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return -1;
+    if (opt.target != TARGET_UDP) {
+        setsockopt(f->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!(f->in = malloc(READ_CHUNK)))
+            return -1;
+    }
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = f;
+    return epoll_ctl(w->epfd, EPOLL_CTL_ADD, f->fd, &ev);
+}
+
+// Builds the message every connection sends: a record of the echo server, a datagram with
+// room for the send time, or a frame sealed once up front (the server does not care that
+// the IV repeats, and the generator should not spend its time encrypting).
+static unsigned char *build_message(size_t *len, size_t *reply_len)
+{
+    unsigned char *payload = malloc(opt.size), *msg;
+
+    if (!payload)
+        return NULL;
+    memset(payload, 'x', opt.size);
+    if (opt.target != TARGET_FRAME) {
+        *len = opt.size;
+        *reply_len = opt.size;
+        return payload;
+    }
+    msg = malloc(FRAME_SEALED_LEN(opt.size, FRAME_TAG_MAX));
+    int n = msg ? frame_seal(frame_key, opt.tag_len, payload, (int)opt.size, msg) : -1;
+    free(payload);
+    if (n < 0) {
+        free(msg);
+        return NULL;
+    }
+    *len = (size_t)n;
+    *reply_len = 0;
+    return msg;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s tcp|udp|frame [-c connections] [-t threads] [-s size] [-d seconds]\n"
+            "          [--warmup seconds] [--rate msgs_per_s] [--depth N] [--gcm] [--port N]\n",
+            prog);
+}
+
+static int parse_args(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2)
+        goto bad;
+    for (i = 0; i < 3 && strcmp(argv[1], target_names[i]) != 0; ++i)
+        ;
+    if (i == 3)
+        goto bad;
+    opt.target = (enum target)i;
+    for (i = 2; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--gcm")) {
+            opt.tag_len = FRAME_TAG_MAX;
+            continue;
+        }
+        if (!v)
+            goto bad;
+        if (!strcmp(a, "-c"))
+            opt.conns = atoi(v);
+        else if (!strcmp(a, "-t"))
+            opt.threads = atoi(v);
+        else if (!strcmp(a, "-s"))
+            opt.size = (size_t)strtoull(v, NULL, 10);
+        else if (!strcmp(a, "-d"))
+            opt.duration = atof(v);
+        else if (!strcmp(a, "--warmup"))
+            opt.warmup = atof(v);
+        else if (!strcmp(a, "--rate"))
+            opt.rate = atof(v);
+        else if (!strcmp(a, "--depth"))
+            opt.depth = atoi(v);
+        else if (!strcmp(a, "--port"))
+            opt.port = atoi(v);
+        else
+            goto bad;
+        ++i;
+    }
+    if (opt.target == TARGET_TCP) {
+        if (opt.size && opt.size != TCP_RECORD)
+            fprintf(stderr, "the TCP echo server answers %d-byte records, using that size\n", TCP_RECORD);
+        opt.size = TCP_RECORD;
+    }
+    if (opt.size == 0)
+        opt.size = 64;
+    if (opt.target == TARGET_UDP && opt.size < sizeof(uint64_t))
+        opt.size = sizeof(uint64_t);
+    if (opt.conns < 1 || opt.threads < 1 || opt.threads > MAX_THREADS || opt.depth < 1 ||
+        opt.duration <= 0 || opt.size > (opt.target == TARGET_UDP ? 65507 : 16384)) {
+        fprintf(stderr, "bad connection/thread count, depth, duration or size\n");
+        return -1;
+    }
+    if (opt.threads > opt.conns)
+        opt.threads = opt.conns;
+    return 0;
+bad:
+    usage(argv[0]);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    struct histogram *all;
+    size_t msg_len, reply_len;
+    unsigned char *msg;
+
+    if (parse_args(argc, argv) != 0)
+        return EXIT_FAILURE;
+    if (!(msg = build_message(&msg_len, &reply_len))) {
+        fprintf(stderr, "could not build the message\n");
+        return EXIT_FAILURE;
+    }
+    workers = calloc((size_t)opt.threads, sizeof(*workers));
+    all = calloc(1, sizeof(*all));
+    if (!workers || !all)
+        return EXIT_FAILURE;
+
+    for (int t = 0; t < opt.threads; ++t) {
+        struct worker *w = &workers[t];
+        w->nflows = opt.conns / opt.threads + (t < opt.conns % opt.threads);
+        w->flows = calloc((size_t)w->nflows, sizeof(*w->flows));
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        w->msg = msg;
+        w->msg_len = msg_len;
+        w->reply_len = reply_len;
+        w->rate = opt.rate / opt.threads;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (!w->flows || w->epfd < 0 || w->tfd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) != 0)
+            return EXIT_FAILURE;
+        for (int i = 0; i < w->nflows; ++i) {
+            if (open_flow(w, &w->flows[i]) != 0) {
+                fprintf(stderr, "could not connect to 127.0.0.1:%d: %s\n", opt.port, strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < opt.threads; ++t) {
+        workers[t].start = start;
+        workers[t].measure_from = start + (uint64_t)(opt.warmup * 1e9);
+        workers[t].stop = workers[t].measure_from + (uint64_t)(opt.duration * 1e9);
+        pthread_create(&workers[t].tid, NULL, worker_main, &workers[t]);
+    }
+
+    uint64_t sent = 0, received = 0, measured = 0, dropped = 0, errors = 0, unanswered = 0;
+    for (int t = 0; t < opt.threads; ++t) {
+        struct worker *w = &workers[t];
+        pthread_join(w->tid, NULL);
+        hist_merge(all, &w->hist);
+        sent += w->sent;
+        received += w->received;
+        measured += w->measured;
+        dropped += w->dropped;
+        errors += w->errors;
+        for (int i = 0; i < w->nflows; ++i) {
+            unanswered += w->flows[i].count;
+            if (w->flows[i].fd >= 0)
+                close(w->flows[i].fd);
+            free(w->flows[i].in);
+            free(w->flows[i].out);
+            free(w->flows[i].pending);
+        }
+        free(w->flows);
+        close(w->epfd);
+        close(w->tfd);
+    }
+    if (opt.target == TARGET_UDP)
+        unanswered = sent > received + errors ? sent - received - errors : 0;
+
+    if (opt.rate > 0)
+        printf("%s: %d connections on %d threads, %zu-byte messages, open loop at %.0f msgs/s, %.1f s\n",
+               target_names[opt.target], opt.conns, opt.threads, opt.size, opt.rate, opt.duration);
+    else
+        printf("%s: %d connections on %d threads, %zu-byte messages, closed loop with %d in flight, %.1f s\n",
+               target_names[opt.target], opt.conns, opt.threads, opt.size, opt.depth, opt.duration);
+    printf("sent %llu, answered %llu, unanswered %llu, not sent %llu, errors %llu\n",
+           (unsigned long long)sent, (unsigned long long)received, (unsigned long long)unanswered,
+           (unsigned long long)dropped, (unsigned long long)errors);
+    printf("throughput %.0f msgs/s, %.2f MB/s\n", measured / opt.duration,
+           measured * (double)msg_len / opt.duration / 1e6);
+    if (all->n) {
+        printf("latency us: min %.1f mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f\n",
+               all->min / 1e3, (double)all->sum / all->n / 1e3, hist_percentile(all, 50) / 1e3,
+               hist_percentile(all, 90) / 1e3, hist_percentile(all, 99) / 1e3,
+               hist_percentile(all, 99.9) / 1e3, hist_percentile(all, 99.99) / 1e3, all->max / 1e3);
+    }
+    free(all);
+    free(workers);
+    free(msg);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
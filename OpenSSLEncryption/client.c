@@ -7,28 +7,54 @@
 #include <unistd.h> 
 #include <arpa/inet.h>
 
+#include "./encryption_functions/frame.h"
+
 #define MAX 80
 #define PORT 8080
 #define SA struct sockaddr
+
+// Sends each line typed as one frame (see encryption_functions/frame.h) and prints the
+// server's reply frame.
 void func(int sockfd)
 {
+	unsigned char *key = (unsigned char *)"My 16 Bit key ad";
+	unsigned char frame[FRAME_SEALED_LEN(MAX, 0)];
+	unsigned char *payload = malloc(FRAME_MAX_LEN + FRAME_TAG_MAX);
+	unsigned char *reply = malloc(FRAME_MAX_LEN + 1);
+	struct frame_header h;
 	char buff[MAX];
 	int n;
-	while(true) {
-    buffsize = sizeof(buff);
-		bzero(buff, buffsize);
+
+	if (!payload || !reply) {
+		printf("out of memory...\n");
+		goto out;
+	}
+	for (;;) {
 		printf("Enter the string : ");
-		n = 0;
-		while ((buff[n++] = getchar()) != '\n');
-		write(sockfd, buff, buffsize);
-		bzero(buff, buffsize);
-		read(sockfd, buff, buffsize);
-		printf("From Server : %s", buff);
-		if ((strncmp(buff, "exit", 4)) == 0) {
+		if (!fgets(buff, sizeof(buff), stdin))
+			break;
+		n = strcspn(buff, "\n");
+		buff[n] = '\0';
+		n = frame_seal(key, 0, (unsigned char *)buff, n, frame);
+		if (n < 0 || write_full(sockfd, frame, n) != 0)
+			break;
+		if (frame_read(sockfd, &h, payload) != 0)
+			break;
+		n = frame_open(key, &h, payload, reply);
+		if (n < 0) {
+			printf("Reply could not be decrypted\n");
+			continue;
+		}
+		reply[n] = '\0';
+		printf("From Server : %s\n", reply);
+		if ((strncmp((char *)reply, "exit", 4)) == 0) {
 			printf("Client Exit...\n");
 			break;
 		}
 	}
+out:
+	free(payload);
+	free(reply);
 }
 
 int main()
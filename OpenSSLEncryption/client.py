@@ -1,4 +1,3 @@
-from base64 import b64decode
 import socket
 from encryption_functions import encrypt
 
@@ -11,13 +10,10 @@ with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
     while True:
       # String
       user_input = input("Enter data: ")
-      # Also a String
-      user_input = encrypt.encrypt(str.encode(user_input))
-      
-      # Send hex byte array
-      s.sendall((b64decode(user_input).hex()).encode())
-      data = s.recv(10000)
-      response = data.decode()
+
+      # Send one binary frame per message (see encryption_functions/frame.h)
+      s.sendall(encrypt.encrypt_frame(str.encode(user_input)))
+      response = encrypt.read_frame(s).decode()
       print("Client responded with:", response)
       if response == "exit":
-        break
\ No newline at end of file
+        break
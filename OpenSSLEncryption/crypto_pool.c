@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto_pool.h"
+#include "../BasicNetworkingDemo/mpmc_queue.h"
+
+// Latencies go into log2 buckets split into four linear steps each, enough for p50/p99
+// within 25% from nanoseconds to minutes.
+#define SUB_BITS 2
+#define BUCKETS (64 << SUB_BITS)
+
+struct stage_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BUCKETS];
+};
+
+enum { STAGE_QUEUE, STAGE_WORK, STAGE_RETURN, STAGES };
+static const char *stage_names[STAGES] = { "queue", "work", "return" };
+
+struct crypto_pool {
+    struct mpmc_queue jobs;
+    struct mpmc_queue results;
+    sem_t available;             // one count per queued job
+    int have_sem;                // available was initialized
+    int efd;                     // signalled when results are waiting
+    atomic_int wake_pending;     // an eventfd write is outstanding
+    atomic_uint in_flight;
+    atomic_int stop;
+    unsigned capacity;
+    pool_work_fn work;
+    void *arg;
+    int nworkers;                // threads running, which crypto_pool_free() joins
+    pthread_t *threads;
+
+    // Updated by the submitting threads.
+    atomic_size_t max_jobs_depth;
+    atomic_ullong inline_jobs;
+
+    // Owned by the thread collecting results.
+    struct stage_stats stages[STAGES];
+    size_t max_results_depth;
+};
+
+uint64_t pool_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t ns)
+{
+    if (ns < (1u << SUB_BITS))
+        return (unsigned)ns;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(ns);
+    return ((msb - SUB_BITS + 1) << SUB_BITS) | (unsigned)((ns >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+}
+
+// Upper end of a bucket's range.
+static uint64_t bucket_limit(unsigned b)
+{
+    if (b < (1u << SUB_BITS))
+        return b;
+    unsigned msb = (b >> SUB_BITS) + SUB_BITS - 1;
+    uint64_t step = 1ull << (msb - SUB_BITS);
+    return (1ull << msb) + ((b & ((1u << SUB_BITS) - 1)) + 1) * step - 1;
+}
+
+static void stage_add(struct stage_stats *s, uint64_t ns)
+{
+    ++s->count;
+    s->total_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    ++s->buckets[bucket_of(ns)];
+}
+
+static uint64_t stage_percentile(const struct stage_stats *s, double p)
+{
+    uint64_t rank = (uint64_t)(p * (double)s->count), seen = 0;
+
+    for (unsigned b = 0; b < BUCKETS; ++b) {
+        seen += s->buckets[b];
+        if (seen > rank)
+            return bucket_limit(b) < s->max_ns ? bucket_limit(b) : s->max_ns;
+    }
+    return s->max_ns;
+}
+
+static void *worker_main(void *arg)
+{
+    struct crypto_pool *pool = arg;
+
+    for (;;) {
+        while (sem_wait(&pool->available) != 0 && errno == EINTR)
+            ;
+        if (atomic_load(&pool->stop))
+            return NULL;
+        // Each count stands for a pushed job, but with several submitters the head cell may
+        // belong to one that has taken its ticket and not yet filled it, so pop can come
+        // back empty. Dropping the count here would strand a job; wait for the cell instead.
+        struct pool_job *job;
+        while (!(job = mpmc_pop(&pool->jobs)))
+            sched_yield();
+        job->t_start = pool_now_ns();
+        pool->work(job, pool->arg);
+        job->t_done = pool_now_ns();
+        // The results queue holds capacity items, as many as can be in flight.
+        while (mpmc_push(&pool->results, job) != 0)
+            sched_yield();
+        // One eventfd write per batch: the collector clears the flag before it drains.
+        if (!atomic_exchange(&pool->wake_pending, 1)) {
+            uint64_t one = 1;
+            while (write(pool->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+                ;
+        }
+    }
+}
+
+struct crypto_pool *crypto_pool_new(int workers, unsigned capacity, int pin, pool_work_fn work, void *arg)
+{
+    struct crypto_pool *pool = calloc(1, sizeof(*pool));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (!pool)
+        return NULL;
+    if (cpus < 1)
+        cpus = 1;
+    if (workers <= 0)
+        workers = (int)cpus;
+    pool->capacity = capacity;
+    pool->work = work;
+    pool->arg = arg;
+    // crypto_pool_free() undoes only the steps that succeeded.
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->threads = calloc(workers, sizeof(*pool->threads));
+    if (pool->efd < 0 || !pool->threads)
+        goto fail;
+    if (sem_init(&pool->available, 0, 0) != 0)
+        goto fail;
+    pool->have_sem = 1;
+    if (mpmc_init(&pool->jobs, capacity) != 0 || mpmc_init(&pool->results, capacity) != 0)
+        goto fail;
+
+    for (int i = 0; i < workers; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+            goto fail;
+        pool->nworkers = i + 1;
+        if (pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            pthread_setaffinity_np(pool->threads[i], sizeof(set), &set);
+        }
+    }
+    return pool;
+
+fail:
+    crypto_pool_free(pool);
+    return NULL;
+}
+
+// Jobs still in flight are not returned; free the pool only once the results are in.
+void crypto_pool_free(struct crypto_pool *pool)
+{
+    if (!pool)
+        return;
+    atomic_store(&pool->stop, 1);
+    for (int i = 0; i < pool->nworkers; ++i)
+        sem_post(&pool->available);
+    for (int i = 0; i < pool->nworkers; ++i)
+        pthread_join(pool->threads[i], NULL);
+    if (pool->jobs.cells)
+        mpmc_destroy(&pool->jobs);
+    if (pool->results.cells)
+        mpmc_destroy(&pool->results);
+    if (pool->have_sem)
+        sem_destroy(&pool->available);
+    if (pool->efd >= 0)
+        close(pool->efd);
+    free(pool->threads);
+    free(pool);
+}
+
+int crypto_pool_workers(const struct crypto_pool *pool)
+{
+    return pool->nworkers;
+}
+
+int crypto_pool_fd(const struct crypto_pool *pool)
+{
+    return pool->efd;
+}
+
+int crypto_pool_submit(struct crypto_pool *pool, struct pool_job *job)
+{
+    if (atomic_fetch_add(&pool->in_flight, 1) >= pool->capacity) {
+        atomic_fetch_sub(&pool->in_flight, 1);
+        return -1;
+    }
+    job->t_submit = pool_now_ns();
+    if (mpmc_push(&pool->jobs, job) != 0) {
+        atomic_fetch_sub(&pool->in_flight, 1);
+        return -1;
+    }
+    sem_post(&pool->available);
+    size_t depth = mpmc_size(&pool->jobs);
+    size_t max = atomic_load_explicit(&pool->max_jobs_depth, memory_order_relaxed);
+    while (depth > max && !atomic_compare_exchange_weak_explicit(&pool->max_jobs_depth, &max, depth,
+                                                                 memory_order_relaxed, memory_order_relaxed))
+        ;
+    return 0;
+}
+
+struct pool_job *crypto_pool_result(struct crypto_pool *pool)
+{
+    struct pool_job *job = mpmc_pop(&pool->results);
+
+    if (!job) {
+        // Re-arm the wakeup, then look once more for a result that raced with it.
+        uint64_t n;
+        atomic_store(&pool->wake_pending, 0);
+        while (read(pool->efd, &n, sizeof(n)) > 0)
+            ;
+        if (!(job = mpmc_pop(&pool->results)))
+            return NULL;
+    }
+    size_t depth = mpmc_size(&pool->results) + 1;
+    if (depth > pool->max_results_depth)
+        pool->max_results_depth = depth;
+    atomic_fetch_sub(&pool->in_flight, 1);
+
+    uint64_t now = pool_now_ns();
+    stage_add(&pool->stages[STAGE_QUEUE], job->t_start - job->t_submit);
+    stage_add(&pool->stages[STAGE_WORK], job->t_done - job->t_start);
+    stage_add(&pool->stages[STAGE_RETURN], now - job->t_done);
+    return job;
+}
+
+void crypto_pool_note_inline(struct crypto_pool *pool)
+{
+    atomic_fetch_add_explicit(&pool->inline_jobs, 1, memory_order_relaxed);
+}
+
+void crypto_pool_print_stats(struct crypto_pool *pool, FILE *out)
+{
+    fprintf(out, "pool: %d workers, in flight %u/%u, job queue %zu (max %zu), result queue %zu (max %zu), "
+            "run inline %llu\n",
+            pool->nworkers, atomic_load(&pool->in_flight), pool->capacity,
+            mpmc_size(&pool->jobs), atomic_load(&pool->max_jobs_depth),
+            mpmc_size(&pool->results), pool->max_results_depth,
+            (unsigned long long)atomic_load(&pool->inline_jobs));
+    for (int i = 0; i < STAGES; ++i) {
+        const struct stage_stats *s = &pool->stages[i];
+        if (s->count == 0)
+            continue;
+        fprintf(out, "  %-6s n=%llu mean=%.1fus p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+                stage_names[i], (unsigned long long)s->count, s->total_ns / 1e3 / s->count,
+                stage_percentile(s, 0.50) / 1e3, stage_percentile(s, 0.99) / 1e3,
+                stage_percentile(s, 0.999) / 1e3, s->max_ns / 1e3);
+    }
+    memset(pool->stages, 0, sizeof(pool->stages));
+    atomic_store(&pool->max_jobs_depth, 0);
+    pool->max_results_depth = 0;
+    atomic_store(&pool->inline_jobs, 0);
+    fflush(out);
+}
@@ -0,0 +1,46 @@
+#ifndef CRYPTO_POOL_H   /* Include guard */
+#define CRYPTO_POOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Worker threads that take crypto work off the network thread. The network thread submits
+// jobs into a bounded lock-free queue, any idle worker runs them, and finished jobs come
+// back through a second queue; crypto_pool_fd() becomes readable when there are some, so
+// it can sit in the server's epoll set next to the sockets.
+//
+// A job is any struct that starts with a struct pool_job. The pool records when it was
+// submitted, started and finished, and keeps latency statistics for the three stages:
+// waiting for a worker, the work itself, and waiting to be collected.
+struct pool_job {
+    uint64_t t_submit;
+    uint64_t t_start;
+    uint64_t t_done;
+};
+
+typedef void (*pool_work_fn)(struct pool_job *job, void *arg);
+
+struct crypto_pool;
+
+// workers = 0 uses one worker per online CPU; pin binds worker i to CPU i. At most
+// capacity jobs are in flight; beyond that crypto_pool_submit() fails and the caller can
+// run the job itself.
+struct crypto_pool *crypto_pool_new(int workers, unsigned capacity, int pin, pool_work_fn work, void *arg);
+void crypto_pool_free(struct crypto_pool *pool);
+int crypto_pool_workers(const struct crypto_pool *pool);
+
+// Safe to call from several threads at once.
+int crypto_pool_submit(struct crypto_pool *pool, struct pool_job *job);
+// Returns a finished job, or NULL when there is none. Results and statistics belong to one
+// thread, the one that polls crypto_pool_fd().
+struct pool_job *crypto_pool_result(struct crypto_pool *pool);
+int crypto_pool_fd(const struct crypto_pool *pool);
+
+// Counts a job that crypto_pool_submit() turned away and the caller ran itself.
+void crypto_pool_note_inline(struct crypto_pool *pool);
+// Queue depths and per-stage latency percentiles since the last call.
+void crypto_pool_print_stats(struct crypto_pool *pool, FILE *out);
+
+uint64_t pool_now_ns(void);
+
+#endif // CRYPTO_POOL_H
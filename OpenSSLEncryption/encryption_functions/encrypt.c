@@ -1,8 +1,18 @@
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "encrypt.h"
+
 
 void handleErrors(void)
 {
@@ -58,6 +68,197 @@ int decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *key,
     return plaintext_len;
 }
 
+/*
+ * Sessions. encrypt()/decrypt() allocate an EVP context and run the key schedule for
+ * every message. A session instead keeps keyed contexts around and only resets the IV
+ * per message. Each thread that uses a session gets its own pair of contexts, so threads
+ * never share or lock a context. The pairs belong to the session, on a list that threads
+ * push to without a lock, so session_close() frees every key schedule of the session. A
+ * small direct-mapped table per thread finds the thread's pair without walking the list;
+ * the list is only searched when another session took the thread's slot.
+ */
+#define SESSION_SLOTS 8
+
+struct session_ctx {
+    const void *owner;                /* thread_slots of the thread that uses it */
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+    struct session_ctx *next;
+};
+
+struct crypto_session {
+    uint64_t id;                      /* never reused, unlike the session's address */
+    unsigned char key[SESSION_KEY_LEN];
+    struct session_ctx *ctxs;         /* one per thread that used the session */
+};
+
+struct session_slot {
+    uint64_t id;                      /* session of ctx, 0 if none */
+    struct session_ctx *ctx;
+};
+
+static uint64_t next_session_id = 1;
+static pthread_key_t slots_key;
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+static __thread struct session_slot *thread_slots;
+
+/* The contexts stay with their sessions; a new thread whose table lands at the same
+ * address takes them over. */
+static void free_slots(void *arg)
+{
+    free(arg);
+}
+
+static void create_slots_key(void)
+{
+    if (pthread_key_create(&slots_key, free_slots) != 0)
+        handleErrors();
+}
+
+/* Returns this thread's contexts for the session, keying them if needed. */
+static struct session_ctx *session_slot(struct crypto_session *s)
+{
+    if (!thread_slots) {
+        pthread_once(&slots_once, create_slots_key);
+        if (!(thread_slots = calloc(SESSION_SLOTS, sizeof(*thread_slots))))
+            handleErrors();
+        pthread_setspecific(slots_key, thread_slots);
+    }
+
+    struct session_slot *slot = &thread_slots[s->id % SESSION_SLOTS];
+    if (slot->id == s->id)
+        return slot->ctx;
+
+    struct session_ctx *c;
+    for (c = __atomic_load_n(&s->ctxs, __ATOMIC_ACQUIRE); c; c = c->next)
+        if (c->owner == thread_slots)
+            break;
+    if (!c) {
+        if (!(c = calloc(1, sizeof(*c))))
+            handleErrors();
+        if (!(c->enc = EVP_CIPHER_CTX_new()) || !(c->dec = EVP_CIPHER_CTX_new()))
+            handleErrors();
+        if(1 != EVP_EncryptInit_ex(c->enc, EVP_aes_128_cbc(), NULL, s->key, NULL))
+            handleErrors();
+        if(1 != EVP_DecryptInit_ex(c->dec, EVP_aes_128_cbc(), NULL, s->key, NULL))
+            handleErrors();
+        c->owner = thread_slots;
+        c->next = __atomic_load_n(&s->ctxs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&s->ctxs, &c->next, c, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    slot->id = s->id;
+    slot->ctx = c;
+    return c;
+}
+
+struct crypto_session *session_open(const unsigned char *key)
+{
+    struct crypto_session *s = malloc(sizeof(*s));
+    if (!s)
+        return NULL;
+    s->id = __atomic_fetch_add(&next_session_id, 1, __ATOMIC_RELAXED);
+    memcpy(s->key, key, SESSION_KEY_LEN);
+    s->ctxs = NULL;
+    return s;
+}
+
+void session_close(struct crypto_session *s)
+{
+    if (!s)
+        return;
+    /* EVP_CIPHER_CTX_free() cleanses the key schedule. The threads' table entries for
+     * the session are left behind, but its id is never used again. */
+    while (s->ctxs) {
+        struct session_ctx *c = s->ctxs;
+        s->ctxs = c->next;
+        EVP_CIPHER_CTX_free(c->enc);
+        EVP_CIPHER_CTX_free(c->dec);
+        free(c);
+    }
+    OPENSSL_cleanse(s->key, sizeof(s->key));
+    free(s);
+}
+
+static int encrypt_with(EVP_CIPHER_CTX *ctx, const unsigned char *iv,
+                        const unsigned char *plaintext, int plaintext_len, unsigned char *ciphertext)
+{
+    int len;
+    int ciphertext_len;
+
+    /* Only the IV changes; the key schedule from session_slot() is kept. */
+    if(1 != EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+        handleErrors();
+    if(1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len))
+        handleErrors();
+    ciphertext_len = len;
+    if(1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &len))
+        handleErrors();
+    return ciphertext_len + len;
+}
+
+static int decrypt_with(EVP_CIPHER_CTX *ctx, const unsigned char *iv,
+                        const unsigned char *ciphertext, int ciphertext_len, unsigned char *plaintext)
+{
+    int len;
+    int plaintext_len;
+
+    if(1 != EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+        handleErrors();
+    if(1 != EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len))
+        return -1;
+    plaintext_len = len;
+    /* Bad padding means a corrupt or forged message; report it instead of aborting. */
+    if(1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &len))
+        return -1;
+    return plaintext_len + len;
+}
+
+int session_encrypt(struct crypto_session *s, const unsigned char *iv,
+                    const unsigned char *plaintext, int plaintext_len, unsigned char *ciphertext)
+{
+    return encrypt_with(session_slot(s)->enc, iv, plaintext, plaintext_len, ciphertext);
+}
+
+int session_decrypt(struct crypto_session *s, const unsigned char *iv,
+                    const unsigned char *ciphertext, int ciphertext_len, unsigned char *plaintext)
+{
+    return decrypt_with(session_slot(s)->dec, iv, ciphertext, ciphertext_len, plaintext);
+}
+
+void session_encrypt_batch(struct session_job *jobs, size_t count)
+{
+    struct crypto_session *keyed = NULL;
+    EVP_CIPHER_CTX *ctx = NULL;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct session_job *j = &jobs[i];
+        if (j->session != keyed) {
+            ctx = session_slot(j->session)->enc;
+            keyed = j->session;
+        }
+        j->out_len = encrypt_with(ctx, j->iv, j->in, j->in_len, j->out);
+    }
+}
+
+size_t session_decrypt_batch(struct session_job *jobs, size_t count)
+{
+    struct crypto_session *keyed = NULL;
+    EVP_CIPHER_CTX *ctx = NULL;
+    size_t failed = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct session_job *j = &jobs[i];
+        if (j->session != keyed) {
+            ctx = session_slot(j->session)->dec;
+            keyed = j->session;
+        }
+        j->out_len = decrypt_with(ctx, j->iv, j->in, j->in_len, j->out);
+        failed += j->out_len < 0;
+    }
+    return failed;
+}
+
 void print_data(const char *title, const void* data, int len) { 
   printf("%s : ",title); 
   const unsigned char * p = (const unsigned char*)data; 
@@ -92,13 +293,293 @@ void set_words(unsigned char *ciphertext, const char *hex, int len) {
   }
 } 
 
-void decrypt_new_message(const char *encrypted_message, int len, unsigned char *key,
+/*
+ * Hex codec. set_words() above is the original decoder and is kept for comparison in
+ * Benchmarks/crypto_bench.c. The vector paths are picked per call from the CPU features;
+ * the decoders accumulate an "every byte was a hex digit" mask and check it once at the
+ * end, so invalid input costs nothing until then.
+ */
+static int hex_nibble(unsigned char c)
+{
+    unsigned d = c - (unsigned)'0';
+    unsigned l = (c | 0x20u) - (unsigned)'a';
+
+    if (d < 10)
+        return (int)d;
+    if (l < 6)
+        return (int)l + 10;
+    return -1;
+}
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HEX_SSSE3 __attribute__((target("ssse3")))
+#define HEX_AVX2 __attribute__((target("avx2")))
+
+/* Maps each character to its nibble value and clears the lanes of valid that are not
+ * hex digits. Bytes >= 0x80 are negative in the signed compares and fail both ranges. */
+HEX_SSSE3 static inline __attribute__((always_inline)) __m128i hex_nibbles_128(__m128i c, __m128i *valid)
+{
+    __m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+
+    *valid = _mm_and_si128(*valid, _mm_or_si128(digit, alpha));
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                        _mm_and_si128(alpha, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+}
+
+/* Decodes 16 bytes (32 digits) per step: pmaddubsw folds each nibble pair into hi * 16 + lo. */
+HEX_SSSE3 static size_t hex_decode_ssse3(unsigned char *out, const char *hex, size_t n, int *bad)
+{
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i valid = _mm_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i a = hex_nibbles_128(_mm_loadu_si128((const __m128i *)(hex + 2 * i)), &valid);
+        __m128i b = hex_nibbles_128(_mm_loadu_si128((const __m128i *)(hex + 2 * i + 16)), &valid);
+        a = _mm_maddubs_epi16(a, weights);
+        b = _mm_maddubs_epi16(b, weights);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+    }
+    *bad = _mm_movemask_epi8(valid) != 0xFFFF;
+    return i;
+}
+
+HEX_SSSE3 static size_t hex_encode_ssse3(char *out, const unsigned char *in, size_t n)
+{
+    const __m128i table = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(x, 4), low));
+        __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(x, low));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+HEX_AVX2 static inline __attribute__((always_inline)) __m256i hex_nibbles_256(__m256i c, __m256i *valid)
+{
+    __m256i lc = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lc));
+
+    *valid = _mm256_and_si256(*valid, _mm256_or_si256(digit, alpha));
+    return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+                           _mm256_and_si256(alpha, _mm256_sub_epi8(lc, _mm256_set1_epi8('a' - 10))));
+}
+
+/* 32 bytes per step. packus works within 128-bit lanes, so the 64-bit quarters come out
+ * as 0, 2, 1, 3 and are put back in order with vpermq. */
+HEX_AVX2 static size_t hex_decode_avx2(unsigned char *out, const char *hex, size_t n, int *bad)
+{
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    __m256i valid = _mm256_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i a = hex_nibbles_256(_mm256_loadu_si256((const __m256i *)(hex + 2 * i)), &valid);
+        __m256i b = hex_nibbles_256(_mm256_loadu_si256((const __m256i *)(hex + 2 * i + 32)), &valid);
+        a = _mm256_maddubs_epi16(a, weights);
+        b = _mm256_maddubs_epi16(b, weights);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+    }
+    *bad = _mm256_movemask_epi8(valid) != -1;
+    return i;
+}
+
+/* unpack also stays within lanes: lo holds the digits of bytes 0-7 and 16-23, hi those of
+ * 8-15 and 24-31. */
+HEX_AVX2 static size_t hex_encode_avx2(char *out, const unsigned char *in, size_t n)
+{
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low));
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i;
+}
+#endif
+
+long hex_decode(unsigned char *out, const char *hex, size_t len)
+{
+    size_t n = len / 2;
+    size_t i = 0;
+    int bad = 0;
+
+    if (len % 2)
+        return -1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        i = hex_decode_avx2(out, hex, n, &bad);
+    else if (__builtin_cpu_supports("ssse3"))
+        i = hex_decode_ssse3(out, hex, n, &bad);
+#endif
+    for (; i < n; ++i) {
+        int hi = hex_nibble((unsigned char)hex[2 * i]);
+        int lo = hex_nibble((unsigned char)hex[2 * i + 1]);
+        bad |= (hi | lo) < 0;
+        out[i] = (unsigned char)((hi & 0x0F) << 4 | (lo & 0x0F));
+    }
+    return bad ? -1 : (long)n;
+}
+
+void hex_encode(char *out, const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        i = hex_encode_avx2(out, in, len);
+    else if (__builtin_cpu_supports("ssse3"))
+        i = hex_encode_ssse3(out, in, len);
+#endif
+    for (; i < len; ++i) {
+        out[2 * i] = hex_digits[in[i] >> 4];
+        out[2 * i + 1] = hex_digits[in[i] & 0x0F];
+    }
+    out[2 * len] = '\0';
+}
+
+/*
+ * Streaming decryption. The input is fed through a fixed stack buffer (hex is decoded
+ * STREAM_CHUNK bytes at a time) so memory use does not depend on the message size.
+ */
+#define STREAM_CHUNK 4096
+
+int decrypt_stream_init(struct decrypt_stream *st, const unsigned char *key,
+                        const unsigned char *iv, int hex)
+{
+    memset(st, 0, sizeof(*st));
+    st->hex = hex;
+    if (!(st->ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+    if (1 != EVP_DecryptInit_ex(st->ctx, EVP_aes_128_cbc(), NULL, key, iv)) {
+        decrypt_stream_abort(st);
+        return -1;
+    }
+    return 0;
+}
+
+int decrypt_stream_update(struct decrypt_stream *st, const char *in, size_t in_len,
+                          unsigned char *out)
+{
+    unsigned char raw[STREAM_CHUNK];
+    int total = 0;
+    int len;
+
+    if (!st->ctx)
+        return -1;
+    /* The output length is returned as an int; keep room for one block left over. */
+    if ((st->hex ? in_len / 2 : in_len) > (size_t)INT_MAX - 16)
+        goto fail;
+    if (!st->hex) {
+        /* EVP_DecryptUpdate takes an int length, so feed it in chunks. */
+        while (in_len > 0) {
+            int n = in_len > STREAM_CHUNK ? STREAM_CHUNK : (int)in_len;
+            if (1 != EVP_DecryptUpdate(st->ctx, out + total, &len, (const unsigned char *)in, n))
+                goto fail;
+            total += len;
+            in += n;
+            in_len -= n;
+        }
+        return total;
+    }
+
+    /* A hex pair may be split across calls; its first digit waits in st->nibble. */
+    if (st->have_nibble && in_len > 0) {
+        int v = hex_nibble((unsigned char)*in);
+        if (v < 0)
+            goto fail;
+        raw[0] = (unsigned char)(st->nibble << 4 | v);
+        st->have_nibble = 0;
+        if (1 != EVP_DecryptUpdate(st->ctx, out, &len, raw, 1))
+            goto fail;
+        total += len;
+        ++in;
+        --in_len;
+    }
+    while (in_len >= 2) {
+        size_t n = in_len / 2 > STREAM_CHUNK ? STREAM_CHUNK : in_len / 2;
+        if (hex_decode(raw, in, 2 * n) < 0)
+            goto fail;
+        if (1 != EVP_DecryptUpdate(st->ctx, out + total, &len, raw, (int)n))
+            goto fail;
+        total += len;
+        in += 2 * n;
+        in_len -= 2 * n;
+    }
+    if (in_len == 1) {
+        int v = hex_nibble((unsigned char)*in);
+        if (v < 0)
+            goto fail;
+        st->nibble = (unsigned char)v;
+        st->have_nibble = 1;
+    }
+    return total;
+
+fail:
+    decrypt_stream_abort(st);
+    return -1;
+}
+
+int decrypt_stream_final(struct decrypt_stream *st, unsigned char *out)
+{
+    int len = -1;
+
+    if (st->ctx && !st->have_nibble && 1 == EVP_DecryptFinal_ex(st->ctx, out, &len)) {
+        decrypt_stream_abort(st);
+        return len;
+    }
+    decrypt_stream_abort(st);
+    return -1;
+}
+
+void decrypt_stream_abort(struct decrypt_stream *st)
+{
+    EVP_CIPHER_CTX_free(st->ctx);
+    st->ctx = NULL;
+}
+
+int decrypt_new_message(const char *encrypted_message, int len, unsigned char *key,
   unsigned char *iv, unsigned char *plaintext){
-  unsigned char ciphertext[128];
-  memset(ciphertext,'\0',128);
-  set_words(ciphertext, encrypted_message, len);
-  int length = decrypt(ciphertext, len / 2, key, iv, plaintext);
+  struct decrypt_stream st;
+  int n, length;
+
+  plaintext[0] = '\0';
+  if (len < 0 || decrypt_stream_init(&st, key, iv, 1) != 0)
+    return -1;
+  if ((length = decrypt_stream_update(&st, encrypted_message, len, plaintext)) < 0)
+    goto fail;
+  if ((n = decrypt_stream_final(&st, plaintext + length)) < 0)
+    goto fail;
+  length += n;
   plaintext[length] = '\0';
+  return length;
+
+fail:
+  /* Blocks decrypted before the error may already be in plaintext. */
+  plaintext[0] = '\0';
+  return -1;
 }
 
 // int main (void)
@@ -1,7 +1,86 @@
 #ifndef ENCRYPT_H   /* Include guard */
 #define ENCRYPT_H
 
-void decrypt_new_message(const char *encrypted_message, int len, unsigned char *key,
+#include <stddef.h>
+
+// AES-128-CBC with PKCS#7 padding; both return the number of bytes written.
+int encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *key,
+            unsigned char *iv, unsigned char *ciphertext);
+int decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *key,
+            unsigned char *iv, unsigned char *plaintext);
+
+// Sessions keep a keyed AES-128-CBC context per thread, so per message only the IV is
+// set up and nothing is allocated. A session can be used from any number of threads at
+// once; close it only after they are done with it, since session_close() frees (and
+// clears) the contexts of every thread. session_encrypt() returns the
+// ciphertext length. session_decrypt() returns the plaintext length, or -1 when the
+// padding is invalid. The output needs room for ciphertext_len/plaintext_len + 16 bytes.
+#define SESSION_KEY_LEN 16
+
+struct crypto_session;
+
+struct crypto_session *session_open(const unsigned char *key);
+void session_close(struct crypto_session *s);
+int session_encrypt(struct crypto_session *s, const unsigned char *iv,
+                    const unsigned char *plaintext, int plaintext_len, unsigned char *ciphertext);
+int session_decrypt(struct crypto_session *s, const unsigned char *iv,
+                    const unsigned char *ciphertext, int ciphertext_len, unsigned char *plaintext);
+
+// A burst of independent messages, each with its own session (key) and IV; out_len is
+// set to what session_encrypt()/session_decrypt() would return for the job. EVP has no
+// multi-buffer CBC, so the messages still go through one at a time, but runs of jobs on
+// one session share the slot lookup. For interleaved AES-NI rounds across messages see
+// AES_CBC_encrypt_batch() in TinyAES. The decrypt batch returns the number of jobs that
+// failed (out_len -1).
+struct session_job {
+    struct crypto_session *session;
+    const unsigned char *iv;
+    const unsigned char *in;
+    int in_len;
+    unsigned char *out;
+    int out_len;
+};
+
+void session_encrypt_batch(struct session_job *jobs, size_t count);
+size_t session_decrypt_batch(struct session_job *jobs, size_t count);
+
+// Hex codec for the client wire format, vectorized with SSSE3/AVX2 where available.
+// hex_decode() turns len digits (either case) into len / 2 bytes and returns that count,
+// or -1 when len is odd or any character is not a hex digit; out is then unspecified.
+// hex_encode() writes 2 * len lowercase digits followed by a NUL.
+long hex_decode(unsigned char *out, const char *hex, size_t len);
+void hex_encode(char *out, const unsigned char *in, size_t len);
+
+// The original scalar decoder, which maps invalid characters to 0. Kept for the benchmark.
+void set_words(unsigned char *ciphertext, const char *hex, int len);
+
+// Incremental AES-128-CBC decryption of a message that arrives in pieces, as hex text
+// (hex = 1) or raw ciphertext (hex = 0). Every call writes the plaintext it can already
+// produce to out and returns its length. update needs room for in_len + 16 bytes of
+// output (in_len / 2 + 16 for hex), final for 16. A hex pair may be split across calls.
+// One update may produce at most INT_MAX - 16 bytes; longer input is an error.
+// Any error (a non-hex character, a dangling hex digit or bad padding at the end) returns
+// -1 and frees the stream. Use decrypt_stream_abort() to drop a stream before final.
+struct evp_cipher_ctx_st;
+
+struct decrypt_stream {
+    struct evp_cipher_ctx_st *ctx;
+    int hex;
+    int have_nibble;
+    unsigned char nibble;
+};
+
+int decrypt_stream_init(struct decrypt_stream *st, const unsigned char *key,
+                        const unsigned char *iv, int hex);
+int decrypt_stream_update(struct decrypt_stream *st, const char *in, size_t in_len,
+                          unsigned char *out);
+int decrypt_stream_final(struct decrypt_stream *st, unsigned char *out);
+void decrypt_stream_abort(struct decrypt_stream *st);
+
+// Decrypts a whole hex message of len characters into a NUL-terminated plaintext, which
+// needs room for len / 2 + 1 bytes. Returns the plaintext length, or -1 (with an empty
+// plaintext) when the message is not valid hex or does not decrypt.
+int decrypt_new_message(const char *encrypted_message, int len, unsigned char *key,
   unsigned char *iv, unsigned char *plaintext);
 
 #endif // ENCRYPT_H
\ No newline at end of file
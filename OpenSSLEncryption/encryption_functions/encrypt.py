@@ -1,5 +1,7 @@
 from base64 import b64decode, b64encode
+import struct
 from Crypto.Cipher import AES
+from Crypto.Random import get_random_bytes
 from Crypto.Util.Padding import pad, unpad
 
 
@@ -17,6 +19,43 @@ def decrypt(data):
     pt = unpad(cipher.decrypt(ct), AES.block_size)
     return pt.decode('utf-8')
 
+# Binary frames, see frame.h: big-endian ciphertext length, version, tag length (0 for
+# CBC, 12..16 for GCM), two reserved bytes and a 16-byte IV, then ciphertext and tag.
+FRAME_VERSION = 1
+FRAME_HEADER = struct.Struct(">IBBH16s")
+FRAME_MAX_LEN = 1 << 20
+
+def encrypt_frame(data, tag_len=0):
+    if tag_len:
+        iv = get_random_bytes(12)
+        cipher = AES.new(KEY, AES.MODE_GCM, nonce=iv, mac_len=tag_len)
+        ct, tag = cipher.encrypt_and_digest(data)
+    else:
+        iv = get_random_bytes(16)
+        ct, tag = AES.new(KEY, AES.MODE_CBC, iv).encrypt(pad(data, AES.block_size)), b""
+    return FRAME_HEADER.pack(len(ct), FRAME_VERSION, tag_len, 0, iv.ljust(16, b"\0")) + ct + tag
+
+def _recv_exact(sock, n):
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("connection closed mid-frame")
+        buf += chunk
+    return bytes(buf)
+
+# Reads one frame from sock and returns its plaintext; raises ValueError if it does not
+# decrypt.
+def read_frame(sock):
+    length, version, tag_len, reserved, iv = FRAME_HEADER.unpack(_recv_exact(sock, FRAME_HEADER.size))
+    if version != FRAME_VERSION or reserved or length > FRAME_MAX_LEN:
+        raise ValueError("bad frame header")
+    ct = _recv_exact(sock, length)
+    tag = _recv_exact(sock, tag_len)
+    if tag_len:
+        return AES.new(KEY, AES.MODE_GCM, nonce=iv[:12], mac_len=tag_len).decrypt_and_verify(ct, tag)
+    return unpad(AES.new(KEY, AES.MODE_CBC, iv).decrypt(ct), AES.block_size)
+
 # idk = encrypt(data)
 # length = str(b64decode(idk).hex())
 # print(length)
\ No newline at end of file
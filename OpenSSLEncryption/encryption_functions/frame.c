@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "frame.h"
+
+
+int frame_parse_header(const unsigned char *buf, struct frame_header *h)
+{
+    h->length = (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+    h->tag_len = buf[5];
+    memcpy(h->iv, buf + 8, FRAME_IV_LEN);
+
+    if (buf[4] != FRAME_VERSION || buf[6] != 0 || buf[7] != 0)
+        return -1;
+    if (h->length > FRAME_MAX_LEN)
+        return -1;
+    if (h->tag_len == 0)
+        return (h->length == 0 || h->length % 16 != 0) ? -1 : 0;
+    return (h->tag_len < 12 || h->tag_len > FRAME_TAG_MAX) ? -1 : 0;
+}
+
+void frame_write_header(unsigned char *buf, const struct frame_header *h)
+{
+    buf[0] = (unsigned char)(h->length >> 24);
+    buf[1] = (unsigned char)(h->length >> 16);
+    buf[2] = (unsigned char)(h->length >> 8);
+    buf[3] = (unsigned char)h->length;
+    buf[4] = FRAME_VERSION;
+    buf[5] = h->tag_len;
+    buf[6] = 0;
+    buf[7] = 0;
+    memcpy(buf + 8, h->iv, FRAME_IV_LEN);
+}
+
+static const EVP_CIPHER *frame_cipher(int tag_len)
+{
+    return tag_len ? EVP_aes_128_gcm() : EVP_aes_128_cbc();
+}
+
+int frame_seal(const unsigned char *key, int tag_len, const unsigned char *plaintext,
+               int plaintext_len, unsigned char *frame)
+{
+    struct frame_header h;
+    EVP_CIPHER_CTX *ctx;
+    unsigned char *ct = frame + FRAME_HEADER_LEN;
+    int len, ct_len;
+
+    if ((tag_len != 0 && (tag_len < 12 || tag_len > FRAME_TAG_MAX)) || plaintext_len < 0 ||
+        FRAME_SEALED_LEN(plaintext_len, 0) - FRAME_HEADER_LEN > FRAME_MAX_LEN)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    h.tag_len = (uint8_t)tag_len;
+    if (1 != RAND_bytes(h.iv, tag_len ? FRAME_GCM_IV_LEN : FRAME_IV_LEN))
+        return -1;
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if(1 != EVP_EncryptInit_ex(ctx, frame_cipher(tag_len), NULL, key, h.iv))
+        goto out;
+    if(1 != EVP_EncryptUpdate(ctx, ct, &len, plaintext, plaintext_len))
+        goto out;
+    ct_len = len;
+    if(1 != EVP_EncryptFinal_ex(ctx, ct + ct_len, &len))
+        goto out;
+    ct_len += len;
+    if(tag_len && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_len, ct + ct_len))
+        goto out;
+
+    h.length = (uint32_t)ct_len;
+    frame_write_header(frame, &h);
+    EVP_CIPHER_CTX_free(ctx);
+    return FRAME_HEADER_LEN + ct_len + tag_len;
+
+out:
+    EVP_CIPHER_CTX_free(ctx);
+    return -1;
+}
+
+int frame_open(const unsigned char *key, const struct frame_header *h,
+               const unsigned char *payload, unsigned char *plaintext)
+{
+    EVP_CIPHER_CTX *ctx;
+    int len, plaintext_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+    if(1 != EVP_DecryptInit_ex(ctx, frame_cipher(h->tag_len), NULL, key, h->iv))
+        goto out;
+    if(1 != EVP_DecryptUpdate(ctx, plaintext, &len, payload, (int)h->length))
+        goto out;
+    // The tag follows the ciphertext and has to be set before Final checks it.
+    if(h->tag_len && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, h->tag_len,
+                                              (void *)(payload + h->length)))
+        goto out;
+    if(1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &plaintext_len))
+        goto out;
+    plaintext_len += len;
+
+out:
+    EVP_CIPHER_CTX_free(ctx);
+    return plaintext_len;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int frame_read(int fd, struct frame_header *h, unsigned char *payload)
+{
+    unsigned char header[FRAME_HEADER_LEN];
+
+    if (read_full(fd, header, sizeof(header)) != 0 || frame_parse_header(header, h) != 0)
+        return -1;
+    return read_full(fd, payload, h->length + h->tag_len);
+}
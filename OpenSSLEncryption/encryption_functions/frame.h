@@ -0,0 +1,57 @@
+#ifndef FRAME_H   /* Include guard */
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary frame used between the clients and the server, in both directions:
+//
+//   offset  size  field
+//        0     4  length of the ciphertext in bytes, big-endian
+//        4     1  version, FRAME_VERSION
+//        5     1  tag length: 0 for AES-128-CBC with PKCS#7 padding, 12..16 for AES-128-GCM
+//        6     2  reserved, 0
+//        8    16  IV, fresh for every frame (GCM uses the first 12 bytes)
+//       24     n  ciphertext
+//     24+n     t  GCM tag, when the tag length is not 0
+//
+// The length says where a frame ends, so several frames may arrive in one read() or one
+// frame across many.
+#define FRAME_VERSION 1
+#define FRAME_HEADER_LEN 24
+#define FRAME_IV_LEN 16
+#define FRAME_GCM_IV_LEN 12
+#define FRAME_TAG_MAX 16
+#define FRAME_MAX_LEN (1u << 20)
+
+struct frame_header {
+    uint32_t length;
+    uint8_t tag_len;
+    unsigned char iv[FRAME_IV_LEN];
+};
+
+// Bytes of a frame carrying plaintext_len bytes, i.e. the buffer frame_seal() needs.
+#define FRAME_SEALED_LEN(plaintext_len, tag_len) \
+    (FRAME_HEADER_LEN + (size_t)(plaintext_len) + 16 + (size_t)(tag_len))
+
+// Parses the first FRAME_HEADER_LEN bytes of buf. Returns -1 for an unknown version, a bad
+// tag length, or a length that is over FRAME_MAX_LEN or not whole CBC blocks.
+int frame_parse_header(const unsigned char *buf, struct frame_header *h);
+void frame_write_header(unsigned char *buf, const struct frame_header *h);
+
+// Encrypts plaintext under a random IV into a complete frame and returns its length.
+int frame_seal(const unsigned char *key, int tag_len, const unsigned char *plaintext,
+               int plaintext_len, unsigned char *frame);
+// Decrypts the ciphertext (followed by the tag, if any) of a parsed frame. Returns the
+// plaintext length, or -1 when the padding or tag is wrong. plaintext needs h->length bytes
+// and may be payload itself, to decrypt in place.
+int frame_open(const unsigned char *key, const struct frame_header *h,
+               const unsigned char *payload, unsigned char *plaintext);
+
+// Blocking socket helpers that retry on short reads and writes. frame_read() reads one
+// frame into payload, which needs room for FRAME_MAX_LEN + FRAME_TAG_MAX bytes, and
+// returns 0, or -1 on EOF, a socket error or a malformed header.
+int frame_read(int fd, struct frame_header *h, unsigned char *payload);
+int write_full(int fd, const void *buf, size_t len);
+
+#endif // FRAME_H
@@ -8,55 +8,79 @@
 #include <sys/types.h>
 #include <fcntl.h> 
 #include <unistd.h> 
+#include <sys/timerfd.h>
 
 #include "./encryption_functions/encrypt.h"
+#include "./encryption_functions/frame.h"
+#include "../BasicNetworkingDemo/event_loop.h"
+#include "../BasicNetworkingDemo/packet_pool.h"
+#include "crypto_pool.h"
 
 #define MAX 10000
 #define PORT 8080
 #define SA struct sockaddr
+#define BACKLOG 1024
+#define PACKET_SIZE 2048
+#define LARGE_PACKETS 16        // buffers for frames over PACKET_SIZE, up to FRAME_MAX_LEN
 
 
-// Function designed for chat between client and server.
+// Function designed for chat between client and server. Every message in either
+// direction is one frame (see encryption_functions/frame.h).
 void func(int connfd)
 {
     unsigned char *key = (unsigned char *)"My 16 Bit key ad";
-    /* A 128 bit IV */
-    unsigned char *iv = (unsigned char *)"0000000000000000";
+    struct frame_header h;
+    unsigned char *payload = malloc(FRAME_MAX_LEN + FRAME_TAG_MAX);
+    unsigned char *output = malloc(FRAME_MAX_LEN + 1);
+    unsigned char reply[FRAME_SEALED_LEN(MAX, FRAME_TAG_MAX)];
     char buff[MAX];
     int n;
+
+    if (!payload || !output) {
+        printf("out of memory...\n");
+        goto out;
+    }
     // infinite loop for chat
     for (;;) {
-        bzero(buff, MAX);
-   
-        // read the message from client and copy it in buffer
-        int length = read(connfd, buff, sizeof(buff));
-        // printf("ENCRYPTED MESSAGE RECEIVED: %s\n", buff);
-        unsigned char output[10000];
-        memset(output,'\0',10000);
-        decrypt_new_message(buff, length, key, iv, output);
+        // read one whole frame from the client, however the bytes were split up
+        if (frame_read(connfd, &h, payload) != 0)
+            break;
+        int length = frame_open(key, &h, payload, output);
         // print buffer which contains the client contents
-        printf("Decrypted Message: %s\n", output);
+        if (length < 0) {
+            printf("Message could not be decrypted\n");
+        } else {
+            output[length] = '\0';
+            printf("Decrypted Message: %s\n", output);
+        }
         printf("To client: ");
-        bzero(buff, MAX);
         n = 0;
         // copy server message in the buffer
-        while ((buff[n++] = getchar()) != '\n')
+        while (n < MAX - 1 && (buff[n++] = getchar()) != '\n')
             ;
-   
-        // and send that buffer to client
-        write(connfd, buff, sizeof(buff));
-   
+        if (n > 0 && buff[n - 1] == '\n')
+            --n;
+        buff[n] = '\0';
+
+        // and send it to the client, encrypted the same way as the message came in
+        int reply_len = frame_seal(key, h.tag_len, (unsigned char *)buff, n, reply);
+        if (reply_len < 0 || write_full(connfd, reply, reply_len) != 0)
+            break;
+
         // if msg contains "Exit" then server exit and chat ended.
         if (strncmp("exit", buff, 4) == 0) {
             printf("Server Exit...\n");
             break;
         }
     }
+out:
+    free(payload);
+    free(output);
 }
    
-// Driver function
-int main()
-{	
+// Interactive server: one client, and every reply is typed in on stdin.
+void chat_server(void)
+{
     int sockfd, connfd, len;
     struct sockaddr_in servaddr, cli;
    
@@ -106,4 +130,269 @@ int main()
    
     // After chatting close the socket
     close(sockfd);
-}
\ No newline at end of file
+}
+
+static const unsigned char *server_key = (const unsigned char *)"My 16 Bit key ad";
+static int quiet;
+static struct crypto_pool *pool;
+static struct packet_pool *packets;
+static struct packet_pool *large_packets;
+
+// One received frame on its way through a worker. It lives at the start of a pooled
+// packet buffer, followed by the payload (ciphertext and tag), which is decrypted in place.
+struct decrypt_job {
+    struct pool_job base;
+    struct conn *conn;
+    uint32_t seq;
+    struct frame_header h;
+    int plaintext_len;          // -1 when the frame does not decrypt
+    int reply_len;
+    unsigned char reply[FRAME_SEALED_LEN(4, FRAME_TAG_MAX)];
+    struct decrypt_job *next;
+    struct packet_buf *buf;
+    unsigned char data[];
+};
+
+// Per-connection state. Workers finish frames in any order; replies go out in the order
+// the frames came in, so early finishers wait in a list sorted by sequence number.
+struct client {
+    uint32_t next_seq;
+    uint32_t next_reply;
+    struct decrypt_job *waiting;
+};
+
+// Runs on a worker (or inline): decrypts the frame and seals the answer, "ok", or "exit"
+// when the client sent exit.
+static void decrypt_work(struct pool_job *base, void *arg)
+{
+    struct decrypt_job *job = (struct decrypt_job *)base;
+    const char *answer = "ok";
+
+    (void)arg;
+    job->reply_len = -1;
+    job->plaintext_len = frame_open(server_key, &job->h, job->data, job->data);
+    if (job->plaintext_len < 0)
+        return;
+    job->data[job->plaintext_len] = '\0';
+    if (strncmp("exit", (char *)job->data, 4) == 0)
+        answer = "exit";
+    job->reply_len = frame_seal(server_key, job->h.tag_len, (const unsigned char *)answer,
+                                (int)strlen(answer), job->reply);
+}
+
+static void send_reply(struct conn *c, struct decrypt_job *job)
+{
+    if (conn_closing(c))
+        return;
+    if (job->plaintext_len < 0) {
+        printf("[%d] Message could not be decrypted\n", conn_fd(c));
+        conn_close(c);
+        return;
+    }
+    if (!quiet)
+        printf("[%d] Decrypted Message: %s\n", conn_fd(c), (char *)job->data);
+    if (job->reply_len < 0 || conn_send(c, job->reply, job->reply_len) != 0)
+        conn_close(c);
+    else if (strncmp("exit", (char *)job->data, 4) == 0)
+        conn_close(c);
+}
+
+// Takes a finished job on the loop thread and sends every reply that is now in order.
+static void deliver(struct decrypt_job *job)
+{
+    struct conn *c = job->conn;
+    struct client *cl = conn_data(c);
+    struct decrypt_job **p = &cl->waiting;
+    int sent = 0;
+
+    while (*p && (int32_t)((*p)->seq - job->seq) < 0)
+        p = &(*p)->next;
+    job->next = *p;
+    *p = job;
+
+    while (cl->waiting && cl->waiting->seq == cl->next_reply) {
+        job = cl->waiting;
+        cl->waiting = job->next;
+        ++cl->next_reply;
+        send_reply(c, job);
+        packet_put(job->buf);
+        ++sent;
+    }
+    // Each job held the connection; the last release may close it, so it goes last.
+    while (sent-- > 0)
+        conn_release(c);
+}
+
+static void collect_results(void *arg)
+{
+    struct pool_job *job;
+
+    (void)arg;
+    while ((job = crypto_pool_result(pool)))
+        deliver((struct decrypt_job *)job);
+}
+
+static void print_stats(void *arg)
+{
+    int tfd = *(int *)arg;
+    uint64_t expirations;
+
+    if (read(tfd, &expirations, sizeof(expirations)) > 0) {
+        crypto_pool_print_stats(pool, stdout);
+        printf("packet buffers: %zu in use, %zu pooled, %zu from malloc\n", packet_pool_in_use(packets),
+               atomic_load_explicit(&packets->hits, memory_order_relaxed),
+               atomic_load_explicit(&packets->misses, memory_order_relaxed));
+        printf("large buffers: %zu in use, %zu pooled, %zu from malloc\n", packet_pool_in_use(large_packets),
+               atomic_load_explicit(&large_packets->hits, memory_order_relaxed),
+               atomic_load_explicit(&large_packets->misses, memory_order_relaxed));
+    }
+}
+
+static void on_open(struct conn *c, void *user)
+{
+    (void)user;
+    struct client *cl = calloc(1, sizeof(*cl));
+    if (!cl)
+        conn_close(c);
+    conn_set_data(c, cl);
+}
+
+static void on_close(struct conn *c, void *user)
+{
+    (void)user;
+    free(conn_data(c));
+}
+
+// Splits the buffered bytes of a connection into frames and hands each one to the worker
+// pool; a partial frame stays buffered until the rest arrives. When every worker is busy
+// and the queue is full, the frame is decrypted right here instead.
+static ssize_t on_data(struct conn *c, const unsigned char *data, size_t len, void *user)
+{
+    struct client *cl = conn_data(c);
+    struct frame_header h;
+    size_t used = 0;
+
+    (void)user;
+    if (!cl)
+        return -1;
+    // Nothing after an exit, or a frame that failed inline, gets an answer.
+    while (len - used >= FRAME_HEADER_LEN && !conn_closing(c)) {
+        if (frame_parse_header(data + used, &h) != 0)
+            return -1;
+        size_t payload = (size_t)h.length + h.tag_len;
+        if (len - used < FRAME_HEADER_LEN + payload)
+            break;
+        // The frame is copied once, out of the connection's input buffer; the plaintext
+        // needs one byte more than the ciphertext for its terminator.
+        size_t need = sizeof(struct decrypt_job) + payload + 1;
+        struct packet_buf *b = packet_get(need <= PACKET_SIZE ? packets : large_packets, need);
+        if (!b)
+            return -1;
+        struct decrypt_job *job = (struct decrypt_job *)b->data;
+        job->buf = b;
+        job->conn = c;
+        job->seq = cl->next_seq++;
+        job->h = h;
+        memcpy(job->data, data + used + FRAME_HEADER_LEN, payload);
+        conn_hold(c);
+        if (!pool || crypto_pool_submit(pool, &job->base) != 0) {
+            if (pool)
+                crypto_pool_note_inline(pool);
+            decrypt_work(&job->base, NULL);
+            deliver(job);
+        }
+        used += FRAME_HEADER_LEN + payload;
+    }
+    return (ssize_t)used;
+}
+
+// Decoder server: any number of clients with epoll on one network thread, decryption on
+// a pool of worker threads, no stdin involved.
+int decoder_server(int uring, int workers, unsigned queue, int pin, int stats_interval)
+{
+    static const struct event_loop_ops ops = { on_open, on_data, on_close };
+    const size_t max_buffer = FRAME_HEADER_LEN + FRAME_MAX_LEN + FRAME_TAG_MAX;
+    struct event_loop *loop = NULL;
+    int sockfd = tcp_listen(PORT, BACKLOG);
+    static int tfd = -1;
+
+    raise_fd_limit();
+    // Enough buffers for every frame a worker may hold; more are taken from malloc. Large
+    // frames are rare, so a few buffers of the largest frame size cover them; their pages
+    // are only touched once they are used.
+    packets = packet_pool_new(PACKET_SIZE, (size_t)queue * 2);
+    large_packets = packet_pool_new(sizeof(struct decrypt_job) + FRAME_MAX_LEN + FRAME_TAG_MAX + 1, LARGE_PACKETS);
+    if (!packets || !large_packets) {
+        printf("Could not allocate packet buffers...\n");
+        return 1;
+    }
+
+    if (uring && !(loop = event_loop_new_uring(&ops, NULL, max_buffer)))
+        printf("io_uring is not available, using epoll..\n");
+    if (!loop)
+        loop = event_loop_new(&ops, NULL, max_buffer);
+    if (!loop || sockfd < 0 || event_loop_listen(loop, sockfd) != 0) {
+        printf("Listen failed...\n");
+        return 1;
+    }
+    if (workers >= 0) {
+        pool = crypto_pool_new(workers, queue, pin, decrypt_work, NULL);
+        if (!pool || event_loop_watch(loop, crypto_pool_fd(pool), collect_results, NULL) != 0) {
+            printf("Could not start the worker threads...\n");
+            return 1;
+        }
+        if (stats_interval > 0) {
+            struct itimerspec its = { { stats_interval, 0 }, { stats_interval, 0 } };
+            tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) != 0 ||
+                event_loop_watch(loop, tfd, print_stats, &tfd) != 0)
+                printf("Statistics are not available...\n");
+        }
+        printf("Decrypting on %d worker threads..\n", crypto_pool_workers(pool));
+    }
+    printf("Server listening on port %d (%s)..\n", PORT, event_loop_backend(loop));
+    int ret = event_loop_run(loop);
+    event_loop_free(loop);
+    crypto_pool_free(pool);
+    packet_pool_free(packets);
+    packet_pool_free(large_packets);
+    close(sockfd);
+    return ret == 0 ? 0 : 1;
+}
+
+// Driver function.
+//   --chat         the original interactive single-client server
+//   --uring        io_uring instead of epoll, where the kernel has it
+//   -q             do not print every message
+//   --workers N    decryption threads, 0 for one per CPU (the default); -1 decrypts on
+//                  the network thread
+//   --queue N      frames in flight before the network thread decrypts them itself
+//   --pin          bind worker i to CPU i
+//   --stats SEC    print queue depths and per-stage latencies every SEC seconds
+int main(int argc, char **argv)
+{
+    int chat = 0, uring = 0, workers = 0, pin = 0, stats_interval = 0;
+    unsigned queue = 4096;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--chat") == 0)
+            chat = 1;
+        else if (strcmp(argv[i], "--uring") == 0)
+            uring = 1;
+        else if (strcmp(argv[i], "-q") == 0)
+            quiet = 1;
+        else if (strcmp(argv[i], "--pin") == 0)
+            pin = 1;
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+            queue = (unsigned)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            stats_interval = atoi(argv[++i]);
+    }
+    if (chat) {
+        chat_server();
+        return 0;
+    }
+    return decoder_server(uring, workers, queue > 0 ? queue : 1, pin, stats_interval);
+}
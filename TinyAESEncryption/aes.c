@@ -37,6 +37,16 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
+#include "aes_internal.h"
+
+#if AES_NI
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(GCM) && (GCM == 1)
+#include <tmmintrin.h>
+#endif
+#endif
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -44,17 +54,34 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 // The number of columns comprising a state in AES. This is a constant in AES. Value=4
 #define Nb 4
 
+// Key size selected at compile time (AES128/AES192/AES256 in aes.h). The functions below
+// take Nk/Nr as parameters so that a context can also carry its own key size, see
+// AES_RUNTIME_KEYLEN.
 #if defined(AES256) && (AES256 == 1)
-    #define Nk 8
-    #define Nr 14
+    #define DefaultNk 8
+    #define DefaultNr 14
 #elif defined(AES192) && (AES192 == 1)
-    #define Nk 6
-    #define Nr 12
+    #define DefaultNk 6
+    #define DefaultNr 12
+#else
+    #define DefaultNk 4        // The number of 32 bit words in a key.
+    #define DefaultNr 10       // The number of rounds in AES Cipher.
+#endif
+
+#if AES_RUNTIME_KEYLEN
+  #define NrOf(ctx) ((ctx)->Nr)
 #else
-    #define Nk 4        // The number of 32 bit words in a key.
-    #define Nr 10       // The number of rounds in AES Cipher.
+  #define NrOf(ctx) DefaultNr
 #endif
 
+// Only the AES-NI loops are instantiated per round count (see CbcDecryptAesNi). Their
+// rounds are a single instruction, so the loop overhead matters there. The portable
+// rounds are long enough that GCC does not fully unroll them even with a constant Nr, so
+// a runtime Nr costs them nothing measurable, and a copy per key size would only add code.
+
+// Room for the largest key schedule that can be in a context, in round keys.
+#define MaxRoundKeys (AES_keyExpSize / AES_BLOCKLEN)
+
 // jcallan@github points out that declaring Multiply as a function 
 // reduces code size considerably with the Keil ARM compiler.
 // See this link for more information: https://github.com/kokke/tiny-AES-C/pull/3
@@ -73,47 +100,104 @@ typedef uint8_t state_t[4][4];
 
 
 
+// The S-box contents are kept in X-macro lists so that the T-tables used by
+// AES_FAST_TABLES can be derived from them at compile time.
+#define SBOX_VALUES(f) \
+  f(0x63), f(0x7c), f(0x77), f(0x7b), f(0xf2), f(0x6b), f(0x6f), f(0xc5), f(0x30), f(0x01), f(0x67), f(0x2b), f(0xfe), f(0xd7), f(0xab), f(0x76), \
+  f(0xca), f(0x82), f(0xc9), f(0x7d), f(0xfa), f(0x59), f(0x47), f(0xf0), f(0xad), f(0xd4), f(0xa2), f(0xaf), f(0x9c), f(0xa4), f(0x72), f(0xc0), \
+  f(0xb7), f(0xfd), f(0x93), f(0x26), f(0x36), f(0x3f), f(0xf7), f(0xcc), f(0x34), f(0xa5), f(0xe5), f(0xf1), f(0x71), f(0xd8), f(0x31), f(0x15), \
+  f(0x04), f(0xc7), f(0x23), f(0xc3), f(0x18), f(0x96), f(0x05), f(0x9a), f(0x07), f(0x12), f(0x80), f(0xe2), f(0xeb), f(0x27), f(0xb2), f(0x75), \
+  f(0x09), f(0x83), f(0x2c), f(0x1a), f(0x1b), f(0x6e), f(0x5a), f(0xa0), f(0x52), f(0x3b), f(0xd6), f(0xb3), f(0x29), f(0xe3), f(0x2f), f(0x84), \
+  f(0x53), f(0xd1), f(0x00), f(0xed), f(0x20), f(0xfc), f(0xb1), f(0x5b), f(0x6a), f(0xcb), f(0xbe), f(0x39), f(0x4a), f(0x4c), f(0x58), f(0xcf), \
+  f(0xd0), f(0xef), f(0xaa), f(0xfb), f(0x43), f(0x4d), f(0x33), f(0x85), f(0x45), f(0xf9), f(0x02), f(0x7f), f(0x50), f(0x3c), f(0x9f), f(0xa8), \
+  f(0x51), f(0xa3), f(0x40), f(0x8f), f(0x92), f(0x9d), f(0x38), f(0xf5), f(0xbc), f(0xb6), f(0xda), f(0x21), f(0x10), f(0xff), f(0xf3), f(0xd2), \
+  f(0xcd), f(0x0c), f(0x13), f(0xec), f(0x5f), f(0x97), f(0x44), f(0x17), f(0xc4), f(0xa7), f(0x7e), f(0x3d), f(0x64), f(0x5d), f(0x19), f(0x73), \
+  f(0x60), f(0x81), f(0x4f), f(0xdc), f(0x22), f(0x2a), f(0x90), f(0x88), f(0x46), f(0xee), f(0xb8), f(0x14), f(0xde), f(0x5e), f(0x0b), f(0xdb), \
+  f(0xe0), f(0x32), f(0x3a), f(0x0a), f(0x49), f(0x06), f(0x24), f(0x5c), f(0xc2), f(0xd3), f(0xac), f(0x62), f(0x91), f(0x95), f(0xe4), f(0x79), \
+  f(0xe7), f(0xc8), f(0x37), f(0x6d), f(0x8d), f(0xd5), f(0x4e), f(0xa9), f(0x6c), f(0x56), f(0xf4), f(0xea), f(0x65), f(0x7a), f(0xae), f(0x08), \
+  f(0xba), f(0x78), f(0x25), f(0x2e), f(0x1c), f(0xa6), f(0xb4), f(0xc6), f(0xe8), f(0xdd), f(0x74), f(0x1f), f(0x4b), f(0xbd), f(0x8b), f(0x8a), \
+  f(0x70), f(0x3e), f(0xb5), f(0x66), f(0x48), f(0x03), f(0xf6), f(0x0e), f(0x61), f(0x35), f(0x57), f(0xb9), f(0x86), f(0xc1), f(0x1d), f(0x9e), \
+  f(0xe1), f(0xf8), f(0x98), f(0x11), f(0x69), f(0xd9), f(0x8e), f(0x94), f(0x9b), f(0x1e), f(0x87), f(0xe9), f(0xce), f(0x55), f(0x28), f(0xdf), \
+  f(0x8c), f(0xa1), f(0x89), f(0x0d), f(0xbf), f(0xe6), f(0x42), f(0x68), f(0x41), f(0x99), f(0x2d), f(0x0f), f(0xb0), f(0x54), f(0xbb), f(0x16)
+
+#define RSBOX_VALUES(f) \
+  f(0x52), f(0x09), f(0x6a), f(0xd5), f(0x30), f(0x36), f(0xa5), f(0x38), f(0xbf), f(0x40), f(0xa3), f(0x9e), f(0x81), f(0xf3), f(0xd7), f(0xfb), \
+  f(0x7c), f(0xe3), f(0x39), f(0x82), f(0x9b), f(0x2f), f(0xff), f(0x87), f(0x34), f(0x8e), f(0x43), f(0x44), f(0xc4), f(0xde), f(0xe9), f(0xcb), \
+  f(0x54), f(0x7b), f(0x94), f(0x32), f(0xa6), f(0xc2), f(0x23), f(0x3d), f(0xee), f(0x4c), f(0x95), f(0x0b), f(0x42), f(0xfa), f(0xc3), f(0x4e), \
+  f(0x08), f(0x2e), f(0xa1), f(0x66), f(0x28), f(0xd9), f(0x24), f(0xb2), f(0x76), f(0x5b), f(0xa2), f(0x49), f(0x6d), f(0x8b), f(0xd1), f(0x25), \
+  f(0x72), f(0xf8), f(0xf6), f(0x64), f(0x86), f(0x68), f(0x98), f(0x16), f(0xd4), f(0xa4), f(0x5c), f(0xcc), f(0x5d), f(0x65), f(0xb6), f(0x92), \
+  f(0x6c), f(0x70), f(0x48), f(0x50), f(0xfd), f(0xed), f(0xb9), f(0xda), f(0x5e), f(0x15), f(0x46), f(0x57), f(0xa7), f(0x8d), f(0x9d), f(0x84), \
+  f(0x90), f(0xd8), f(0xab), f(0x00), f(0x8c), f(0xbc), f(0xd3), f(0x0a), f(0xf7), f(0xe4), f(0x58), f(0x05), f(0xb8), f(0xb3), f(0x45), f(0x06), \
+  f(0xd0), f(0x2c), f(0x1e), f(0x8f), f(0xca), f(0x3f), f(0x0f), f(0x02), f(0xc1), f(0xaf), f(0xbd), f(0x03), f(0x01), f(0x13), f(0x8a), f(0x6b), \
+  f(0x3a), f(0x91), f(0x11), f(0x41), f(0x4f), f(0x67), f(0xdc), f(0xea), f(0x97), f(0xf2), f(0xcf), f(0xce), f(0xf0), f(0xb4), f(0xe6), f(0x73), \
+  f(0x96), f(0xac), f(0x74), f(0x22), f(0xe7), f(0xad), f(0x35), f(0x85), f(0xe2), f(0xf9), f(0x37), f(0xe8), f(0x1c), f(0x75), f(0xdf), f(0x6e), \
+  f(0x47), f(0xf1), f(0x1a), f(0x71), f(0x1d), f(0x29), f(0xc5), f(0x89), f(0x6f), f(0xb7), f(0x62), f(0x0e), f(0xaa), f(0x18), f(0xbe), f(0x1b), \
+  f(0xfc), f(0x56), f(0x3e), f(0x4b), f(0xc6), f(0xd2), f(0x79), f(0x20), f(0x9a), f(0xdb), f(0xc0), f(0xfe), f(0x78), f(0xcd), f(0x5a), f(0xf4), \
+  f(0x1f), f(0xdd), f(0xa8), f(0x33), f(0x88), f(0x07), f(0xc7), f(0x31), f(0xb1), f(0x12), f(0x10), f(0x59), f(0x27), f(0x80), f(0xec), f(0x5f), \
+  f(0x60), f(0x51), f(0x7f), f(0xa9), f(0x19), f(0xb5), f(0x4a), f(0x0d), f(0x2d), f(0xe5), f(0x7a), f(0x9f), f(0x93), f(0xc9), f(0x9c), f(0xef), \
+  f(0xa0), f(0xe0), f(0x3b), f(0x4d), f(0xae), f(0x2a), f(0xf5), f(0xb0), f(0xc8), f(0xeb), f(0xbb), f(0x3c), f(0x83), f(0x53), f(0x99), f(0x61), \
+  f(0x17), f(0x2b), f(0x04), f(0x7e), f(0xba), f(0x77), f(0xd6), f(0x26), f(0xe1), f(0x69), f(0x14), f(0x63), f(0x55), f(0x21), f(0x0c), f(0x7d)
+
+#define AS_BYTE(x) (x)
+
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM - 
 // This can be useful in (embedded) bootloader applications, where ROM is often limited.
+// The bitsliced engine computes the S-box instead, so it has no tables at all.
+#if !AES_BITSLICE
 static const uint8_t sbox[256] = {
-  //0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
-  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
-  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
-  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
-  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
-  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
-  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
-  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
-  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
-  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
-  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
-  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
-  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
-  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
-  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
-  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
-  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+  SBOX_VALUES(AS_BYTE) };
 
 #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 static const uint8_t rsbox[256] = {
-  0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
-  0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
-  0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
-  0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
-  0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
-  0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
-  0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
-  0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
-  0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
-  0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
-  0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
-  0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
-  0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
-  0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
-  0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
-  0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
+  RSBOX_VALUES(AS_BYTE) };
 #endif
+#endif // #if !AES_BITSLICE
+
+#if AES_FAST_TABLES
+// T-tables fuse SubBytes, ShiftRows and MixColumns into four lookups per column.
+// Te0[x] holds the column {02,01,01,03}*S[x]; Te1..Te3 are the same column rotated
+// so that each table serves one row of the state. Td0..Td3 are the inverse
+// counterparts built from the inverse S-box with {0e,09,0d,0b}.
+// Everything is computed by the compiler from the S-box lists above.
+#define GF_X2(x) ((((x) << 1) ^ ((((x) >> 7) & 1) * 0x1b)) & 0xff)
+#define GF_X4(x) GF_X2(GF_X2(x))
+#define GF_X8(x) GF_X2(GF_X4(x))
+#define GF_X3(x) (GF_X2(x) ^ (x))
+#define GF_X9(x) (GF_X8(x) ^ (x))
+#define GF_XB(x) (GF_X8(x) ^ GF_X2(x) ^ (x))
+#define GF_XD(x) (GF_X8(x) ^ GF_X4(x) ^ (x))
+#define GF_XE(x) (GF_X8(x) ^ GF_X4(x) ^ GF_X2(x))
+
+#define COLUMN(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define TE0(s) COLUMN(GF_X2(s), (s), (s), GF_X3(s))
+#define TE1(s) COLUMN(GF_X3(s), GF_X2(s), (s), (s))
+#define TE2(s) COLUMN((s), GF_X3(s), GF_X2(s), (s))
+#define TE3(s) COLUMN((s), (s), GF_X3(s), GF_X2(s))
+
+static const uint32_t Te0[256] = { SBOX_VALUES(TE0) };
+static const uint32_t Te1[256] = { SBOX_VALUES(TE1) };
+static const uint32_t Te2[256] = { SBOX_VALUES(TE2) };
+static const uint32_t Te3[256] = { SBOX_VALUES(TE3) };
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#define TD0(s) COLUMN(GF_XE(s), GF_X9(s), GF_XD(s), GF_XB(s))
+#define TD1(s) COLUMN(GF_XB(s), GF_XE(s), GF_X9(s), GF_XD(s))
+#define TD2(s) COLUMN(GF_XD(s), GF_XB(s), GF_XE(s), GF_X9(s))
+#define TD3(s) COLUMN(GF_X9(s), GF_XD(s), GF_XB(s), GF_XE(s))
+
+static const uint32_t Td0[256] = { RSBOX_VALUES(TD0) };
+static const uint32_t Td1[256] = { RSBOX_VALUES(TD1) };
+static const uint32_t Td2[256] = { RSBOX_VALUES(TD2) };
+static const uint32_t Td3[256] = { RSBOX_VALUES(TD3) };
+#endif
+
+// Big-endian column load/store, independent of host byte order and alignment.
+#define GETU32(p) \
+  (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#endif // #if AES_FAST_TABLES
 
 // The round constant word array, Rcon[i], contains the values given by 
 // x to the power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
@@ -142,9 +226,494 @@ static uint8_t getSBoxValue(uint8_t num)
 */
 #define getSBoxValue(num) (sbox[(num)])
 
+#if AES_BITSLICE
+// Bitsliced constant-time engine, modelled on the "ct64" design from BearSSL.
+// Four blocks are processed at once in eight 64-bit words q[0..7], where q[i] holds
+// bit i of every byte of the four states. The S-box is evaluated as a boolean circuit
+// (Boyar-Peralta) instead of a table lookup, so neither the memory access pattern nor
+// the timing depends on the key or the data.
+#define BITSLICE_BLOCKS 4
+
+static void BitsliceSbox(uint64_t* q)
+{
+  uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+  uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  uint64_t y20, y21;
+  uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+  uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+  uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  // Top linear transformation.
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  // Non-linear section.
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  // Bottom linear transformation.
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+// Converts between the block-per-word layout and the bit-per-word layout. The
+// transform is an involution, so the same function is used in both directions.
+static void BitsliceOrtho(uint64_t* q)
+{
+#define SWAPN(cl, ch, s, x, y) do {                             \
+    uint64_t a = (x), b = (y);                                  \
+    (x) = (a & (uint64_t)(cl)) | ((b & (uint64_t)(cl)) << (s)); \
+    (y) = ((a & (uint64_t)(ch)) >> (s)) | (b & (uint64_t)(ch)); \
+  } while (0)
+#define SWAP2(x, y) SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, x, y)
+#define SWAP4(x, y) SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, x, y)
+#define SWAP8(x, y) SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, x, y)
+
+  SWAP2(q[0], q[1]);
+  SWAP2(q[2], q[3]);
+  SWAP2(q[4], q[5]);
+  SWAP2(q[6], q[7]);
+
+  SWAP4(q[0], q[2]);
+  SWAP4(q[1], q[3]);
+  SWAP4(q[4], q[6]);
+  SWAP4(q[5], q[7]);
+
+  SWAP8(q[0], q[4]);
+  SWAP8(q[1], q[5]);
+  SWAP8(q[2], q[6]);
+  SWAP8(q[3], q[7]);
+
+#undef SWAP8
+#undef SWAP4
+#undef SWAP2
+#undef SWAPN
+}
+
+static uint32_t LoadLE32(const uint8_t* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Loads BITSLICE_BLOCKS consecutive blocks from buf into bitsliced form.
+static void BitsliceLoad(uint64_t* q, const uint8_t* buf)
+{
+  uint64_t x0, x1, x2, x3;
+  uint8_t i;
+
+  for (i = 0; i < BITSLICE_BLOCKS; ++i)
+  {
+    const uint8_t* p = buf + (i * AES_BLOCKLEN);
+    x0 = LoadLE32(p);
+    x1 = LoadLE32(p + 4);
+    x2 = LoadLE32(p + 8);
+    x3 = LoadLE32(p + 12);
+    x0 = (x0 | (x0 << 16)) & (uint64_t)0x0000FFFF0000FFFF;
+    x1 = (x1 | (x1 << 16)) & (uint64_t)0x0000FFFF0000FFFF;
+    x2 = (x2 | (x2 << 16)) & (uint64_t)0x0000FFFF0000FFFF;
+    x3 = (x3 | (x3 << 16)) & (uint64_t)0x0000FFFF0000FFFF;
+    x0 = (x0 | (x0 << 8)) & (uint64_t)0x00FF00FF00FF00FF;
+    x1 = (x1 | (x1 << 8)) & (uint64_t)0x00FF00FF00FF00FF;
+    x2 = (x2 | (x2 << 8)) & (uint64_t)0x00FF00FF00FF00FF;
+    x3 = (x3 | (x3 << 8)) & (uint64_t)0x00FF00FF00FF00FF;
+    q[i] = x0 | (x2 << 8);
+    q[i + 4] = x1 | (x3 << 8);
+  }
+  BitsliceOrtho(q);
+}
+
+// Inverse of BitsliceLoad(); q is clobbered.
+static void BitsliceStore(uint8_t* buf, uint64_t* q)
+{
+  uint64_t x0, x1, x2, x3;
+  uint32_t w[4];
+  uint8_t i, j;
+
+  BitsliceOrtho(q);
+  for (i = 0; i < BITSLICE_BLOCKS; ++i)
+  {
+    x0 = q[i] & (uint64_t)0x00FF00FF00FF00FF;
+    x1 = q[i + 4] & (uint64_t)0x00FF00FF00FF00FF;
+    x2 = (q[i] >> 8) & (uint64_t)0x00FF00FF00FF00FF;
+    x3 = (q[i + 4] >> 8) & (uint64_t)0x00FF00FF00FF00FF;
+    x0 = (x0 | (x0 >> 8)) & (uint64_t)0x0000FFFF0000FFFF;
+    x1 = (x1 | (x1 >> 8)) & (uint64_t)0x0000FFFF0000FFFF;
+    x2 = (x2 | (x2 >> 8)) & (uint64_t)0x0000FFFF0000FFFF;
+    x3 = (x3 | (x3 >> 8)) & (uint64_t)0x0000FFFF0000FFFF;
+    w[0] = (uint32_t)x0 | (uint32_t)(x0 >> 16);
+    w[1] = (uint32_t)x1 | (uint32_t)(x1 >> 16);
+    w[2] = (uint32_t)x2 | (uint32_t)(x2 >> 16);
+    w[3] = (uint32_t)x3 | (uint32_t)(x3 >> 16);
+    for (j = 0; j < 16; ++j)
+    {
+      buf[(i * AES_BLOCKLEN) + j] = (uint8_t)(w[j >> 2] >> (8 * (j & 3)));
+    }
+  }
+}
+
+// Constant-time replacement for the S-box lookups in KeyExpansion().
+static void BitsliceSubWord(uint8_t* word)
+{
+  uint8_t blocks[BITSLICE_BLOCKS * AES_BLOCKLEN] = { 0 };
+  uint64_t q[8];
+
+  memcpy(blocks, word, 4);
+  BitsliceLoad(q, blocks);
+  BitsliceSbox(q);
+  BitsliceStore(blocks, q);
+  memcpy(word, blocks, 4);
+}
+
+static void BitsliceAddRoundKey(uint64_t* q, const uint64_t* sk)
+{
+  uint8_t i;
+  for (i = 0; i < 8; ++i)
+  {
+    q[i] ^= sk[i];
+  }
+}
+
+static void BitsliceShiftRows(uint64_t* q)
+{
+  uint8_t i;
+  uint64_t x;
+  for (i = 0; i < 8; ++i)
+  {
+    x = q[i];
+    q[i] = (x & (uint64_t)0x000000000000FFFF)
+      | ((x & (uint64_t)0x00000000FFF00000) >> 4)
+      | ((x & (uint64_t)0x00000000000F0000) << 12)
+      | ((x & (uint64_t)0x0000FF0000000000) >> 8)
+      | ((x & (uint64_t)0x000000FF00000000) << 8)
+      | ((x & (uint64_t)0xF000000000000000) >> 12)
+      | ((x & (uint64_t)0x0FFF000000000000) << 4);
+  }
+}
+
+// Rotating a word by 16 bits moves every byte one row down its column, by 32 bits two rows.
+#define ROTR16(x) (((x) >> 16) | ((x) << 48))
+#define ROTR32(x) (((x) >> 32) | ((x) << 32))
+
+static void BitsliceMixColumns(uint64_t* q)
+{
+  uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+  uint64_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+  q0 = q[0]; q1 = q[1]; q2 = q[2]; q3 = q[3];
+  q4 = q[4]; q5 = q[5]; q6 = q[6]; q7 = q[7];
+  r0 = ROTR16(q0); r1 = ROTR16(q1); r2 = ROTR16(q2); r3 = ROTR16(q3);
+  r4 = ROTR16(q4); r5 = ROTR16(q5); r6 = ROTR16(q6); r7 = ROTR16(q7);
+
+  q[0] = q7 ^ r7 ^ r0 ^ ROTR32(q0 ^ r0);
+  q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ ROTR32(q1 ^ r1);
+  q[2] = q1 ^ r1 ^ r2 ^ ROTR32(q2 ^ r2);
+  q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ ROTR32(q3 ^ r3);
+  q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ ROTR32(q4 ^ r4);
+  q[5] = q4 ^ r4 ^ r5 ^ ROTR32(q5 ^ r5);
+  q[6] = q5 ^ r5 ^ r6 ^ ROTR32(q6 ^ r6);
+  q[7] = q6 ^ r6 ^ r7 ^ ROTR32(q7 ^ r7);
+}
+
+static void BitsliceCipher(uint64_t* q, const uint64_t* sk, uint8_t Nr)
+{
+  uint8_t round;
+
+  BitsliceAddRoundKey(q, sk);
+  for (round = 1; round < Nr; ++round)
+  {
+    BitsliceSbox(q);
+    BitsliceShiftRows(q);
+    BitsliceMixColumns(q);
+    BitsliceAddRoundKey(q, sk + (round * 8));
+  }
+  BitsliceSbox(q);
+  BitsliceShiftRows(q);
+  BitsliceAddRoundKey(q, sk + (Nr * 8));
+}
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+// The inverse S-box is the forward circuit wrapped in the inverse affine transform,
+// applied on both sides: InvSbox(x) = A^-1(Sbox(A^-1(x))), with A^-1 including the 0x63.
+static void BitsliceInvAffine(uint64_t* q)
+{
+  uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+  q0 = ~q[0]; q1 = ~q[1]; q2 = q[2]; q3 = q[3];
+  q4 = q[4]; q5 = ~q[5]; q6 = ~q[6]; q7 = q[7];
+  q[7] = q1 ^ q4 ^ q6;
+  q[6] = q0 ^ q3 ^ q5;
+  q[5] = q7 ^ q2 ^ q4;
+  q[4] = q6 ^ q1 ^ q3;
+  q[3] = q5 ^ q0 ^ q2;
+  q[2] = q4 ^ q7 ^ q1;
+  q[1] = q3 ^ q6 ^ q0;
+  q[0] = q2 ^ q5 ^ q7;
+}
+
+static void BitsliceInvSbox(uint64_t* q)
+{
+  BitsliceInvAffine(q);
+  BitsliceSbox(q);
+  BitsliceInvAffine(q);
+}
+
+static void BitsliceInvShiftRows(uint64_t* q)
+{
+  uint8_t i;
+  uint64_t x;
+  for (i = 0; i < 8; ++i)
+  {
+    x = q[i];
+    q[i] = (x & (uint64_t)0x000000000000FFFF)
+      | ((x & (uint64_t)0x000000000FFF0000) << 4)
+      | ((x & (uint64_t)0x00000000F0000000) >> 12)
+      | ((x & (uint64_t)0x000000FF00000000) << 8)
+      | ((x & (uint64_t)0x0000FF0000000000) >> 8)
+      | ((x & (uint64_t)0x000F000000000000) << 12)
+      | ((x & (uint64_t)0xFFF0000000000000) >> 4);
+  }
+}
+
+// InvMixColumns = MixColumns . P, where P adds {04}(a0 ^ a2) to rows 0 and 2 and
+// {04}(a1 ^ a3) to rows 1 and 3 of every column.
+static void BitsliceInvMixColumns(uint64_t* q)
+{
+  uint64_t u[8];
+  uint8_t i;
+
+  // u = a ^ (the byte two rows away); identical for rows r and r+2.
+  for (i = 0; i < 8; ++i)
+  {
+    u[i] = q[i] ^ ROTR32(q[i]);
+  }
+  // Multiply u by {04}: two xtime steps, each shifting bit i to i+1 and folding bit 7
+  // back in as 0x1b (bits 0, 1, 3 and 4).
+  for (i = 0; i < 2; ++i)
+  {
+    const uint64_t hi = u[7];
+    u[7] = u[6];
+    u[6] = u[5];
+    u[5] = u[4];
+    u[4] = u[3] ^ hi;
+    u[3] = u[2] ^ hi;
+    u[2] = u[1];
+    u[1] = u[0] ^ hi;
+    u[0] = hi;
+  }
+  for (i = 0; i < 8; ++i)
+  {
+    q[i] ^= u[i];
+  }
+  BitsliceMixColumns(q);
+}
+
+static void BitsliceInvCipher(uint64_t* q, const uint64_t* sk, uint8_t Nr)
+{
+  uint8_t round;
+
+  BitsliceAddRoundKey(q, sk + (Nr * 8));
+  for (round = Nr - 1; round > 0; --round)
+  {
+    BitsliceInvShiftRows(q);
+    BitsliceInvSbox(q);
+    BitsliceAddRoundKey(q, sk + (round * 8));
+    BitsliceInvMixColumns(q);
+  }
+  BitsliceInvShiftRows(q);
+  BitsliceInvSbox(q);
+  BitsliceAddRoundKey(q, sk);
+}
+#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+
+// Every round key is loaded as BITSLICE_BLOCKS identical blocks so it lines up with
+// the bitsliced state.
+static void BitsliceKeyExpansion(uint64_t* BitsliceKey, const uint8_t* RoundKey, uint8_t Nr)
+{
+  uint8_t blocks[BITSLICE_BLOCKS * AES_BLOCKLEN];
+  uint8_t round, i;
+
+  for (round = 0; round <= Nr; ++round)
+  {
+    for (i = 0; i < BITSLICE_BLOCKS; ++i)
+    {
+      memcpy(blocks + (i * AES_BLOCKLEN), RoundKey + (round * Nb * 4), AES_BLOCKLEN);
+    }
+    BitsliceLoad(BitsliceKey + (round * 8), blocks);
+  }
+}
+
+// Runs n consecutive blocks of buf through the bitsliced cipher, BITSLICE_BLOCKS at a
+// time; a short final group is padded through a scratch buffer.
+static void BitsliceBlocks(const uint64_t* sk, uint8_t Nr, uint8_t* buf, size_t n, void (*cipher)(uint64_t*, const uint64_t*, uint8_t))
+{
+  uint8_t scratch[BITSLICE_BLOCKS * AES_BLOCKLEN];
+  uint64_t q[8];
+  size_t len;
+
+  for (; n > 0; n -= len / AES_BLOCKLEN)
+  {
+    len = (n < BITSLICE_BLOCKS) ? (n * AES_BLOCKLEN) : sizeof(scratch);
+    if (len < sizeof(scratch))
+    {
+      memset(scratch, 0, sizeof(scratch));
+      memcpy(scratch, buf, len);
+      BitsliceLoad(q, scratch);
+      cipher(q, sk, Nr);
+      BitsliceStore(scratch, q);
+      memcpy(buf, scratch, len);
+    }
+    else
+    {
+      BitsliceLoad(q, buf);
+      cipher(q, sk, Nr);
+      BitsliceStore(buf, q);
+    }
+    buf += len;
+  }
+}
+#endif // #if AES_BITSLICE
+
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key, uint8_t Nk)
 {
+  const unsigned Nr = Nk + 6u;
   unsigned i, j, k;
   uint8_t tempa[4]; // Used for the column/row operations
   
@@ -187,25 +756,33 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
       // applies the S-box to each of the four bytes to produce an output word.
 
       // Function Subword()
+#if AES_BITSLICE
+      BitsliceSubWord(tempa);
+#else
       {
         tempa[0] = getSBoxValue(tempa[0]);
         tempa[1] = getSBoxValue(tempa[1]);
         tempa[2] = getSBoxValue(tempa[2]);
         tempa[3] = getSBoxValue(tempa[3]);
       }
+#endif
 
       tempa[0] = tempa[0] ^ Rcon[i/Nk];
     }
-#if defined(AES256) && (AES256 == 1)
-    if (i % Nk == 4)
+#if (defined(AES256) && (AES256 == 1)) || AES_RUNTIME_KEYLEN
+    if (Nk == 8 && i % Nk == 4)
     {
       // Function Subword()
+#if AES_BITSLICE
+      BitsliceSubWord(tempa);
+#else
       {
         tempa[0] = getSBoxValue(tempa[0]);
         tempa[1] = getSBoxValue(tempa[1]);
         tempa[2] = getSBoxValue(tempa[2]);
         tempa[3] = getSBoxValue(tempa[3]);
       }
+#endif
     }
 #endif
     j = i * 4; k=(i - Nk) * 4;
@@ -216,22 +793,157 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
   }
 }
 
+#if AES_INV_ROUNDKEY && AES_FAST_TABLES
+// Derives the round keys for the equivalent inverse cipher: the inner round keys get
+// InvMixColumns applied so that decryption can use the same round shape as encryption
+// (this is also what aesdec expects). InvMixColumns(w) is computed as Td[S[w]] since
+// Td already includes InvSubBytes.
+static void InvKeyExpansion(uint8_t* InvRoundKey, const uint8_t* RoundKey, uint8_t Nr)
+{
+  unsigned i;
+  uint32_t w;
+
+  memcpy(InvRoundKey, RoundKey, AES_keyExpSize);
+  for (i = Nb; i < Nb * Nr; ++i)
+  {
+    const uint8_t* k = RoundKey + (i * 4);
+    w = Td0[getSBoxValue(k[0])] ^ Td1[getSBoxValue(k[1])] ^ Td2[getSBoxValue(k[2])] ^ Td3[getSBoxValue(k[3])];
+    InvRoundKey[(i * 4) + 0] = (uint8_t)(w >> 24);
+    InvRoundKey[(i * 4) + 1] = (uint8_t)(w >> 16);
+    InvRoundKey[(i * 4) + 2] = (uint8_t)(w >> 8);
+    InvRoundKey[(i * 4) + 3] = (uint8_t)(w);
+  }
+}
+#elif AES_INV_ROUNDKEY && AES_BITSLICE
+// Same equivalent inverse cipher schedule, with InvMixColumns done on the bitsliced
+// form of the round keys so that key setup stays constant-time as well.
+static void InvKeyExpansion(uint8_t* InvRoundKey, const uint8_t* RoundKey, uint8_t Nr)
+{
+  uint8_t blocks[BITSLICE_BLOCKS * AES_BLOCKLEN] = { 0 };
+  uint64_t q[8];
+  uint8_t round;
+
+  memcpy(InvRoundKey, RoundKey, AES_keyExpSize);
+  for (round = 1; round < Nr; ++round)
+  {
+    memcpy(blocks, RoundKey + (round * Nb * 4), AES_BLOCKLEN);
+    BitsliceLoad(q, blocks);
+    BitsliceInvMixColumns(q);
+    BitsliceStore(blocks, q);
+    memcpy(InvRoundKey + (round * Nb * 4), blocks, AES_BLOCKLEN);
+  }
+}
+#elif AES_INV_ROUNDKEY
+static void InvMixColumns(state_t* state);
+
+// Same equivalent inverse cipher schedule as above, using the byte-wise InvMixColumns
+// on each inner round key since the T-tables are not compiled in.
+static void InvKeyExpansion(uint8_t* InvRoundKey, const uint8_t* RoundKey, uint8_t Nr)
+{
+  uint8_t round;
+
+  memcpy(InvRoundKey, RoundKey, AES_keyExpSize);
+  for (round = 1; round < Nr; ++round)
+  {
+    InvMixColumns((state_t*)(InvRoundKey + (round * Nb * 4)));
+  }
+}
+#endif
+
+#if AES_NI
+// Only the AES-NI feature bit is checked; SSE2 is implied on every CPU that has it.
+static uint8_t DetectAesNi(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    return 0;
+  }
+  return (ecx & bit_AES) ? 1 : 0;
+}
+#endif
+
+#if defined(GCM) && (GCM == 1)
+static void GcmInitKey(struct AES_ctx* ctx);
+#endif
+#if defined(CMAC) && (CMAC == 1)
+static void CmacInitKey(struct AES_ctx* ctx);
+#endif
+
+// Expands key into every schedule the compiled-in engines need and resets the rest of
+// the context. Nk is the key length in 32-bit words.
+static void InitCtx(struct AES_ctx* ctx, const uint8_t* key, uint8_t Nk)
+{
+  const uint8_t Nr = Nk + 6;
+
+  KeyExpansion(ctx->RoundKey, key, Nk);
+#if AES_RUNTIME_KEYLEN
+  ctx->Nr = Nr;
+#endif
+#if AES_INV_ROUNDKEY
+  InvKeyExpansion(ctx->InvRoundKey, ctx->RoundKey, Nr);
+#endif
+#if AES_BITSLICE
+  BitsliceKeyExpansion(ctx->BitsliceKey, ctx->RoundKey, Nr);
+#endif
+#if AES_NI
+  ctx->AesNi = DetectAesNi();
+#endif
+#if defined(CTR) && (CTR == 1)
+  ctx->KeystreamOffset = AES_BLOCKLEN;
+#endif
+#if defined(GCM) && (GCM == 1)
+  GcmInitKey(ctx);
+#endif
+#if defined(CMAC) && (CMAC == 1)
+  CmacInitKey(ctx);
+#endif
+  (void)Nr;
+}
+
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
 {
-  KeyExpansion(ctx->RoundKey, key);
+  InitCtx(ctx, key, DefaultNk);
 }
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
 {
-  KeyExpansion(ctx->RoundKey, key);
-  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
+  AES_init_ctx(ctx, key);
+  AES_ctx_set_iv(ctx, iv);
 }
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
 {
   memcpy (ctx->Iv, iv, AES_BLOCKLEN);
+#if defined(CTR) && (CTR == 1)
+  ctx->KeystreamOffset = AES_BLOCKLEN; // a new IV invalidates any buffered keystream
+#endif
+}
+#endif
+
+#if AES_RUNTIME_KEYLEN
+int AES_init_ctx_keylen(struct AES_ctx* ctx, const uint8_t* key, size_t keylen)
+{
+  if (keylen != 16 && keylen != 24 && keylen != 32)
+  {
+    return -1;
+  }
+  InitCtx(ctx, key, (uint8_t)(keylen / 4));
+  return 0;
+}
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+int AES_init_ctx_iv_keylen(struct AES_ctx* ctx, const uint8_t* key, size_t keylen, const uint8_t* iv)
+{
+  if (AES_init_ctx_keylen(ctx, key, keylen) != 0)
+  {
+    return -1;
+  }
+  AES_ctx_set_iv(ctx, iv);
+  return 0;
 }
 #endif
+#endif // #if AES_RUNTIME_KEYLEN
 
+#if !AES_FAST_TABLES && !AES_BITSLICE
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
 static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
@@ -410,7 +1122,7 @@ static void InvShiftRows(state_t* state)
 #endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(state_t* state, const uint8_t* RoundKey)
+static void Cipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
 {
   uint8_t round = 0;
 
@@ -436,7 +1148,7 @@ static void Cipher(state_t* state, const uint8_t* RoundKey)
 }
 
 #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
-static void InvCipher(state_t* state, const uint8_t* RoundKey)
+static void InvCipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
 {
   uint8_t round = 0;
 
@@ -461,6 +1173,237 @@ static void InvCipher(state_t* state, const uint8_t* RoundKey)
 }
 #endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 
+#elif AES_FAST_TABLES
+
+// Table-driven Cipher: the state is held as four big-endian column words and every
+// inner round is 16 table lookups. The last round has no MixColumns, so it goes
+// through the plain S-box and writes the bytes straight back into the state.
+static void Cipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
+{
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  const uint8_t* rk = RoundKey;
+  uint8_t round;
+
+  s0 = GETU32((*state)[0]) ^ GETU32(rk +  0);
+  s1 = GETU32((*state)[1]) ^ GETU32(rk +  4);
+  s2 = GETU32((*state)[2]) ^ GETU32(rk +  8);
+  s3 = GETU32((*state)[3]) ^ GETU32(rk + 12);
+
+  for (round = 1; round < Nr; ++round)
+  {
+    rk += Nb * 4;
+    t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ GETU32(rk +  0);
+    t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ GETU32(rk +  4);
+    t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ GETU32(rk +  8);
+    t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ GETU32(rk + 12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  rk += Nb * 4;
+  (*state)[0][0] = getSBoxValue(s0 >> 24)          ^ rk[0];
+  (*state)[0][1] = getSBoxValue((s1 >> 16) & 0xff) ^ rk[1];
+  (*state)[0][2] = getSBoxValue((s2 >> 8) & 0xff)  ^ rk[2];
+  (*state)[0][3] = getSBoxValue(s3 & 0xff)         ^ rk[3];
+  (*state)[1][0] = getSBoxValue(s1 >> 24)          ^ rk[4];
+  (*state)[1][1] = getSBoxValue((s2 >> 16) & 0xff) ^ rk[5];
+  (*state)[1][2] = getSBoxValue((s3 >> 8) & 0xff)  ^ rk[6];
+  (*state)[1][3] = getSBoxValue(s0 & 0xff)         ^ rk[7];
+  (*state)[2][0] = getSBoxValue(s2 >> 24)          ^ rk[8];
+  (*state)[2][1] = getSBoxValue((s3 >> 16) & 0xff) ^ rk[9];
+  (*state)[2][2] = getSBoxValue((s0 >> 8) & 0xff)  ^ rk[10];
+  (*state)[2][3] = getSBoxValue(s1 & 0xff)         ^ rk[11];
+  (*state)[3][0] = getSBoxValue(s3 >> 24)          ^ rk[12];
+  (*state)[3][1] = getSBoxValue((s0 >> 16) & 0xff) ^ rk[13];
+  (*state)[3][2] = getSBoxValue((s1 >> 8) & 0xff)  ^ rk[14];
+  (*state)[3][3] = getSBoxValue(s2 & 0xff)         ^ rk[15];
+}
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#define getSBoxInvert(num) (rsbox[(num)])
+
+// Table-driven InvCipher using the equivalent inverse cipher, so RoundKey here must be
+// the InvRoundKey schedule produced by InvKeyExpansion().
+static void InvCipher(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
+{
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  const uint8_t* rk = RoundKey + (Nr * Nb * 4);
+  uint8_t round;
+
+  s0 = GETU32((*state)[0]) ^ GETU32(rk +  0);
+  s1 = GETU32((*state)[1]) ^ GETU32(rk +  4);
+  s2 = GETU32((*state)[2]) ^ GETU32(rk +  8);
+  s3 = GETU32((*state)[3]) ^ GETU32(rk + 12);
+
+  for (round = 1; round < Nr; ++round)
+  {
+    rk -= Nb * 4;
+    t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >> 8) & 0xff] ^ Td3[s1 & 0xff] ^ GETU32(rk +  0);
+    t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xff] ^ Td2[(s3 >> 8) & 0xff] ^ Td3[s2 & 0xff] ^ GETU32(rk +  4);
+    t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xff] ^ Td2[(s0 >> 8) & 0xff] ^ Td3[s3 & 0xff] ^ GETU32(rk +  8);
+    t3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xff] ^ Td2[(s1 >> 8) & 0xff] ^ Td3[s0 & 0xff] ^ GETU32(rk + 12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  rk -= Nb * 4;
+  (*state)[0][0] = getSBoxInvert(s0 >> 24)          ^ rk[0];
+  (*state)[0][1] = getSBoxInvert((s3 >> 16) & 0xff) ^ rk[1];
+  (*state)[0][2] = getSBoxInvert((s2 >> 8) & 0xff)  ^ rk[2];
+  (*state)[0][3] = getSBoxInvert(s1 & 0xff)         ^ rk[3];
+  (*state)[1][0] = getSBoxInvert(s1 >> 24)          ^ rk[4];
+  (*state)[1][1] = getSBoxInvert((s0 >> 16) & 0xff) ^ rk[5];
+  (*state)[1][2] = getSBoxInvert((s3 >> 8) & 0xff)  ^ rk[6];
+  (*state)[1][3] = getSBoxInvert(s2 & 0xff)         ^ rk[7];
+  (*state)[2][0] = getSBoxInvert(s2 >> 24)          ^ rk[8];
+  (*state)[2][1] = getSBoxInvert((s1 >> 16) & 0xff) ^ rk[9];
+  (*state)[2][2] = getSBoxInvert((s0 >> 8) & 0xff)  ^ rk[10];
+  (*state)[2][3] = getSBoxInvert(s3 & 0xff)         ^ rk[11];
+  (*state)[3][0] = getSBoxInvert(s3 >> 24)          ^ rk[12];
+  (*state)[3][1] = getSBoxInvert((s2 >> 16) & 0xff) ^ rk[13];
+  (*state)[3][2] = getSBoxInvert((s1 >> 8) & 0xff)  ^ rk[14];
+  (*state)[3][3] = getSBoxInvert(s0 & 0xff)         ^ rk[15];
+}
+#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+
+#endif // #if !AES_FAST_TABLES && !AES_BITSLICE
+
+// The decryption key schedule differs from the encryption one when InvCipher is table-driven.
+#if AES_FAST_TABLES
+  #define InvRoundKeyOf(ctx) ((ctx)->InvRoundKey)
+#else
+  #define InvRoundKeyOf(ctx) ((ctx)->RoundKey)
+#endif
+
+#if AES_NI
+// AES-NI versions of Cipher/InvCipher. They are compiled with a target attribute rather
+// than -maes so that the same binary still runs on CPUs without the instructions; they
+// are only ever called when DetectAesNi() succeeded for the context.
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+// Round loops that are instantiated once per key size with a constant Nr, so each copy
+// is fully unrolled.
+#define AESNI_INLINE AESNI_TARGET static inline __attribute__((always_inline))
+#define AESNI_UNROLL _Pragma("GCC unroll 14")
+#define LoadRoundKey(RoundKey, round) _mm_loadu_si128((const __m128i*)((RoundKey) + ((round) * Nb * 4)))
+
+AESNI_TARGET static void CipherAesNi(state_t* state, const uint8_t* RoundKey, uint8_t Nr)
+{
+  __m128i m = _mm_loadu_si128((const __m128i*)state);
+  uint8_t round;
+
+  m = _mm_xor_si128(m, LoadRoundKey(RoundKey, 0));
+  for (round = 1; round < Nr; ++round)
+  {
+    m = _mm_aesenc_si128(m, LoadRoundKey(RoundKey, round));
+  }
+  m = _mm_aesenclast_si128(m, LoadRoundKey(RoundKey, Nr));
+  _mm_storeu_si128((__m128i*)state, m);
+}
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+// aesdec implements the equivalent inverse cipher, so this takes the InvRoundKey schedule
+// whose inner round keys already went through InvMixColumns (aesimc).
+AESNI_TARGET static void InvCipherAesNi(state_t* state, const uint8_t* InvRoundKey, uint8_t Nr)
+{
+  __m128i m = _mm_loadu_si128((const __m128i*)state);
+  uint8_t round;
+
+  m = _mm_xor_si128(m, LoadRoundKey(InvRoundKey, Nr));
+  for (round = Nr - 1; round > 0; --round)
+  {
+    m = _mm_aesdec_si128(m, LoadRoundKey(InvRoundKey, round));
+  }
+  m = _mm_aesdeclast_si128(m, LoadRoundKey(InvRoundKey, 0));
+  _mm_storeu_si128((__m128i*)state, m);
+}
+#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#endif // #if AES_NI
+
+// EncryptBlock/DecryptBlock are what the modes of operation call; they dispatch to
+// AES-NI when the context was set up on a CPU that supports it and otherwise to the
+// bitsliced engine or the byte-wise/table-driven Cipher, whichever is compiled in.
+static void EncryptBlock(const struct AES_ctx* ctx, uint8_t* buf)
+{
+#if AES_NI
+  if (ctx->AesNi)
+  {
+    CipherAesNi((state_t*)buf, ctx->RoundKey, NrOf(ctx));
+    return;
+  }
+#endif
+#if AES_BITSLICE
+  BitsliceBlocks(ctx->BitsliceKey, NrOf(ctx), buf, 1, BitsliceCipher);
+#else
+  Cipher((state_t*)buf, ctx->RoundKey, NrOf(ctx));
+#endif
+}
+
+#if defined(CTR) && (CTR == 1)
+// EncryptBlocks/DecryptBlocks run n consecutive blocks of buf through the cipher. Only
+// the bitsliced engine gains from seeing several blocks at once; the others just loop.
+static void EncryptBlocks(const struct AES_ctx* ctx, uint8_t* buf, size_t n)
+{
+#if AES_BITSLICE
+#if AES_NI
+  if (!ctx->AesNi)
+#endif
+  {
+    BitsliceBlocks(ctx->BitsliceKey, NrOf(ctx), buf, n, BitsliceCipher);
+    return;
+  }
+#endif
+  for (; n > 0; --n, buf += AES_BLOCKLEN)
+  {
+    EncryptBlock(ctx, buf);
+  }
+}
+#endif // #if defined(CTR) && (CTR == 1)
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+static void DecryptBlock(const struct AES_ctx* ctx, uint8_t* buf)
+{
+#if AES_NI
+  if (ctx->AesNi)
+  {
+    InvCipherAesNi((state_t*)buf, ctx->InvRoundKey, NrOf(ctx));
+    return;
+  }
+#endif
+#if AES_BITSLICE
+  BitsliceBlocks(ctx->BitsliceKey, NrOf(ctx), buf, 1, BitsliceInvCipher);
+#else
+  InvCipher((state_t*)buf, InvRoundKeyOf(ctx), NrOf(ctx));
+#endif
+}
+#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+
+#if defined(CBC) && (CBC == 1)
+static void DecryptBlocks(const struct AES_ctx* ctx, uint8_t* buf, size_t n)
+{
+#if AES_BITSLICE
+#if AES_NI
+  if (!ctx->AesNi)
+#endif
+  {
+    BitsliceBlocks(ctx->BitsliceKey, NrOf(ctx), buf, n, BitsliceInvCipher);
+    return;
+  }
+#endif
+  for (; n > 0; --n, buf += AES_BLOCKLEN)
+  {
+    DecryptBlock(ctx, buf);
+  }
+}
+#endif // #if defined(CBC) && (CBC == 1)
+
+// The volatile stores keep the compiler from dropping the clear as a dead store.
+void AES_secure_zero(void* p, size_t len)
+{
+  volatile uint8_t* v = (volatile uint8_t*)p;
+  while (len-- > 0)
+  {
+    *v++ = 0;
+  }
+}
+
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
@@ -470,13 +1413,13 @@ static void InvCipher(state_t* state, const uint8_t* RoundKey)
 void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
 {
   // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher((state_t*)buf, ctx->RoundKey);
+  EncryptBlock(ctx, buf);
 }
 
 void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
 {
   // The next function call decrypts the PlainText with the Key using AES algorithm.
-  InvCipher((state_t*)buf, ctx->RoundKey);
+  DecryptBlock(ctx, buf);
 }
 
 
@@ -500,32 +1443,461 @@ static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
 
 void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, size_t length)
 {
-  size_t i;
-  uint8_t *Iv = ctx->Iv;
+  AES_CBC_encrypt_buffer_to(ctx, buf, buf, length);
+}
+
+void AES_CBC_encrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  size_t i;
+  uint8_t *Iv = ctx->Iv;
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
-    XorWithIv(buf, Iv);
-    Cipher((state_t*)buf, ctx->RoundKey);
-    Iv = buf;
-    buf += AES_BLOCKLEN;
+    if (out != in)
+    {
+      memcpy(out, in, AES_BLOCKLEN);
+    }
+    XorWithIv(out, Iv);
+    EncryptBlock(ctx, out);
+    Iv = out;
+    out += AES_BLOCKLEN;
+    in += AES_BLOCKLEN;
   }
   /* store Iv in ctx for next call */
   memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
 }
 
+// CBC decryption has no dependency between blocks apart from the XOR with the previous
+// ciphertext, so blocks are decrypted in groups of CBC_PARALLEL_BLOCKS.
+#define CBC_PARALLEL_BLOCKS 8
+
+#if AES_NI
+// Decrypts CBC_PARALLEL_BLOCKS blocks per iteration with the aesdec chains interleaved.
+// The ciphertext stays in registers until the XOR, so this works in place as well.
+AESNI_INLINE void CbcDecryptAesNiRounds(const uint8_t* InvRoundKey, const uint8_t Nr, uint8_t* Iv, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+  __m128i rk[MaxRoundKeys];
+  __m128i c[CBC_PARALLEL_BLOCKS];
+  __m128i m[CBC_PARALLEL_BLOCKS];
+  __m128i iv = _mm_loadu_si128((const __m128i*)Iv);
+  size_t done;
+  uint8_t i, round;
+
+  for (round = 0; round <= Nr; ++round)
+  {
+    rk[round] = LoadRoundKey(InvRoundKey, round);
+  }
+
+  for (done = 0; done + CBC_PARALLEL_BLOCKS <= blocks; done += CBC_PARALLEL_BLOCKS)
+  {
+    for (i = 0; i < CBC_PARALLEL_BLOCKS; ++i)
+    {
+      c[i] = _mm_loadu_si128((const __m128i*)(in + ((done + i) * AES_BLOCKLEN)));
+      m[i] = _mm_xor_si128(c[i], rk[Nr]);
+    }
+    AESNI_UNROLL
+    for (round = Nr - 1; round > 0; --round)
+    {
+      for (i = 0; i < CBC_PARALLEL_BLOCKS; ++i)
+      {
+        m[i] = _mm_aesdec_si128(m[i], rk[round]);
+      }
+    }
+    for (i = 0; i < CBC_PARALLEL_BLOCKS; ++i)
+    {
+      m[i] = _mm_aesdeclast_si128(m[i], rk[0]);
+      m[i] = _mm_xor_si128(m[i], (i == 0) ? iv : c[i - 1]);
+      _mm_storeu_si128((__m128i*)(out + ((done + i) * AES_BLOCKLEN)), m[i]);
+    }
+    iv = c[CBC_PARALLEL_BLOCKS - 1];
+  }
+
+  for (; done < blocks; ++done)
+  {
+    c[0] = _mm_loadu_si128((const __m128i*)(in + (done * AES_BLOCKLEN)));
+    m[0] = _mm_xor_si128(c[0], rk[Nr]);
+    for (round = Nr - 1; round > 0; --round)
+    {
+      m[0] = _mm_aesdec_si128(m[0], rk[round]);
+    }
+    m[0] = _mm_xor_si128(_mm_aesdeclast_si128(m[0], rk[0]), iv);
+    _mm_storeu_si128((__m128i*)(out + (done * AES_BLOCKLEN)), m[0]);
+    iv = c[0];
+  }
+  _mm_storeu_si128((__m128i*)Iv, iv);
+}
+
+AESNI_TARGET static void CbcDecryptAesNi(const uint8_t* InvRoundKey, uint8_t Nr, uint8_t* Iv, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+#if AES_RUNTIME_KEYLEN
+  switch (Nr)
+  {
+    case 10: CbcDecryptAesNiRounds(InvRoundKey, 10, Iv, out, in, blocks); return;
+    case 12: CbcDecryptAesNiRounds(InvRoundKey, 12, Iv, out, in, blocks); return;
+    default: CbcDecryptAesNiRounds(InvRoundKey, 14, Iv, out, in, blocks); return;
+  }
+#else
+  CbcDecryptAesNiRounds(InvRoundKey, Nr, Iv, out, in, blocks);
+#endif
+}
+#endif // #if AES_NI
+
 void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 {
+  AES_CBC_decrypt_buffer_to(ctx, buf, buf, length);
+}
+
+void AES_CBC_decrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  uint8_t saved[CBC_PARALLEL_BLOCKS * AES_BLOCKLEN];
+  const size_t blocks = length / AES_BLOCKLEN;
+  const uint8_t* prev = ctx->Iv;
+  size_t done;
+  uint8_t i, n;
+
+#if AES_NI
+  if (ctx->AesNi)
+  {
+    CbcDecryptAesNi(ctx->InvRoundKey, NrOf(ctx), ctx->Iv, out, in, blocks);
+    return;
+  }
+#endif
+
+  if (out != in)
+  {
+    // Out of place the previous ciphertext block is still intact in the input,
+    // so nothing needs to be saved.
+    for (done = 0; done < blocks; done += n)
+    {
+      n = (blocks - done < CBC_PARALLEL_BLOCKS) ? (uint8_t)(blocks - done) : CBC_PARALLEL_BLOCKS;
+      memcpy(out, in, n * AES_BLOCKLEN);
+      DecryptBlocks(ctx, out, n);
+      for (i = 0; i < n; ++i)
+      {
+        XorWithIv(out, prev);
+        prev = in;
+        in += AES_BLOCKLEN;
+        out += AES_BLOCKLEN;
+      }
+    }
+    if (blocks > 0)
+    {
+      memcpy(ctx->Iv, prev, AES_BLOCKLEN);
+    }
+    return;
+  }
+
+  // In place the ciphertext is overwritten, so each group is saved once up front
+  // instead of copying every block into storeNextIv.
+  for (done = 0; done < blocks; done += n)
+  {
+    n = (blocks - done < CBC_PARALLEL_BLOCKS) ? (uint8_t)(blocks - done) : CBC_PARALLEL_BLOCKS;
+    memcpy(saved, out, n * AES_BLOCKLEN);
+    DecryptBlocks(ctx, out, n);
+    XorWithIv(out, ctx->Iv);
+    for (i = 1; i < n; ++i)
+    {
+      XorWithIv(out + (i * AES_BLOCKLEN), saved + ((i - 1) * AES_BLOCKLEN));
+    }
+    memcpy(ctx->Iv, saved + ((n - 1) * AES_BLOCKLEN), AES_BLOCKLEN);
+    out += n * AES_BLOCKLEN;
+  }
+}
+
+// Multi-buffer CBC: up to AES_BATCH_LANES independent messages are processed side by side,
+// one block of each per step. Within one message CBC encryption must finish every round of
+// a block before the next block can start; across messages the rounds overlap. A lane
+// whose message ends takes the next job, so messages of different lengths keep all
+// lanes busy.
+#if AES_NI
+#define AesNiOf(ctx) ((ctx)->AesNi)
+#else
+#define AesNiOf(ctx) 0
+#endif
+
+#if AES_NI
+// Lane state of the multi-buffer functions. The busy lanes are always the first Count;
+// an idle lane reads and writes Scratch, so a step runs all lanes of its width without
+// branches.
+struct BatchLanes
+{
+  const uint8_t* Rk[AES_BATCH_LANES];
+  const uint8_t* In[AES_BATCH_LANES];
+  uint8_t* Out[AES_BATCH_LANES];
+  size_t Left[AES_BATCH_LANES];               // blocks still to do
+  uint8_t Prev[AES_BATCH_LANES][AES_BLOCKLEN]; // previous ciphertext block, the IV at first
+  uint8_t Scratch[AES_BLOCKLEN];
+  unsigned Count;
+  size_t Next;                                // next job to look at
+};
+
+// Puts the next job that runs with Nr rounds on AES-NI into lane l, if any is left.
+static int BatchFill(struct BatchLanes* b, unsigned l, const struct AES_batch_job* jobs, size_t count, uint8_t Nr, int decrypt)
+{
+  while (b->Next < count)
+  {
+    const struct AES_batch_job* job = &jobs[b->Next++];
+    if (job->length >= AES_BLOCKLEN && job->ctx->AesNi && NrOf(job->ctx) == Nr)
+    {
+      b->Rk[l] = decrypt ? job->ctx->InvRoundKey : job->ctx->RoundKey;
+      b->In[l] = job->in;
+      b->Out[l] = job->out;
+      b->Left[l] = job->length / AES_BLOCKLEN;
+      memcpy(b->Prev[l], job->iv, AES_BLOCKLEN);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// An idle lane keeps its last round keys, which are valid, and works on Scratch.
+static void BatchIdle(struct BatchLanes* b, unsigned l)
+{
+  b->In[l] = b->Scratch;
+  b->Out[l] = b->Scratch;
+}
+
+// Returns 0 when no job runs with Nr rounds on AES-NI.
+static int BatchStart(struct BatchLanes* b, const struct AES_batch_job* jobs, size_t count, uint8_t Nr, int decrypt)
+{
+  unsigned l;
+
+  b->Count = 0;
+  b->Next = 0;
+  while (b->Count < AES_BATCH_LANES && BatchFill(b, b->Count, jobs, count, Nr, decrypt))
+  {
+    ++b->Count;
+  }
+  for (l = b->Count; b->Count > 0 && l < AES_BATCH_LANES; ++l)
+  {
+    b->Rk[l] = b->Rk[0];
+    BatchIdle(b, l);
+  }
+  return b->Count > 0;
+}
+
+// Moves every busy lane one block on. A lane whose job ended takes the next job; when
+// there is none, the last busy lane moves into its place and is advanced there.
+static void BatchAdvance(struct BatchLanes* b, const struct AES_batch_job* jobs, size_t count, uint8_t Nr, int decrypt)
+{
+  unsigned l = 0, last;
+
+  while (l < b->Count)
+  {
+    b->In[l] += AES_BLOCKLEN;
+    b->Out[l] += AES_BLOCKLEN;
+    if (--b->Left[l] > 0 || BatchFill(b, l, jobs, count, Nr, decrypt))
+    {
+      ++l;
+      continue;
+    }
+    last = --b->Count;
+    if (l != last)
+    {
+      b->Rk[l] = b->Rk[last];
+      b->In[l] = b->In[last];
+      b->Out[l] = b->Out[last];
+      b->Left[l] = b->Left[last];
+      memcpy(b->Prev[l], b->Prev[last], AES_BLOCKLEN);
+    }
+    BatchIdle(b, last);
+  }
+}
+
+// One block of each of the first W lanes; W and Nr are constants in every instance.
+AESNI_INLINE void CbcEncryptStep(struct BatchLanes* b, const unsigned W, const uint8_t Nr)
+{
+  __m128i x[AES_BATCH_LANES];
+  unsigned l;
+  uint8_t round;
+
+  AESNI_UNROLL
+  for (l = 0; l < W; ++l)
+  {
+    x[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)b->Prev[l]), _mm_loadu_si128((const __m128i*)b->In[l]));
+    x[l] = _mm_xor_si128(x[l], LoadRoundKey(b->Rk[l], 0));
+  }
+  AESNI_UNROLL
+  for (round = 1; round < Nr; ++round)
+  {
+    AESNI_UNROLL
+    for (l = 0; l < W; ++l)
+    {
+      x[l] = _mm_aesenc_si128(x[l], LoadRoundKey(b->Rk[l], round));
+    }
+  }
+  AESNI_UNROLL
+  for (l = 0; l < W; ++l)
+  {
+    x[l] = _mm_aesenclast_si128(x[l], LoadRoundKey(b->Rk[l], Nr));
+    _mm_storeu_si128((__m128i*)b->Out[l], x[l]);
+    _mm_storeu_si128((__m128i*)b->Prev[l], x[l]);
+  }
+}
+
+// The ciphertext stays in registers until the XOR, so this works in place as well.
+AESNI_INLINE void CbcDecryptStep(struct BatchLanes* b, const unsigned W, const uint8_t Nr)
+{
+  __m128i c[AES_BATCH_LANES];
+  __m128i x[AES_BATCH_LANES];
+  unsigned l;
+  uint8_t round;
+
+  AESNI_UNROLL
+  for (l = 0; l < W; ++l)
+  {
+    c[l] = _mm_loadu_si128((const __m128i*)b->In[l]);
+    x[l] = _mm_xor_si128(c[l], LoadRoundKey(b->Rk[l], Nr));
+  }
+  AESNI_UNROLL
+  for (round = Nr - 1; round > 0; --round)
+  {
+    AESNI_UNROLL
+    for (l = 0; l < W; ++l)
+    {
+      x[l] = _mm_aesdec_si128(x[l], LoadRoundKey(b->Rk[l], round));
+    }
+  }
+  AESNI_UNROLL
+  for (l = 0; l < W; ++l)
+  {
+    x[l] = _mm_aesdeclast_si128(x[l], LoadRoundKey(b->Rk[l], 0));
+    x[l] = _mm_xor_si128(x[l], _mm_loadu_si128((const __m128i*)b->Prev[l]));
+    _mm_storeu_si128((__m128i*)b->Prev[l], c[l]);
+    _mm_storeu_si128((__m128i*)b->Out[l], x[l]);
+  }
+}
+
+// The step width follows the busy lanes down as the batch drains, so a few long jobs at
+// the end do not pay for eight.
+AESNI_INLINE void CbcBatchAesNiRounds(const struct AES_batch_job* jobs, size_t count, const uint8_t Nr, const int decrypt)
+{
+  struct BatchLanes b;
+
+  if (!BatchStart(&b, jobs, count, Nr, decrypt))
+  {
+    return;
+  }
+  while (b.Count > 0)
+  {
+    if (decrypt)
+    {
+      if (b.Count > 4)      CbcDecryptStep(&b, 8, Nr);
+      else if (b.Count > 2) CbcDecryptStep(&b, 4, Nr);
+      else if (b.Count > 1) CbcDecryptStep(&b, 2, Nr);
+      else                  CbcDecryptStep(&b, 1, Nr);
+    }
+    else
+    {
+      if (b.Count > 4)      CbcEncryptStep(&b, 8, Nr);
+      else if (b.Count > 2) CbcEncryptStep(&b, 4, Nr);
+      else if (b.Count > 1) CbcEncryptStep(&b, 2, Nr);
+      else                  CbcEncryptStep(&b, 1, Nr);
+    }
+    BatchAdvance(&b, jobs, count, Nr, decrypt);
+  }
+}
+
+// One pass over the jobs per key size, so that all lanes of a step run the same rounds.
+AESNI_TARGET static void CbcBatchAesNi(const struct AES_batch_job* jobs, size_t count, int decrypt)
+{
+#if AES_RUNTIME_KEYLEN
+  if (decrypt)
+  {
+    CbcBatchAesNiRounds(jobs, count, 10, 1);
+    CbcBatchAesNiRounds(jobs, count, 12, 1);
+    CbcBatchAesNiRounds(jobs, count, 14, 1);
+  }
+  else
+  {
+    CbcBatchAesNiRounds(jobs, count, 10, 0);
+    CbcBatchAesNiRounds(jobs, count, 12, 0);
+    CbcBatchAesNiRounds(jobs, count, 14, 0);
+  }
+#else
+  if (decrypt)
+  {
+    CbcBatchAesNiRounds(jobs, count, DefaultNr, 1);
+  }
+  else
+  {
+    CbcBatchAesNiRounds(jobs, count, DefaultNr, 0);
+  }
+#endif
+}
+#endif // #if AES_NI
+
+// One job at a time through EncryptBlock/DecryptBlock, for contexts without AES-NI.
+static void CbcEncryptJob(const struct AES_batch_job* job)
+{
+  const uint8_t* prev = job->iv;
+  const uint8_t* in = job->in;
+  uint8_t* out = job->out;
   size_t i;
-  uint8_t storeNextIv[AES_BLOCKLEN];
-  for (i = 0; i < length; i += AES_BLOCKLEN)
+
+  for (i = 0; i + AES_BLOCKLEN <= job->length; i += AES_BLOCKLEN)
   {
-    memcpy(storeNextIv, buf, AES_BLOCKLEN);
-    InvCipher((state_t*)buf, ctx->RoundKey);
-    XorWithIv(buf, ctx->Iv);
-    memcpy(ctx->Iv, storeNextIv, AES_BLOCKLEN);
-    buf += AES_BLOCKLEN;
+    if (out != in)
+    {
+      memcpy(out, in, AES_BLOCKLEN);
+    }
+    XorWithIv(out, prev);
+    EncryptBlock(job->ctx, out);
+    prev = out;
+    out += AES_BLOCKLEN;
+    in += AES_BLOCKLEN;
   }
+}
 
+static void CbcDecryptJob(const struct AES_batch_job* job)
+{
+  uint8_t prev[AES_BLOCKLEN], saved[AES_BLOCKLEN];
+  const uint8_t* in = job->in;
+  uint8_t* out = job->out;
+  size_t i;
+
+  memcpy(prev, job->iv, AES_BLOCKLEN);
+  for (i = 0; i + AES_BLOCKLEN <= job->length; i += AES_BLOCKLEN)
+  {
+    memcpy(saved, in, AES_BLOCKLEN);
+    memcpy(out, saved, AES_BLOCKLEN);
+    DecryptBlock(job->ctx, out);
+    XorWithIv(out, prev);
+    memcpy(prev, saved, AES_BLOCKLEN);
+    out += AES_BLOCKLEN;
+    in += AES_BLOCKLEN;
+  }
+}
+
+void AES_CBC_encrypt_batch(const struct AES_batch_job* jobs, size_t count)
+{
+  size_t i;
+
+#if AES_NI
+  CbcBatchAesNi(jobs, count, 0);
+#endif
+  for (i = 0; i < count; ++i)
+  {
+    if (!AesNiOf(jobs[i].ctx))
+    {
+      CbcEncryptJob(&jobs[i]);
+    }
+  }
+}
+
+void AES_CBC_decrypt_batch(const struct AES_batch_job* jobs, size_t count)
+{
+  size_t i;
+
+#if AES_NI
+  CbcBatchAesNi(jobs, count, 1);
+#endif
+  for (i = 0; i < count; ++i)
+  {
+    if (!AesNiOf(jobs[i].ctx))
+    {
+      CbcDecryptJob(&jobs[i]);
+    }
+  }
 }
 
 #endif // #if defined(CBC) && (CBC == 1)
@@ -534,39 +1906,778 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 
 #if defined(CTR) && (CTR == 1)
 
+// Number of counter blocks encrypted per iteration of the CTR loop. The blocks are
+// independent, so AES-NI can keep all of them in flight at once.
+#define CTR_PARALLEL_BLOCKS 8
+
+// The counter is a big-endian 128-bit integer; it is handled as two 64-bit halves so the
+// common case is a single add, with a carry into the upper half only when the lower wraps.
+static uint64_t LoadBE64(const uint8_t* p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+         ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8)  | ((uint64_t)p[7]);
+}
+
+static void StoreBE64(uint8_t* p, uint64_t v)
+{
+  uint8_t i;
+  for (i = 0; i < 8; ++i)
+  {
+    p[i] = (uint8_t)(v >> (56 - (8 * i)));
+  }
+}
+
+// Adds n to the counter (hi:lo) and writes the result to Iv.
+static void AddToCounter(uint8_t* Iv, uint64_t hi, uint64_t lo, uint64_t n)
+{
+  uint64_t sum = lo + n;
+  if (sum < lo)
+  {
+    ++hi;
+  }
+  StoreBE64(Iv, hi);
+  StoreBE64(Iv + 8, sum);
+}
+
+void AES_ctr_counter_add(uint8_t* Iv, uint64_t blocks)
+{
+  AddToCounter(Iv, LoadBE64(Iv), LoadBE64(Iv + 8), blocks);
+}
+
+// Writes in XOR keystream to out (which may be in) a machine word at a time. memcpy keeps
+// the accesses legal for unaligned buffers and compiles down to plain loads and stores.
+void AES_xor_keystream(uint8_t* out, const uint8_t* in, const uint8_t* ks, size_t len)
+{
+  size_t i;
+  uint64_t a, b;
+  for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+  {
+    memcpy(&a, in + i, sizeof(a));
+    memcpy(&b, ks + i, sizeof(b));
+    a ^= b;
+    memcpy(out + i, &a, sizeof(a));
+  }
+  for (; i < len; ++i)
+  {
+    out[i] = in[i] ^ ks[i];
+  }
+}
+
+#if AES_NI
+// Encrypts CTR_PARALLEL_BLOCKS counters per iteration with the aesenc chains interleaved,
+// then XORs the keystream with in straight into out. Returns the number of blocks
+// processed; the tail that does not fill a whole batch is left to the portable loop.
+AESNI_INLINE size_t CtrBlocksAesNiRounds(const uint8_t* RoundKey, const uint8_t Nr, uint64_t hi, uint64_t lo, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+  __m128i rk[MaxRoundKeys];
+  __m128i m[CTR_PARALLEL_BLOCKS];
+  size_t done;
+  uint8_t i, round;
+
+  for (round = 0; round <= Nr; ++round)
+  {
+    rk[round] = LoadRoundKey(RoundKey, round);
+  }
+
+  for (done = 0; done + CTR_PARALLEL_BLOCKS <= blocks; done += CTR_PARALLEL_BLOCKS)
+  {
+    for (i = 0; i < CTR_PARALLEL_BLOCKS; ++i)
+    {
+      const uint64_t n = lo + done + i;
+      const uint64_t h = hi + (n < lo);
+      m[i] = _mm_set_epi64x((long long)__builtin_bswap64(n), (long long)__builtin_bswap64(h));
+      m[i] = _mm_xor_si128(m[i], rk[0]);
+    }
+    AESNI_UNROLL
+    for (round = 1; round < Nr; ++round)
+    {
+      for (i = 0; i < CTR_PARALLEL_BLOCKS; ++i)
+      {
+        m[i] = _mm_aesenc_si128(m[i], rk[round]);
+      }
+    }
+    for (i = 0; i < CTR_PARALLEL_BLOCKS; ++i)
+    {
+      const size_t offset = (done + i) * AES_BLOCKLEN;
+      m[i] = _mm_aesenclast_si128(m[i], rk[Nr]);
+      _mm_storeu_si128((__m128i*)(out + offset), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + offset)), m[i]));
+    }
+  }
+  return done;
+}
+
+AESNI_TARGET static size_t CtrBlocksAesNi(const uint8_t* RoundKey, uint8_t Nr, uint64_t hi, uint64_t lo, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+#if AES_RUNTIME_KEYLEN
+  switch (Nr)
+  {
+    case 10: return CtrBlocksAesNiRounds(RoundKey, 10, hi, lo, out, in, blocks);
+    case 12: return CtrBlocksAesNiRounds(RoundKey, 12, hi, lo, out, in, blocks);
+    default: return CtrBlocksAesNiRounds(RoundKey, 14, hi, lo, out, in, blocks);
+  }
+#else
+  return CtrBlocksAesNiRounds(RoundKey, Nr, hi, lo, out, in, blocks);
+#endif
+}
+#endif // #if AES_NI
+
+// Encrypts/decrypts whole blocks of in into out with the counters hi:lo, hi:lo + 1, ...
+// Only reads ctx.
+static void CtrBlocksAt(const struct AES_ctx* ctx, uint64_t hi, uint64_t lo, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+  uint8_t keystream[CTR_PARALLEL_BLOCKS * AES_BLOCKLEN];
+  size_t done = 0;
+  uint8_t i, n;
+
+#if AES_NI
+  if (ctx->AesNi)
+  {
+    done = CtrBlocksAesNi(ctx->RoundKey, NrOf(ctx), hi, lo, out, in, blocks);
+  }
+#endif
+  while (done < blocks)
+  {
+    n = (blocks - done < CTR_PARALLEL_BLOCKS) ? (uint8_t)(blocks - done) : CTR_PARALLEL_BLOCKS;
+    for (i = 0; i < n; ++i)
+    {
+      AddToCounter(keystream + (i * AES_BLOCKLEN), hi, lo, done + i);
+    }
+    EncryptBlocks(ctx, keystream, n);
+    AES_xor_keystream(out + (done * AES_BLOCKLEN), in + (done * AES_BLOCKLEN), keystream, n * AES_BLOCKLEN);
+    done += n;
+  }
+}
+
+// Encrypts/decrypts whole blocks of in into out and advances ctx->Iv past them.
+static void CtrBlocks(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t blocks)
+{
+  const uint64_t hi = LoadBE64(ctx->Iv);
+  const uint64_t lo = LoadBE64(ctx->Iv + 8);
+
+  CtrBlocksAt(ctx, hi, lo, out, in, blocks);
+  AddToCounter(ctx->Iv, hi, lo, blocks);
+}
+
 /* Symmetrical operation: same function for encrypting as for decrypting. Note any IV/nonce should never be reused with the same key */
+/* Keystream left over from a call that ended mid-block is kept in ctx and used first by the next call. */
 void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 {
-  uint8_t buffer[AES_BLOCKLEN];
-  
-  size_t i;
-  int bi;
-  for (i = 0, bi = AES_BLOCKLEN; i < length; ++i, ++bi)
+  AES_CTR_xcrypt_buffer_to(ctx, buf, buf, length);
+}
+
+void AES_CTR_xcrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  size_t blocks;
+
+  // Finish the block started by the previous call.
+  while (length > 0 && ctx->KeystreamOffset < AES_BLOCKLEN)
+  {
+    *out++ = *in++ ^ ctx->Keystream[ctx->KeystreamOffset++];
+    --length;
+  }
+
+  blocks = length / AES_BLOCKLEN;
+  CtrBlocks(ctx, out, in, blocks);
+  out += blocks * AES_BLOCKLEN;
+  in += blocks * AES_BLOCKLEN;
+  length -= blocks * AES_BLOCKLEN;
+
+  // Partial trailing block: generate one more keystream block and keep the unused part.
+  if (length > 0)
+  {
+    memset(ctx->Keystream, 0, AES_BLOCKLEN);
+    CtrBlocks(ctx, ctx->Keystream, ctx->Keystream, 1);
+    AES_xor_keystream(out, in, ctx->Keystream, length);
+    ctx->KeystreamOffset = (uint8_t)length;
+  }
+}
+
+void AES_CTR_xcrypt_at(const struct AES_ctx* ctx, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length)
+{
+  uint8_t keystream[AES_BLOCKLEN];
+  uint64_t hi = LoadBE64(ctx->Iv);
+  uint64_t lo = LoadBE64(ctx->Iv + 8);
+  const uint8_t skip = (uint8_t)(offset % AES_BLOCKLEN);
+  size_t blocks, n;
+
+  // The counter of the block that holds offset, with the 128-bit carry.
+  lo += offset / AES_BLOCKLEN;
+  if (lo < offset / AES_BLOCKLEN)
+  {
+    ++hi;
+  }
+
+  // A start in the middle of a block uses the end of that block's keystream.
+  if (skip != 0 && length > 0)
+  {
+    memset(keystream, 0, AES_BLOCKLEN);
+    CtrBlocksAt(ctx, hi, lo, keystream, keystream, 1);
+    n = (length < (size_t)(AES_BLOCKLEN - skip)) ? length : (size_t)(AES_BLOCKLEN - skip);
+    AES_xor_keystream(out, in, keystream + skip, n);
+    out += n;
+    in += n;
+    length -= n;
+    hi += (++lo == 0);
+  }
+
+  blocks = length / AES_BLOCKLEN;
+  CtrBlocksAt(ctx, hi, lo, out, in, blocks);
+  out += blocks * AES_BLOCKLEN;
+  in += blocks * AES_BLOCKLEN;
+  length -= blocks * AES_BLOCKLEN;
+  lo += blocks;
+  hi += (lo < blocks);
+
+  if (length > 0)
   {
-    if (bi == AES_BLOCKLEN) /* we need to regen xor compliment in buffer */
+    memset(keystream, 0, AES_BLOCKLEN);
+    CtrBlocksAt(ctx, hi, lo, keystream, keystream, 1);
+    AES_xor_keystream(out, in, keystream, length);
+  }
+}
+
+#endif // #if defined(CTR) && (CTR == 1)
+
+
+#if defined(GCM) && (GCM == 1)
+/*****************************************************************************/
+/* GCM:                                                                      */
+/*****************************************************************************/
+// Encryption reuses the CTR code with the counter held in ctx->Iv, and GHASH runs over
+// the same data in chunks of GCM_PASS_BLOCKS blocks while they are still in L1, so every
+// byte is loaded from memory once.
+#define GCM_PASS_BLOCKS (4 * CTR_PARALLEL_BLOCKS)
+
+// Remainders of the 4-bit shifts in the table-driven multiplication (Shoup's method).
+static const uint16_t GcmLast4[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0 };
+
+// Fills GcmHL/GcmHH with i * H for every 4-bit i, as 128-bit values split in halves.
+static void GcmInitTable(struct AES_ctx* ctx, const uint8_t* H)
+{
+  uint64_t vh = LoadBE64(H);
+  uint64_t vl = LoadBE64(H + 8);
+  uint8_t i, j;
+
+  ctx->GcmHH[0] = 0;
+  ctx->GcmHL[0] = 0;
+  ctx->GcmHH[8] = vh;
+  ctx->GcmHL[8] = vl;
+  for (i = 4; i > 0; i >>= 1)
+  {
+    const uint64_t reduce = (vl & 1) ? ((uint64_t)0xe1000000 << 32) : 0;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ reduce;
+    ctx->GcmHH[i] = vh;
+    ctx->GcmHL[i] = vl;
+  }
+  for (i = 2; i <= 8; i *= 2)
+  {
+    for (j = 1; j < i; ++j)
     {
-      
-      memcpy(buffer, ctx->Iv, AES_BLOCKLEN);
-      Cipher((state_t*)buffer,ctx->RoundKey);
+      ctx->GcmHH[i + j] = ctx->GcmHH[i] ^ ctx->GcmHH[j];
+      ctx->GcmHL[i + j] = ctx->GcmHL[i] ^ ctx->GcmHL[j];
+    }
+  }
+}
+
+// X = X * H in GF(2^128), four bits at a time.
+static void GhashMultTable(const struct AES_ctx* ctx, uint8_t* X)
+{
+  uint64_t zh, zl;
+  uint8_t i, lo, hi, rem;
 
-      /* Increment Iv and handle overflow */
-      for (bi = (AES_BLOCKLEN - 1); bi >= 0; --bi)
+  lo = X[15] & 0x0f;
+  zh = ctx->GcmHH[lo];
+  zl = ctx->GcmHL[lo];
+  for (i = AES_BLOCKLEN; i-- > 0; )
+  {
+    lo = X[i] & 0x0f;
+    hi = X[i] >> 4;
+    if (i != 15)
+    {
+      rem = (uint8_t)(zl & 0x0f);
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ ((uint64_t)GcmLast4[rem] << 48);
+      zh ^= ctx->GcmHH[lo];
+      zl ^= ctx->GcmHL[lo];
+    }
+    rem = (uint8_t)(zl & 0x0f);
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ ((uint64_t)GcmLast4[rem] << 48);
+    zh ^= ctx->GcmHH[hi];
+    zl ^= ctx->GcmHL[hi];
+  }
+  StoreBE64(X, zh);
+  StoreBE64(X + 8, zl);
+}
+
+#if AES_NI
+// GHASH with carry-less multiplication, after Intel's "Carry-Less Multiplication and Its
+// Usage for Computing the GCM Mode" white paper. Values are kept byte-reversed in the
+// registers, and four blocks are multiplied by H^4..H^1 and summed before one reduction.
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#define CLMUL_INLINE CLMUL_TARGET static inline __attribute__((always_inline))
+#define GCM_AGGREGATE 4
+
+static uint8_t DetectPclmul(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    return 0;
+  }
+  return ((ecx & bit_PCLMUL) && (ecx & bit_SSSE3)) ? 1 : 0;
+}
+
+CLMUL_INLINE __m128i ByteSwap128(__m128i x)
+{
+  return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Adds the 256-bit product a * b to hi:lo, without reducing it.
+CLMUL_INLINE void ClmulAccumulate(__m128i a, __m128i b, __m128i* lo, __m128i* hi)
+{
+  const __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+  const __m128i t3 = _mm_clmulepi64_si128(a, b, 0x11);
+  const __m128i t1 = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+  *lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+  *hi = _mm_xor_si128(*hi, _mm_xor_si128(t3, _mm_srli_si128(t1, 8)));
+}
+
+// Reduces hi:lo modulo the GCM polynomial. The shift left by one compensates for the
+// bit-reflected representation.
+CLMUL_INLINE __m128i ClmulReduce(__m128i lo, __m128i hi)
+{
+  __m128i a, b, c;
+
+  a = _mm_srli_epi32(lo, 31);
+  b = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  c = _mm_srli_si128(a, 12);
+  b = _mm_slli_si128(b, 4);
+  a = _mm_slli_si128(a, 4);
+  lo = _mm_or_si128(lo, a);
+  hi = _mm_or_si128(_mm_or_si128(hi, b), c);
+
+  a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+  b = _mm_srli_si128(a, 4);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+  c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+  c = _mm_xor_si128(c, b);
+  lo = _mm_xor_si128(lo, c);
+  return _mm_xor_si128(hi, lo);
+}
+
+CLMUL_INLINE __m128i ClmulMult(__m128i a, __m128i b)
+{
+  __m128i lo = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+  ClmulAccumulate(a, b, &lo, &hi);
+  return ClmulReduce(lo, hi);
+}
+
+// Stores H, H^2, H^3, H^4 in the byte-reversed form GhashBlocksClmul loads them in.
+CLMUL_TARGET static void GcmInitPowers(uint8_t* HPow, const uint8_t* H)
+{
+  const __m128i h = ByteSwap128(_mm_loadu_si128((const __m128i*)H));
+  __m128i p = h;
+  uint8_t i;
+
+  for (i = 0; i < GCM_AGGREGATE; ++i)
+  {
+    _mm_storeu_si128((__m128i*)(HPow + (i * AES_BLOCKLEN)), p);
+    p = ClmulMult(p, h);
+  }
+}
+
+CLMUL_TARGET static void GhashBlocksClmul(const uint8_t* HPow, uint8_t* X, const uint8_t* data, size_t blocks)
+{
+  __m128i h[GCM_AGGREGATE];
+  __m128i x = ByteSwap128(_mm_loadu_si128((const __m128i*)X));
+  __m128i lo, hi, b;
+  uint8_t i;
+
+  for (i = 0; i < GCM_AGGREGATE; ++i)
+  {
+    h[i] = _mm_loadu_si128((const __m128i*)(HPow + (i * AES_BLOCKLEN)));
+  }
+
+  for (; blocks >= GCM_AGGREGATE; blocks -= GCM_AGGREGATE, data += GCM_AGGREGATE * AES_BLOCKLEN)
+  {
+    lo = _mm_setzero_si128();
+    hi = _mm_setzero_si128();
+    for (i = 0; i < GCM_AGGREGATE; ++i)
+    {
+      b = ByteSwap128(_mm_loadu_si128((const __m128i*)(data + (i * AES_BLOCKLEN))));
+      if (i == 0)
       {
-	/* inc will overflow */
-        if (ctx->Iv[bi] == 255)
-	{
-          ctx->Iv[bi] = 0;
-          continue;
-        } 
-        ctx->Iv[bi] += 1;
-        break;   
+        b = _mm_xor_si128(b, x);
       }
-      bi = 0;
+      ClmulAccumulate(b, h[GCM_AGGREGATE - 1 - i], &lo, &hi);
+    }
+    x = ClmulReduce(lo, hi);
+  }
+  for (; blocks > 0; --blocks, data += AES_BLOCKLEN)
+  {
+    b = ByteSwap128(_mm_loadu_si128((const __m128i*)data));
+    x = ClmulMult(_mm_xor_si128(b, x), h[0]);
+  }
+  _mm_storeu_si128((__m128i*)X, ByteSwap128(x));
+}
+#endif // #if AES_NI
+
+static void GcmInitKey(struct AES_ctx* ctx)
+{
+  uint8_t H[AES_BLOCKLEN];
+
+  memset(H, 0, AES_BLOCKLEN);
+  EncryptBlock(ctx, H);
+  GcmInitTable(ctx, H);
+#if AES_NI
+  ctx->Pclmul = ctx->AesNi && DetectPclmul();
+  if (ctx->Pclmul)
+  {
+    GcmInitPowers(ctx->GcmHPow, H);
+  }
+#endif
+}
+
+// GcmX = (GcmX ^ block) * H for each of the given blocks.
+static void GhashBlocks(struct AES_ctx* ctx, const uint8_t* data, size_t blocks)
+{
+  uint8_t i;
+
+#if AES_NI
+  if (ctx->Pclmul)
+  {
+    GhashBlocksClmul(ctx->GcmHPow, ctx->GcmX, data, blocks);
+    return;
+  }
+#endif
+  for (; blocks > 0; --blocks, data += AES_BLOCKLEN)
+  {
+    for (i = 0; i < AES_BLOCKLEN; ++i)
+    {
+      ctx->GcmX[i] ^= data[i];
     }
+    GhashMultTable(ctx, ctx->GcmX);
+  }
+}
 
-    buf[i] = (buf[i] ^ buffer[bi]);
+// Hashes len bytes, holding back a trailing partial block in GcmBuf until more data
+// arrives or GhashFlush() pads it.
+static void GhashUpdate(struct AES_ctx* ctx, const uint8_t* data, size_t len)
+{
+  size_t blocks;
+
+  if (ctx->GcmBufLen > 0)
+  {
+    while (len > 0 && ctx->GcmBufLen < AES_BLOCKLEN)
+    {
+      ctx->GcmBuf[ctx->GcmBufLen++] = *data++;
+      --len;
+    }
+    if (ctx->GcmBufLen < AES_BLOCKLEN)
+    {
+      return;
+    }
+    GhashBlocks(ctx, ctx->GcmBuf, 1);
+    ctx->GcmBufLen = 0;
   }
+
+  blocks = len / AES_BLOCKLEN;
+  GhashBlocks(ctx, data, blocks);
+  data += blocks * AES_BLOCKLEN;
+  len -= blocks * AES_BLOCKLEN;
+  memcpy(ctx->GcmBuf, data, len);
+  ctx->GcmBufLen = (uint8_t)len;
 }
 
-#endif // #if defined(CTR) && (CTR == 1)
+static void GhashFlush(struct AES_ctx* ctx)
+{
+  if (ctx->GcmBufLen > 0)
+  {
+    memset(ctx->GcmBuf + ctx->GcmBufLen, 0, AES_BLOCKLEN - ctx->GcmBufLen);
+    GhashBlocks(ctx, ctx->GcmBuf, 1);
+    ctx->GcmBufLen = 0;
+  }
+}
+
+// GCM increments only the low 32 bits of the counter block (inc32). AES_CTR_xcrypt_buffer_to
+// does a 128-bit increment, so the text is split where the low word wraps and the carry
+// into the upper 96 bits is undone afterwards.
+static void GcmXcrypt(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  uint8_t upper[AES_BLOCKLEN - 4];
+  uint64_t room;
+  size_t n;
+
+  while (length > 0)
+  {
+    room = (((uint64_t)1 << 32) - (LoadBE64(ctx->Iv + 8) & 0xffffffff)) * AES_BLOCKLEN;
+    room += AES_BLOCKLEN - ctx->KeystreamOffset;
+    n = (length < room) ? length : (size_t)room;
+
+    memcpy(upper, ctx->Iv, sizeof(upper));
+    AES_CTR_xcrypt_buffer_to(ctx, out, in, n);
+    memcpy(ctx->Iv, upper, sizeof(upper));
+    out += n;
+    in += n;
+    length -= n;
+  }
+}
+
+void AES_GCM_start(struct AES_ctx* ctx, const uint8_t* iv, size_t iv_len)
+{
+  uint8_t J0[AES_BLOCKLEN];
+  uint8_t i;
+
+  memset(ctx->GcmX, 0, AES_BLOCKLEN);
+  ctx->GcmBufLen = 0;
+  if (iv_len == 12)
+  {
+    memcpy(J0, iv, 12);
+    J0[12] = 0;
+    J0[13] = 0;
+    J0[14] = 0;
+    J0[15] = 1;
+  }
+  else
+  {
+    GhashUpdate(ctx, iv, iv_len);
+    GhashFlush(ctx);
+    memset(J0, 0, AES_BLOCKLEN);
+    StoreBE64(J0 + 8, (uint64_t)iv_len * 8);
+    GhashBlocks(ctx, J0, 1);
+    memcpy(J0, ctx->GcmX, AES_BLOCKLEN);
+    memset(ctx->GcmX, 0, AES_BLOCKLEN);
+  }
+  ctx->GcmAadLen = 0;
+  ctx->GcmTextLen = 0;
+
+  memcpy(ctx->GcmEkJ0, J0, AES_BLOCKLEN);
+  EncryptBlock(ctx, ctx->GcmEkJ0);
+
+  // The first block of text uses inc32(J0).
+  for (i = AES_BLOCKLEN; i-- > 12; )
+  {
+    if (++J0[i] != 0)
+    {
+      break;
+    }
+  }
+  AES_ctx_set_iv(ctx, J0);
+}
+
+void AES_GCM_aad(struct AES_ctx* ctx, const uint8_t* aad, size_t length)
+{
+  GhashUpdate(ctx, aad, length);
+  ctx->GcmAadLen += length;
+}
+
+void AES_GCM_encrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  size_t n;
+
+  if (ctx->GcmTextLen == 0)
+  {
+    GhashFlush(ctx); // the AAD is padded to a whole block
+  }
+  ctx->GcmTextLen += length;
+  for (; length > 0; length -= n, in += n, out += n)
+  {
+    n = (length < GCM_PASS_BLOCKS * AES_BLOCKLEN) ? length : GCM_PASS_BLOCKS * AES_BLOCKLEN;
+    GcmXcrypt(ctx, out, in, n);
+    GhashUpdate(ctx, out, n);
+  }
+}
+
+void AES_GCM_decrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length)
+{
+  size_t n;
+
+  if (ctx->GcmTextLen == 0)
+  {
+    GhashFlush(ctx);
+  }
+  ctx->GcmTextLen += length;
+  for (; length > 0; length -= n, in += n, out += n)
+  {
+    n = (length < GCM_PASS_BLOCKS * AES_BLOCKLEN) ? length : GCM_PASS_BLOCKS * AES_BLOCKLEN;
+    GhashUpdate(ctx, in, n); // before decrypting, in case out == in
+    GcmXcrypt(ctx, out, in, n);
+  }
+}
+
+void AES_GCM_finish(struct AES_ctx* ctx, uint8_t* tag, size_t tag_len)
+{
+  uint8_t block[AES_BLOCKLEN];
+  size_t i;
+
+  GhashFlush(ctx);
+  StoreBE64(block, ctx->GcmAadLen * 8);
+  StoreBE64(block + 8, ctx->GcmTextLen * 8);
+  GhashBlocks(ctx, block, 1);
+  for (i = 0; i < tag_len && i < AES_BLOCKLEN; ++i)
+  {
+    tag[i] = ctx->GcmX[i] ^ ctx->GcmEkJ0[i];
+  }
+}
+
+int AES_GCM_check_tag(struct AES_ctx* ctx, const uint8_t* tag, size_t tag_len)
+{
+  uint8_t expected[AES_BLOCKLEN];
+  uint8_t diff = 0;
+  size_t i;
+
+  if (tag_len == 0 || tag_len > AES_BLOCKLEN)
+  {
+    return -1;
+  }
+  AES_GCM_finish(ctx, expected, AES_BLOCKLEN);
+  for (i = 0; i < tag_len; ++i)
+  {
+    diff |= expected[i] ^ tag[i]; // no early exit, so the time taken does not leak the match
+  }
+  return (diff == 0) ? 0 : -1;
+}
+
+#endif // #if defined(GCM) && (GCM == 1)
+
+#if defined(CMAC) && (CMAC == 1)
+/*****************************************************************************/
+/* CMAC:                                                                     */
+/*****************************************************************************/
+// CMAC (NIST SP 800-38B / RFC 4493) is CBC-MAC with the last block masked by a subkey.
+// The chain runs on a 16-byte state beside the message, which is only ever read.
+
+// Doubling in GF(2^128): shift left by one, folding the carry back in with 0x87.
+static void CmacDouble(uint8_t* out, const uint8_t* in)
+{
+  const uint8_t carry = (uint8_t)(0x87 & -(in[0] >> 7)); // no branch on key-derived data
+  uint8_t i;
+
+  for (i = 0; i < AES_BLOCKLEN - 1; ++i)
+  {
+    out[i] = (uint8_t)((in[i] << 1) | (in[i + 1] >> 7));
+  }
+  out[AES_BLOCKLEN - 1] = (uint8_t)((in[AES_BLOCKLEN - 1] << 1) ^ carry);
+}
+
+static void CmacInitKey(struct AES_ctx* ctx)
+{
+  uint8_t L[AES_BLOCKLEN];
+
+  memset(L, 0, AES_BLOCKLEN);
+  EncryptBlock(ctx, L);
+  CmacDouble(ctx->CmacK1, L);
+  CmacDouble(ctx->CmacK2, ctx->CmacK1);
+  memset(L, 0, AES_BLOCKLEN);
+}
+
+// Runs whole blocks of data through the CBC-MAC chain in X.
+static void CmacBlocks(const struct AES_ctx* ctx, uint8_t* X, const uint8_t* data, size_t blocks)
+{
+  uint8_t i;
+
+  for (; blocks > 0; --blocks, data += AES_BLOCKLEN)
+  {
+    for (i = 0; i < AES_BLOCKLEN; ++i)
+    {
+      X[i] ^= data[i];
+    }
+    EncryptBlock(ctx, X);
+  }
+}
+
+// Masks and encrypts the final block (len bytes, 0 to AES_BLOCKLEN) and writes the tag.
+static void CmacLast(const struct AES_ctx* ctx, uint8_t* X, const uint8_t* last, size_t len, uint8_t* tag, size_t tag_len)
+{
+  const uint8_t* K = (len == AES_BLOCKLEN) ? ctx->CmacK1 : ctx->CmacK2;
+  uint8_t i;
+
+  for (i = 0; i < AES_BLOCKLEN; ++i)
+  {
+    X[i] ^= K[i] ^ ((i < len) ? last[i] : (i == len) ? 0x80 : 0);
+  }
+  EncryptBlock(ctx, X);
+  memcpy(tag, X, (tag_len < AES_BLOCKLEN) ? tag_len : AES_BLOCKLEN);
+}
+
+void AES_CMAC_start(struct AES_ctx* ctx)
+{
+  memset(ctx->CmacX, 0, AES_BLOCKLEN);
+  ctx->CmacBufLen = 0;
+}
+
+void AES_CMAC_update(struct AES_ctx* ctx, const uint8_t* msg, size_t length)
+{
+  size_t blocks, fill;
+
+  // The last block is processed differently, so a block is only added to the chain once
+  // at least one more byte has arrived after it.
+  if (length == 0)
+  {
+    return;
+  }
+  if (ctx->CmacBufLen > 0)
+  {
+    fill = AES_BLOCKLEN - ctx->CmacBufLen;
+    if (length <= fill)
+    {
+      memcpy(ctx->CmacBuf + ctx->CmacBufLen, msg, length);
+      ctx->CmacBufLen += (uint8_t)length;
+      return;
+    }
+    memcpy(ctx->CmacBuf + ctx->CmacBufLen, msg, fill);
+    CmacBlocks(ctx, ctx->CmacX, ctx->CmacBuf, 1);
+    msg += fill;
+    length -= fill;
+  }
+
+  blocks = (length - 1) / AES_BLOCKLEN;
+  CmacBlocks(ctx, ctx->CmacX, msg, blocks);
+  msg += blocks * AES_BLOCKLEN;
+  length -= blocks * AES_BLOCKLEN;
+  memcpy(ctx->CmacBuf, msg, length);
+  ctx->CmacBufLen = (uint8_t)length;
+}
+
+void AES_CMAC_finish(struct AES_ctx* ctx, uint8_t* tag, size_t tag_len)
+{
+  CmacLast(ctx, ctx->CmacX, ctx->CmacBuf, ctx->CmacBufLen, tag, tag_len);
+  ctx->CmacBufLen = 0;
+}
+
+void AES_CMAC_buffer(const struct AES_ctx* ctx, const uint8_t* msg, size_t length, uint8_t* tag, size_t tag_len)
+{
+  uint8_t X[AES_BLOCKLEN];
+  const size_t blocks = (length > 0) ? (length - 1) / AES_BLOCKLEN : 0;
+
+  memset(X, 0, AES_BLOCKLEN);
+  CmacBlocks(ctx, X, msg, blocks);
+  CmacLast(ctx, X, msg + (blocks * AES_BLOCKLEN), length - (blocks * AES_BLOCKLEN), tag, tag_len);
+}
+
+int AES_CMAC_check_tag(const struct AES_ctx* ctx, const uint8_t* msg, size_t length, const uint8_t* tag, size_t tag_len)
+{
+  uint8_t expected[AES_BLOCKLEN];
+  uint8_t diff = 0;
+  size_t i;
+
+  if (tag_len == 0 || tag_len > AES_BLOCKLEN)
+  {
+    return -1;
+  }
+  AES_CMAC_buffer(ctx, msg, length, expected, AES_BLOCKLEN);
+  for (i = 0; i < tag_len; ++i)
+  {
+    diff |= expected[i] ^ tag[i]; // no early exit, so the time taken does not leak the match
+  }
+  return (diff == 0) ? 0 : -1;
+}
 
+#endif // #if defined(CMAC) && (CMAC == 1)
@@ -23,6 +23,54 @@
   #define CTR 1
 #endif
 
+// GCM enables AES-GCM authenticated encryption. It runs on the CTR code, so it needs CTR,
+// and adds about 400 bytes of GHASH state to the context, so it is off by default.
+#ifndef GCM
+  #define GCM 0
+#endif
+
+#if defined(GCM) && (GCM == 1) && !(defined(CTR) && (CTR == 1))
+  #error "GCM needs CTR"
+#endif
+
+// CMAC enables AES-CMAC message authentication (integrity without encryption). The two
+// subkeys are derived by AES_init_ctx() and kept in the context.
+#ifndef CMAC
+  #define CMAC 0
+#endif
+
+// AES_FAST_TABLES replaces the byte-wise SubBytes/ShiftRows/MixColumns rounds with
+// 32-bit T-table lookups. This costs 8K of ROM for the tables (4K when only CTR is
+// enabled) plus a second key schedule in the context, so it is off by default and
+// meant for ground-side builds where throughput matters more than code size.
+#ifndef AES_FAST_TABLES
+  #define AES_FAST_TABLES 0
+#endif
+
+// AES_BITSLICE replaces the table-based portable code with a bitsliced engine that
+// evaluates the S-box as a boolean circuit on four blocks at a time. It has no secret-
+// dependent memory accesses or branches (constant-time), which matters on shared hosts
+// where the sbox/rsbox lookups leak through the cache. It is used whenever AES-NI is
+// not available and needs a bitsliced key schedule in the context (up to 960 bytes).
+#ifndef AES_BITSLICE
+  #define AES_BITSLICE 0
+#endif
+
+#if defined(AES_BITSLICE) && (AES_BITSLICE == 1) && defined(AES_FAST_TABLES) && (AES_FAST_TABLES == 1)
+  #error "AES_BITSLICE and AES_FAST_TABLES are mutually exclusive"
+#endif
+
+// AES_NI adds an x86 AES-NI backend. Support is detected with cpuid when the context is
+// initialized and the portable code is used on CPUs without the instructions, so a single
+// binary runs everywhere. On by default for x86 GCC/Clang builds, unavailable elsewhere.
+#ifndef AES_NI
+  #if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define AES_NI 1
+  #else
+    #define AES_NI 0
+  #endif
+#endif
+
 
 #define AES128 1
 //#define AES192 1
@@ -30,6 +78,13 @@
 
 #define AES_BLOCKLEN 16 // Block length in bytes - AES is 128b block only
 
+// AES_RUNTIME_KEYLEN lets one build handle 128, 192 and 256-bit keys: the context records
+// its round count and AES_init_ctx_keylen() picks the key size at runtime. AES_init_ctx()
+// keeps using the compile-time key size below. Contexts grow to the AES256 schedule size.
+#ifndef AES_RUNTIME_KEYLEN
+  #define AES_RUNTIME_KEYLEN 0
+#endif
+
 #if defined(AES256) && (AES256 == 1)
     #define AES_KEYLEN 32
     #define AES_keyExpSize 240
@@ -41,12 +96,63 @@
     #define AES_keyExpSize 176
 #endif
 
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+    #undef AES_keyExpSize
+    #define AES_keyExpSize 240
+#endif
+
+// The equivalent inverse cipher used by the fast decryption paths (T-tables, aesdec) needs
+// round keys with InvMixColumns already applied; they are expanded once next to RoundKey.
+#if ((defined(AES_FAST_TABLES) && (AES_FAST_TABLES == 1)) || (defined(AES_NI) && (AES_NI == 1))) && \
+    ((defined(CBC) && (CBC == 1)) || (defined(ECB) && (ECB == 1)))
+  #define AES_INV_ROUNDKEY 1
+#else
+  #define AES_INV_ROUNDKEY 0
+#endif
+
 struct AES_ctx
 {
   uint8_t RoundKey[AES_keyExpSize];
+#if AES_INV_ROUNDKEY
+  uint8_t InvRoundKey[AES_keyExpSize];
+#endif
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
   uint8_t Iv[AES_BLOCKLEN];
 #endif
+#if defined(AES_BITSLICE) && (AES_BITSLICE == 1)
+  uint64_t BitsliceKey[(AES_keyExpSize / AES_BLOCKLEN) * 8];
+#endif
+#if defined(CTR) && (CTR == 1)
+  uint8_t Keystream[AES_BLOCKLEN]; // unused keystream when the last CTR call ended mid-block
+  uint8_t KeystreamOffset;         // first unused byte of Keystream, AES_BLOCKLEN if none
+#endif
+#if defined(AES_NI) && (AES_NI == 1)
+  uint8_t AesNi; // set by AES_init_ctx() when the CPU supports AES-NI
+#endif
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+  uint8_t Nr;    // number of rounds: 10, 12 or 14 for 128, 192 and 256-bit keys
+#endif
+#if defined(GCM) && (GCM == 1)
+  uint64_t GcmHH[16];                // i * H for every 4-bit i, upper and lower halves
+  uint64_t GcmHL[16];
+  uint64_t GcmAadLen;                // bytes of AAD and of text hashed since AES_GCM_start()
+  uint64_t GcmTextLen;
+  uint8_t GcmEkJ0[AES_BLOCKLEN];     // encrypted first counter block, masks the tag
+  uint8_t GcmX[AES_BLOCKLEN];        // running GHASH value
+  uint8_t GcmBuf[AES_BLOCKLEN];      // GHASH input that does not fill a block yet
+  uint8_t GcmBufLen;
+#if defined(AES_NI) && (AES_NI == 1)
+  uint8_t Pclmul;                    // set by AES_init_ctx() when the CPU has PCLMULQDQ
+  uint8_t GcmHPow[4 * AES_BLOCKLEN]; // H^1..H^4 for the PCLMULQDQ GHASH
+#endif
+#endif
+#if defined(CMAC) && (CMAC == 1)
+  uint8_t CmacK1[AES_BLOCKLEN];      // subkeys for a complete and a padded last block
+  uint8_t CmacK2[AES_BLOCKLEN];
+  uint8_t CmacX[AES_BLOCKLEN];       // CBC-MAC chain of AES_CMAC_update()
+  uint8_t CmacBuf[AES_BLOCKLEN];     // held-back last block, 1 to AES_BLOCKLEN bytes
+  uint8_t CmacBufLen;
+#endif
 };
 
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
@@ -55,6 +161,14 @@ void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv);
 #endif
 
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+// keylen is in bytes and must be 16, 24 or 32; returns 0 on success, -1 otherwise.
+int AES_init_ctx_keylen(struct AES_ctx* ctx, const uint8_t* key, size_t keylen);
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+int AES_init_ctx_iv_keylen(struct AES_ctx* ctx, const uint8_t* key, size_t keylen, const uint8_t* iv);
+#endif
+#endif // #if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+
 #if defined(ECB) && (ECB == 1)
 // buffer size is exactly AES_BLOCKLEN bytes; 
 // you need only AES_init_ctx as IV is not used in ECB 
@@ -73,6 +187,33 @@ void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf);
 void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length);
 void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length);
 
+// Out-of-place variants: read from in and write to out, leaving in untouched. in and out
+// must either be the same buffer or not overlap at all.
+void AES_CBC_encrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length);
+void AES_CBC_decrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length);
+
+// Many independent messages in one call, e.g. a burst of small frames each with its own
+// IV and key. With AES-NI up to AES_BATCH_LANES messages are interleaved block by block,
+// which is the only way to keep the AES unit busy in CBC encryption, where the blocks of
+// one message depend on each other. The contexts are only read (ctx->Iv is not used, the
+// IV comes from the job); several jobs may share one. length must be a multiple of
+// AES_BLOCKLEN; in and out of a job are the same buffer or do not overlap, and no job
+// writes into another job's buffers.
+#define AES_BATCH_LANES 8
+
+struct AES_batch_job
+{
+  const struct AES_ctx* ctx; // the key; AES_keyring_bind() sets it from key_id
+  uint32_t key_id;           // not used by the functions below
+  const uint8_t* iv;
+  const uint8_t* in;
+  uint8_t* out;
+  size_t length;
+};
+
+void AES_CBC_encrypt_batch(const struct AES_batch_job* jobs, size_t count);
+void AES_CBC_decrypt_batch(const struct AES_batch_job* jobs, size_t count);
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
@@ -80,12 +221,64 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length);
 
 // Same function for encrypting as for decrypting. 
 // IV is incremented for every block, and used after encryption as XOR-compliment for output
+// Calls can be chained on a stream of any length: keystream left over from a call that
+// ended mid-block is kept in ctx and consumed by the next call.
 // Suggesting https://en.wikipedia.org/wiki/Padding_(cryptography)#PKCS7 for padding scheme
 // NOTES: you need to set IV in ctx with AES_init_ctx_iv() or AES_ctx_set_iv()
 //        no IV should ever be reused with the same key 
 void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length);
 
+// Out-of-place variant; in and out must either be the same buffer or not overlap at all.
+void AES_CTR_xcrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length);
+
+// Random access: encrypts/decrypts the length bytes that sit at byte offset of the stream
+// whose first counter block is ctx->Iv, i.e. counter ctx->Iv + offset / 16, starting
+// offset % 16 bytes into its keystream. ctx is only read (Iv and buffered keystream are
+// left alone), so any number of threads can work on different ranges with one context.
+void AES_CTR_xcrypt_at(const struct AES_ctx* ctx, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length);
+
 #endif // #if defined(CTR) && (CTR == 1)
 
 
+#if defined(GCM) && (GCM == 1)
+
+// Authenticated encryption, one message at a time per context:
+//   AES_GCM_start() with the IV (12 bytes recommended, any length accepted),
+//   AES_GCM_aad() with the additional data, if any,
+//   AES_GCM_encrypt_buffer_to() or AES_GCM_decrypt_buffer_to() on the text,
+//   AES_GCM_finish() for the tag when encrypting, AES_GCM_check_tag() when decrypting.
+// The aad and text calls can be repeated on consecutive chunks of any length, but all AAD
+// must come before the text. out may be the same buffer as in. AES_GCM_check_tag()
+// returns 0 when the first tag_len (1 to 16) bytes of the tag match, -1 otherwise; the
+// decrypted text must not be used before it returns 0.
+// NOTES: the key comes from AES_init_ctx(), the GCM functions overwrite the CTR state
+//        never reuse an IV with the same key
+void AES_GCM_start(struct AES_ctx* ctx, const uint8_t* iv, size_t iv_len);
+void AES_GCM_aad(struct AES_ctx* ctx, const uint8_t* aad, size_t length);
+void AES_GCM_encrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length);
+void AES_GCM_decrypt_buffer_to(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length);
+void AES_GCM_finish(struct AES_ctx* ctx, uint8_t* tag, size_t tag_len);
+int AES_GCM_check_tag(struct AES_ctx* ctx, const uint8_t* tag, size_t tag_len);
+
+#endif // #if defined(GCM) && (GCM == 1)
+
+
+#if defined(CMAC) && (CMAC == 1)
+
+// Computes a tag over msg without modifying or copying it; tag_len is 1 to 16 bytes.
+// AES_CMAC_buffer() and AES_CMAC_check_tag() do a whole message and leave ctx untouched,
+// so one context can check messages from several threads. AES_CMAC_check_tag() returns 0
+// when the first tag_len bytes of the tag match, -1 otherwise.
+void AES_CMAC_buffer(const struct AES_ctx* ctx, const uint8_t* msg, size_t length, uint8_t* tag, size_t tag_len);
+int AES_CMAC_check_tag(const struct AES_ctx* ctx, const uint8_t* msg, size_t length, const uint8_t* tag, size_t tag_len);
+
+// Incremental form for messages that arrive in pieces: AES_CMAC_start(), then
+// AES_CMAC_update() on consecutive chunks of any length, then AES_CMAC_finish().
+void AES_CMAC_start(struct AES_ctx* ctx);
+void AES_CMAC_update(struct AES_ctx* ctx, const uint8_t* msg, size_t length);
+void AES_CMAC_finish(struct AES_ctx* ctx, uint8_t* tag, size_t tag_len);
+
+#endif // #if defined(CMAC) && (CMAC == 1)
+
+
 #endif // _AES_H_
@@ -7,6 +7,249 @@
 
 extern "C" {
 #include "aes.h"
+#include "aes_internal.h"
 }
 
+// The C++ layer below needs C++11; older compilers get the plain C interface only.
+#if __cplusplus >= 201103L
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if __cplusplus >= 202002L
+#include <span>
+#include <type_traits>
+#endif
+
+namespace aes {
+
+// Compile-time description of an AES key size. Bits is 128, 192 or 256.
+template <unsigned Bits> struct KeySize;
+
+template <> struct KeySize<128> { static constexpr std::size_t KeyLen = 16; static constexpr unsigned Nk = 4; static constexpr unsigned Nr = 10; };
+template <> struct KeySize<192> { static constexpr std::size_t KeyLen = 24; static constexpr unsigned Nk = 6; static constexpr unsigned Nr = 12; };
+template <> struct KeySize<256> { static constexpr std::size_t KeyLen = 32; static constexpr unsigned Nk = 8; static constexpr unsigned Nr = 14; };
+
+// Key size that AES_init_ctx() uses, i.e. the one selected with AES128/AES192/AES256.
+constexpr unsigned DefaultKeyBits = AES_KEYLEN * 8;
+
+// Whether contexts of this build can hold a key of the given size.
+template <unsigned Bits>
+constexpr bool Supported()
+{
+  return (AES_RUNTIME_KEYLEN == 1) || (Bits == DefaultKeyBits);
+}
+
+namespace detail {
+
+template <unsigned Bits>
+inline void InitKey(AES_ctx& ctx, const std::uint8_t* key)
+{
+  static_assert(Supported<Bits>(), "key size needs AES_RUNTIME_KEYLEN or a matching AES128/AES192/AES256 build");
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+  AES_init_ctx_keylen(&ctx, key, KeySize<Bits>::KeyLen);
+#else
+  AES_init_ctx(&ctx, key);
+#endif
+}
+
+} // namespace detail
+
+// Initializes ctx for a key whose size is fixed at compile time; the check is all that
+// Bits adds. With AES_RUNTIME_KEYLEN the context records the round count. aes.c switches
+// on it to AES-NI round loops specialized per key size, and the portable loops read it
+// with no measurable per-block cost, so this is as fast as a build for a single key size.
+template <unsigned Bits>
+inline void Init(AES_ctx& ctx, const std::uint8_t (&key)[KeySize<Bits>::KeyLen])
+{
+  detail::InitKey<Bits>(ctx, key);
+}
+
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+template <unsigned Bits>
+inline void Init(AES_ctx& ctx, const std::uint8_t (&key)[KeySize<Bits>::KeyLen], const std::uint8_t (&iv)[AES_BLOCKLEN])
+{
+  Init<Bits>(ctx, key);
+  AES_ctx_set_iv(&ctx, iv);
+}
+#endif
+
+#if __cplusplus >= 202002L
+
+// Calls f(std::integral_constant<unsigned, Bits>{}) for the key size matching keylen (in
+// bytes), so code templated on the key size can be picked from a runtime length. Returns
+// false when keylen is not a key size this build supports.
+template <typename F>
+constexpr bool DispatchKeySize(std::size_t keylen, F&& f)
+{
+  switch (keylen)
+  {
+    case KeySize<128>::KeyLen:
+      if constexpr (Supported<128>()) { f(std::integral_constant<unsigned, 128>{}); return true; }
+      break;
+    case KeySize<192>::KeyLen:
+      if constexpr (Supported<192>()) { f(std::integral_constant<unsigned, 192>{}); return true; }
+      break;
+    case KeySize<256>::KeyLen:
+      if constexpr (Supported<256>()) { f(std::integral_constant<unsigned, 256>{}); return true; }
+      break;
+  }
+  return false;
+}
+
+// Mode::Ecb etc., since ECB/CBC/CTR are the configuration macros from aes.h.
+enum class Mode { Ecb, Cbc, Ctr };
+
+template <Mode M>
+constexpr bool ModeEnabled()
+{
+  return (M == Mode::Ecb) ? (ECB == 1) : (M == Mode::Cbc) ? (CBC == 1) : (CTR == 1);
+}
+
+// Owns an AES_ctx for one key size and mode of operation. Contexts are move-only and the
+// round keys are zeroized when a context is destroyed or moved from.
+//
+// Every operation comes in-place and out-of-place; the out-of-place forms read in and write
+// in.size() bytes to out without a scratch copy, and in and out must either be the same
+// buffer or not overlap. ECB and CBC need whole blocks. An operation returns false, and
+// touches nothing, when the sizes are wrong. CTR calls can be chained on a stream.
+template <unsigned Bits, Mode M>
+class AesContext
+{
+  static_assert(Supported<Bits>(), "key size needs AES_RUNTIME_KEYLEN or a matching AES128/AES192/AES256 build");
+  static_assert(ModeEnabled<M>(), "mode of operation is disabled in aes.h");
+
+public:
+  static constexpr std::size_t KeyLen = KeySize<Bits>::KeyLen;
+  static constexpr std::size_t BlockLen = AES_BLOCKLEN;
+
+  explicit AesContext(std::span<const std::byte, KeyLen> key) requires (M == Mode::Ecb)
+  {
+    detail::InitKey<Bits>(ctx_, reinterpret_cast<const std::uint8_t*>(key.data()));
+  }
+
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+  AesContext(std::span<const std::byte, KeyLen> key, std::span<const std::byte, BlockLen> iv) requires (M != Mode::Ecb)
+  {
+    detail::InitKey<Bits>(ctx_, reinterpret_cast<const std::uint8_t*>(key.data()));
+    SetIv(iv);
+  }
+#endif
+
+  AesContext(const AesContext&) = delete;
+  AesContext& operator=(const AesContext&) = delete;
+
+  AesContext(AesContext&& other) noexcept : ctx_(other.ctx_)
+  {
+    other.Wipe();
+  }
+
+  AesContext& operator=(AesContext&& other) noexcept
+  {
+    if (this != &other)
+    {
+      ctx_ = other.ctx_;
+      other.Wipe();
+    }
+    return *this;
+  }
+
+  ~AesContext()
+  {
+    Wipe();
+  }
+
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+  void SetIv(std::span<const std::byte, BlockLen> iv) requires (M != Mode::Ecb)
+  {
+    AES_ctx_set_iv(&ctx_, reinterpret_cast<const std::uint8_t*>(iv.data()));
+  }
+#endif
+
+  bool Encrypt(std::span<std::byte> buf)
+  {
+    return Encrypt(buf, buf);
+  }
+
+  bool Decrypt(std::span<std::byte> buf)
+  {
+    return Decrypt(buf, buf);
+  }
+
+  bool Encrypt(std::span<const std::byte> in, std::span<std::byte> out)
+  {
+    if (!Fits(in, out))
+    {
+      return false;
+    }
+    Run<true>(reinterpret_cast<std::uint8_t*>(out.data()), reinterpret_cast<const std::uint8_t*>(in.data()), in.size());
+    return true;
+  }
+
+  bool Decrypt(std::span<const std::byte> in, std::span<std::byte> out)
+  {
+    if (!Fits(in, out))
+    {
+      return false;
+    }
+    Run<false>(reinterpret_cast<std::uint8_t*>(out.data()), reinterpret_cast<const std::uint8_t*>(in.data()), in.size());
+    return true;
+  }
+
+  // The underlying C context, for APIs that are not wrapped here.
+  AES_ctx& Native() noexcept { return ctx_; }
+  const AES_ctx& Native() const noexcept { return ctx_; }
+
+private:
+  static bool Fits(std::span<const std::byte> in, std::span<std::byte> out)
+  {
+    return (out.size() >= in.size()) && ((M == Mode::Ctr) || (in.size() % BlockLen == 0));
+  }
+
+  // The C functions of disabled modes are not declared, hence the #if around each branch.
+  template <bool Encrypting>
+  void Run(std::uint8_t* out, const std::uint8_t* in, std::size_t length)
+  {
+#if defined(ECB) && (ECB == 1)
+    if constexpr (M == Mode::Ecb)
+    {
+      for (std::size_t n = 0; n < length; n += BlockLen)
+      {
+        if (out != in)
+        {
+          std::memcpy(out + n, in + n, BlockLen);
+        }
+        if constexpr (Encrypting) { AES_ECB_encrypt(&ctx_, out + n); } else { AES_ECB_decrypt(&ctx_, out + n); }
+      }
+    }
+#endif
+#if defined(CBC) && (CBC == 1)
+    if constexpr (M == Mode::Cbc)
+    {
+      if constexpr (Encrypting) { AES_CBC_encrypt_buffer_to(&ctx_, out, in, length); } else { AES_CBC_decrypt_buffer_to(&ctx_, out, in, length); }
+    }
+#endif
+#if defined(CTR) && (CTR == 1)
+    if constexpr (M == Mode::Ctr)
+    {
+      AES_CTR_xcrypt_buffer_to(&ctx_, out, in, length);
+    }
+#endif
+  }
+
+  void Wipe() noexcept
+  {
+    AES_secure_zero(&ctx_, sizeof(ctx_));
+  }
+
+  AES_ctx ctx_;
+};
+
+#endif // #if __cplusplus >= 202002L
+
+} // namespace aes
+
+#endif // #if __cplusplus >= 201103L
+
 #endif //_AES_HPP_
@@ -0,0 +1,241 @@
+// Encrypts or decrypts a whole file in CTR or CBC mode through memory mappings
+// To build, gcc -O2 aes_file.c aes.c aes_parallel.c -o aes_file -pthread
+//
+//   ./aes_file -e|-d -m ctr|cbc -k KEYHEX -i IVHEX [-t THREADS] [-c CHUNK_MB] IN OUT
+//
+// Both files are mapped, so the cipher reads the page cache of IN and writes straight into
+// the page cache of OUT, with no read()/write() copies in between. The work goes in chunks
+// (64 MiB by default): the next input chunk is prefetched while the current one is
+// processed, and finished input chunks are dropped from the mapping so a file of many GB
+// does not stay resident. CTR in both directions and CBC decryption run on THREADS
+// threads (0 = one per CPU, the default); CBC encryption is sequential by nature. CBC
+// uses PKCS#7 padding. The key is 16 bytes (24 or 32 with -DAES_RUNTIME_KEYLEN=1), the IV
+// 16, both given as hex.
+
+#define _GNU_SOURCE
+#include "aes.h"
+#include "aes_parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CHUNK_MB 64
+#define MAX_CHUNK_MB 65536
+
+static int parse_hex(const char *hex, uint8_t *out, size_t max) {
+    size_t len = strlen(hex), i;
+
+    if (len % 2 != 0 || len / 2 > max)
+        return -1;
+    for (i = 0; i < len / 2; ++i) {
+        unsigned v;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+            return -1;
+        out[i] = (uint8_t)v;
+    }
+    return (int)i;
+}
+
+// Parses a decimal number from min to max. Returns -1 for anything else, including a
+// sign, trailing characters and overflow, which atoi() would take without a word.
+static int parse_count(const char *text, unsigned long min, unsigned long max, unsigned long *out) {
+    char *end;
+    unsigned long v;
+
+    if (*text < '0' || *text > '9')
+        return -1;
+    errno = 0;
+    v = strtoul(text, &end, 10);
+    if (errno != 0 || *end != '\0' || v < min || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int init_ctx(struct AES_ctx *ctx, const uint8_t *key, int keylen, const uint8_t *iv) {
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+    return AES_init_ctx_iv_keylen(ctx, key, keylen, iv);
+#else
+    if (keylen != AES_KEYLEN)
+        return -1;
+    AES_init_ctx_iv(ctx, key, iv);
+    return 0;
+#endif
+}
+
+// Maps len bytes of fd (nothing for an empty file) and tells the kernel how they are used.
+static uint8_t *map_file(int fd, size_t len, int writable) {
+    uint8_t *p;
+
+    if (len == 0)
+        return NULL;
+    p = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+    madvise(p, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Only some file systems back file mappings with huge pages; elsewhere this is a no-op.
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s -e|-d -m ctr|cbc -k KEYHEX -i IVHEX [-t THREADS] [-c CHUNK_MB] IN OUT\n", prog);
+}
+
+int main(int argc, char **argv) {
+    uint8_t key[32], iv[AES_BLOCKLEN];
+    int keylen = -1, have_iv = 0, encrypting = -1, cbc = -1, opt;
+    unsigned long threads = 0, chunk_mb = DEFAULT_CHUNK_MB;
+
+    while ((opt = getopt(argc, argv, "edm:k:i:t:c:")) != -1) {
+        switch (opt) {
+        case 'e': encrypting = 1; break;
+        case 'd': encrypting = 0; break;
+        case 'm': cbc = !strcmp(optarg, "cbc") ? 1 : !strcmp(optarg, "ctr") ? 0 : -1; break;
+        case 'k': keylen = parse_hex(optarg, key, sizeof(key)); break;
+        case 'i': have_iv = parse_hex(optarg, iv, sizeof(iv)) == AES_BLOCKLEN; break;
+        case 't':
+            if (parse_count(optarg, 0, AES_PARALLEL_MAX_THREADS, &threads) != 0) {
+                fprintf(stderr, "-t: THREADS must be 0 to %d\n", AES_PARALLEL_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (parse_count(optarg, 1, MAX_CHUNK_MB, &chunk_mb) != 0) {
+                fprintf(stderr, "-c: CHUNK_MB must be 1 to %d\n", MAX_CHUNK_MB);
+                return 1;
+            }
+            break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (encrypting < 0 || cbc < 0 || keylen < 0 || !have_iv || optind + 2 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct AES_ctx ctx;
+    if (init_ctx(&ctx, key, keylen, iv) != 0) {
+        fprintf(stderr, "the key must be %d bytes\n", AES_KEYLEN);
+        return 1;
+    }
+
+    // From here on every exit goes through out, which unmaps, closes and, unless the
+    // output is complete, removes it.
+    const char *in_path = argv[optind], *out_path = argv[optind + 1];
+    int in_fd = -1, out_fd = -1, status = 1, keep_out = 0;
+    uint8_t *in = MAP_FAILED, *out = MAP_FAILED;
+    size_t in_len = 0, out_len = 0, mapped_len = 0;
+    size_t chunk = (size_t)chunk_mb << 20;
+    double seconds = 0;
+    struct stat st;
+
+    in_fd = open(in_path, O_RDONLY);
+    if (in_fd < 0 || fstat(in_fd, &st) != 0) {
+        perror(in_path);
+        goto out;
+    }
+    in_len = (size_t)st.st_size;
+    if (cbc && !encrypting && (in_len == 0 || in_len % AES_BLOCKLEN != 0)) {
+        fprintf(stderr, "%s: CBC ciphertext must be a non-empty multiple of %d bytes\n", in_path, AES_BLOCKLEN);
+        goto out;
+    }
+    // CBC encryption always adds 1 to 16 bytes of padding.
+    out_len = (cbc && encrypting) ? (in_len / AES_BLOCKLEN + 1) * AES_BLOCKLEN : in_len;
+
+    out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror(out_path);
+        goto out;
+    }
+    if (ftruncate(out_fd, (off_t)out_len) != 0) {
+        perror(out_path);
+        goto out;
+    }
+    in = map_file(in_fd, in_len, 0);
+    mapped_len = out_len;
+    out = map_file(out_fd, mapped_len, 1);
+    if (in == MAP_FAILED || out == MAP_FAILED) {
+        perror("mmap");
+        goto out;
+    }
+
+    double t0 = now_seconds();
+    // Whole blocks go through in chunks; with CBC encryption the last partial block is left
+    // for the padding below.
+    size_t body = (cbc && encrypting) ? in_len / AES_BLOCKLEN * AES_BLOCKLEN : in_len;
+    chunk = (chunk + AES_BLOCKLEN - 1) / AES_BLOCKLEN * AES_BLOCKLEN;
+    for (size_t pos = 0; pos < body; pos += chunk) {
+        size_t n = body - pos < chunk ? body - pos : chunk;
+        if (pos + n < in_len)
+            madvise(in + pos + n, in_len - (pos + n) < chunk ? in_len - (pos + n) : chunk, MADV_WILLNEED);
+        if (!cbc)
+            AES_CTR_xcrypt_buffer_mt(&ctx, out + pos, in + pos, n, (unsigned)threads);
+        else if (encrypting)
+            AES_CBC_encrypt_buffer_to(&ctx, out + pos, in + pos, n);
+        else
+            AES_CBC_decrypt_buffer_mt(&ctx, out + pos, in + pos, n, (unsigned)threads);
+        // Done with this part of the input; the page cache keeps it if there is room.
+        madvise(in + pos, n, MADV_DONTNEED);
+    }
+
+    if (cbc && encrypting) {
+        uint8_t last[AES_BLOCKLEN];
+        size_t rest = in_len - body;
+        memcpy(last, in + body, rest);
+        memset(last + rest, (int)(AES_BLOCKLEN - rest), AES_BLOCKLEN - rest);
+        AES_CBC_encrypt_buffer_to(&ctx, out + body, last, AES_BLOCKLEN);
+    } else if (cbc) {
+        uint8_t pad = out[out_len - 1];
+        int bad = pad == 0 || pad > AES_BLOCKLEN;
+        for (size_t i = 1; !bad && i <= pad; ++i)
+            bad = out[out_len - i] != pad;
+        if (bad) {
+            fprintf(stderr, "%s: bad padding, wrong key or IV?\n", in_path);
+            goto out;
+        }
+        out_len -= pad;
+    }
+    seconds = now_seconds() - t0;
+
+    // Drops the padding that CBC decryption removed.
+    if (out_len != mapped_len && ftruncate(out_fd, (off_t)out_len) != 0) {
+        perror(out_path);
+        goto out;
+    }
+    keep_out = 1;
+    status = 0;
+
+out:
+    if (in != MAP_FAILED && in)
+        munmap(in, in_len);
+    if (out != MAP_FAILED && out)
+        munmap(out, mapped_len);
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0) {
+        close(out_fd);
+        if (!keep_out)
+            unlink(out_path);
+    }
+    if (status != 0)
+        return status;
+
+    fprintf(stderr, "%s %zu bytes in %.3f s: %.1f MB/s\n", encrypting ? "encrypted" : "decrypted", in_len,
+            seconds, seconds > 0 ? in_len / seconds / 1e6 : 0.0);
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _AES_INTERNAL_H_
+#define _AES_INTERNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "aes.h"
+
+// Helpers of aes.c that the other files of this directory share. Not part of the API.
+
+// Clears len bytes at p in a way the compiler cannot drop as a dead store, for key
+// material that is about to be freed or go out of scope.
+void AES_secure_zero(void* p, size_t len);
+
+#if defined(CTR) && (CTR == 1)
+// Adds blocks to the big-endian 128-bit counter in Iv, modulo 2^128.
+void AES_ctr_counter_add(uint8_t* Iv, uint64_t blocks);
+// Writes in XOR keystream to out, which may be in.
+void AES_xor_keystream(uint8_t* out, const uint8_t* in, const uint8_t* keystream, size_t length);
+#endif
+
+#endif // _AES_INTERNAL_H_
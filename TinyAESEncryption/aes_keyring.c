@@ -0,0 +1,358 @@
+/*
+
+Key-schedule cache, see aes_keyring.h.
+
+The table is open addressing with linear probing over 16-byte slots, four to a cache
+line, and at most half full. A slot is claimed for a key ID once and never moves, so a
+reader can probe without a lock: it matches the ID, then loads the schedule pointer with
+acquire ordering, which makes the whole schedule written before the release store
+visible. Schedules are never changed after they are published; a new key gets a new
+schedule and the old one goes on the retired list.
+
+Retired schedules are freed in two generations: AES_keyring_reclaim() frees the ones
+that were already retired at the call before it, and moves the ones retired since then
+into their place. A reader therefore has a whole reclaim period to finish with a
+context, and the writers never have to know which readers exist.
+
+The hit/miss counters are striped: COUNTER_STRIPES counter pairs, one to a cache line,
+and each thread bumps the pair picked by a hash of its thread-local storage address.
+Threads that share a pair do so rarely, and only cost each other a cache line transfer;
+there is no lock, nothing to register and nothing left behind when a thread exits.
+AES_keyring_stats() sums the pairs.
+
+To build, add aes_keyring.c to the sources and link with -pthread.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aes_keyring.h"
+#include "aes_internal.h"
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define CACHE_LINE 64
+#define COUNTER_STRIPES 64             // power of two
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+struct Schedule
+{
+  struct AES_ctx Ctx;
+  struct Schedule* Retired; // next on the retired list
+};
+
+struct Slot
+{
+  _Atomic uint64_t Id;                 // key ID + 1, 0 while the slot is free
+  _Atomic(struct Schedule*) Schedule;  // NULL when the key was removed
+};
+
+// Lookup counts of the threads that hash to this stripe.
+struct Counters
+{
+  alignas(CACHE_LINE) _Atomic uint64_t Hits;
+  _Atomic uint64_t Misses;
+};
+
+struct AES_keyring
+{
+  struct Slot* Slots;
+  size_t Mask;
+  size_t Capacity;
+  size_t Used;                         // slots claimed, under Lock
+  struct Schedule* Retired;            // retired since the last reclaim, under Lock
+  struct Schedule* Reclaimable;        // retired before it, under Lock
+  pthread_mutex_t Lock;
+  struct Counters Counters[COUNTER_STRIPES];
+};
+
+// The stripe of the calling thread + 1, 0 until its first lookup.
+static _Thread_local unsigned LocalStripe;
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static size_t Hash(const struct AES_keyring* kr, uint32_t id)
+{
+  // Fibonacci hashing spreads consecutive IDs over the table.
+  return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32) & kr->Mask;
+}
+
+// Returns the slot of id, or NULL. With claim, a free slot is claimed for id instead;
+// only writers, holding the lock, may claim.
+static struct Slot* FindSlot(struct AES_keyring* kr, uint32_t id, int claim)
+{
+  size_t i = Hash(kr, id);
+  uint64_t tag = (uint64_t)id + 1;
+
+  for (;;)
+  {
+    struct Slot* s = &kr->Slots[i];
+    uint64_t current = atomic_load_explicit(&s->Id, memory_order_acquire);
+    if (current == tag)
+    {
+      return s;
+    }
+    if (current == 0)
+    {
+      if (!claim || kr->Used == kr->Capacity)
+      {
+        return NULL;
+      }
+      ++kr->Used;
+      atomic_store_explicit(&s->Id, tag, memory_order_release);
+      return s;
+    }
+    i = (i + 1) & kr->Mask;
+  }
+}
+
+static int Expand(struct AES_ctx* ctx, const uint8_t* key, size_t keylen)
+{
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+  return AES_init_ctx_keylen(ctx, key, keylen);
+#else
+  if (keylen != AES_KEYLEN)
+  {
+    return -1;
+  }
+  AES_init_ctx(ctx, key);
+  return 0;
+#endif
+}
+
+// The address of a thread-local variable is different for every live thread and costs
+// nothing to get, unlike a portable thread ID.
+static unsigned ThreadStripe(void)
+{
+  if (LocalStripe == 0)
+  {
+    uint64_t h = (uint64_t)(uintptr_t)&LocalStripe * 0x9E3779B97F4A7C15ull;
+    LocalStripe = (unsigned)(h >> 58) % COUNTER_STRIPES + 1;
+  }
+  return LocalStripe - 1;
+}
+
+static void CountLookup(struct AES_keyring* kr, int found)
+{
+  struct Counters* c = &kr->Counters[ThreadStripe()];
+
+  atomic_fetch_add_explicit(found ? &c->Hits : &c->Misses, 1, memory_order_relaxed);
+}
+
+static void FreeSchedules(struct Schedule* s)
+{
+  while (s != NULL)
+  {
+    struct Schedule* next = s->Retired;
+    AES_secure_zero(s, sizeof(*s));
+    free(s);
+    s = next;
+  }
+}
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+struct AES_keyring* AES_keyring_new(size_t capacity)
+{
+  struct AES_keyring* kr;
+  size_t n = 16;
+
+  kr = aligned_alloc(CACHE_LINE, (sizeof(*kr) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  if (kr == NULL)
+  {
+    return NULL;
+  }
+  memset(kr, 0, sizeof(*kr));
+  while (n < 2 * capacity)
+  {
+    n *= 2;
+  }
+  kr->Slots = aligned_alloc(CACHE_LINE, n * sizeof(struct Slot));
+  if (kr->Slots == NULL || pthread_mutex_init(&kr->Lock, NULL) != 0)
+  {
+    free(kr->Slots);
+    free(kr);
+    return NULL;
+  }
+  for (size_t i = 0; i < n; ++i)
+  {
+    atomic_init(&kr->Slots[i].Id, 0);
+    atomic_init(&kr->Slots[i].Schedule, NULL);
+  }
+  for (size_t i = 0; i < COUNTER_STRIPES; ++i)
+  {
+    atomic_init(&kr->Counters[i].Hits, 0);
+    atomic_init(&kr->Counters[i].Misses, 0);
+  }
+  kr->Mask = n - 1;
+  kr->Capacity = capacity;
+  return kr;
+}
+
+void AES_keyring_free(struct AES_keyring* kr)
+{
+  if (kr == NULL)
+  {
+    return;
+  }
+  for (size_t i = 0; i <= kr->Mask; ++i)
+  {
+    struct Schedule* s = atomic_load_explicit(&kr->Slots[i].Schedule, memory_order_relaxed);
+    if (s != NULL)
+    {
+      AES_secure_zero(s, sizeof(*s));
+      free(s);
+    }
+  }
+  FreeSchedules(kr->Retired);
+  FreeSchedules(kr->Reclaimable);
+  pthread_mutex_destroy(&kr->Lock);
+  free(kr->Slots);
+  free(kr);
+}
+
+int AES_keyring_set(struct AES_keyring* kr, uint32_t id, const uint8_t* key, size_t keylen)
+{
+  struct Schedule* s;
+  struct Slot* slot;
+
+  s = aligned_alloc(CACHE_LINE, (sizeof(*s) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  if (s == NULL)
+  {
+    return -1;
+  }
+  // The expansion runs outside the lock, so lookups and other writers never wait on it.
+  if (Expand(&s->Ctx, key, keylen) != 0)
+  {
+    free(s);
+    return -1;
+  }
+  s->Retired = NULL;
+
+  pthread_mutex_lock(&kr->Lock);
+  slot = FindSlot(kr, id, 1);
+  if (slot == NULL)
+  {
+    pthread_mutex_unlock(&kr->Lock);
+    AES_secure_zero(s, sizeof(*s));
+    free(s);
+    return -1;
+  }
+  struct Schedule* old = atomic_exchange_explicit(&slot->Schedule, s, memory_order_acq_rel);
+  if (old != NULL)
+  {
+    old->Retired = kr->Retired;
+    kr->Retired = old;
+  }
+  pthread_mutex_unlock(&kr->Lock);
+  return 0;
+}
+
+int AES_keyring_remove(struct AES_keyring* kr, uint32_t id)
+{
+  struct Schedule* old = NULL;
+  struct Slot* slot;
+
+  pthread_mutex_lock(&kr->Lock);
+  slot = FindSlot(kr, id, 0);
+  if (slot != NULL)
+  {
+    old = atomic_exchange_explicit(&slot->Schedule, NULL, memory_order_acq_rel);
+  }
+  if (old != NULL)
+  {
+    old->Retired = kr->Retired;
+    kr->Retired = old;
+  }
+  pthread_mutex_unlock(&kr->Lock);
+  return (old != NULL) ? 0 : -1;
+}
+
+const struct AES_ctx* AES_keyring_find(struct AES_keyring* kr, uint32_t id)
+{
+  struct Slot* slot = FindSlot(kr, id, 0);
+  struct Schedule* s = NULL;
+
+  if (slot != NULL)
+  {
+    s = atomic_load_explicit(&slot->Schedule, memory_order_acquire);
+  }
+  CountLookup(kr, s != NULL);
+  return (s != NULL) ? &s->Ctx : NULL;
+}
+
+int AES_keyring_load(struct AES_keyring* kr, uint32_t id, struct AES_ctx* ctx)
+{
+  const struct AES_ctx* keyed = AES_keyring_find(kr, id);
+
+  if (keyed == NULL)
+  {
+    return -1;
+  }
+  memcpy(ctx, keyed, sizeof(*ctx));
+  return 0;
+}
+
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+int AES_keyring_load_iv(struct AES_keyring* kr, uint32_t id, struct AES_ctx* ctx, const uint8_t* iv)
+{
+  if (AES_keyring_load(kr, id, ctx) != 0)
+  {
+    return -1;
+  }
+  AES_ctx_set_iv(ctx, iv);
+  return 0;
+}
+#endif
+
+#if defined(CBC) && (CBC == 1)
+size_t AES_keyring_bind(struct AES_keyring* kr, struct AES_batch_job* jobs, size_t count)
+{
+  size_t missing = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    jobs[i].ctx = AES_keyring_find(kr, jobs[i].key_id);
+    missing += (jobs[i].ctx == NULL);
+  }
+  return missing;
+}
+#endif
+
+void AES_keyring_reclaim(struct AES_keyring* kr)
+{
+  struct Schedule* old;
+
+  pthread_mutex_lock(&kr->Lock);
+  old = kr->Reclaimable;
+  kr->Reclaimable = kr->Retired;
+  kr->Retired = NULL;
+  pthread_mutex_unlock(&kr->Lock);
+  // Wiping and freeing happen outside the lock, so writers never wait on them.
+  FreeSchedules(old);
+}
+
+void AES_keyring_stats(struct AES_keyring* kr, uint64_t* hits, uint64_t* misses)
+{
+  uint64_t h = 0, m = 0;
+
+  for (size_t i = 0; i < COUNTER_STRIPES; ++i)
+  {
+    h += atomic_load_explicit(&kr->Counters[i].Hits, memory_order_relaxed);
+    m += atomic_load_explicit(&kr->Counters[i].Misses, memory_order_relaxed);
+  }
+  *hits = h;
+  *misses = m;
+}
@@ -0,0 +1,62 @@
+#ifndef _AES_KEYRING_H_
+#define _AES_KEYRING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "aes.h"
+
+// Key-schedule cache for hosts that juggle many keys, e.g. a ground station with one key
+// per spacecraft link. AES_keyring_set() runs the key expansion once per key ID and keeps
+// the keyed context (round keys, decryption round keys and whatever else AES_init_ctx()
+// derives for the enabled modes); a packet's key ID then maps to that schedule without
+// expanding the key again.
+//
+// Lookups take no lock (the hit/miss counters are striped over cache lines by thread), so
+// any number of threads can look up keys while another one adds, replaces or removes
+// them. Writers are serialized by a mutex. A schedule that is replaced or removed stays
+// valid, because a reader may still be using it, until the second AES_keyring_reclaim()
+// after that. Between two calls of AES_keyring_reclaim(), every thread that looks up keys
+// must be done with the contexts it found before the first one; a host whose workers
+// finish a frame well within a second can simply call it once a second.
+// This file is not needed for flight builds; compile it only where pthreads exist.
+
+struct AES_keyring;
+
+// capacity is the number of distinct key IDs the keyring can hold over its lifetime (a
+// removed ID keeps its place and can be set again). Returns NULL when out of memory.
+struct AES_keyring* AES_keyring_new(size_t capacity);
+// Clears every schedule, also the retired ones, and frees the keyring.
+void AES_keyring_free(struct AES_keyring* kr);
+// Clears and frees the schedules that were already retired at the previous call, so
+// contexts found before the previous call must no longer be in use.
+void AES_keyring_reclaim(struct AES_keyring* kr);
+
+// Adds the key for id, or replaces it. keylen is in bytes: AES_KEYLEN, or 16, 24 or 32
+// with AES_RUNTIME_KEYLEN. Returns 0, or -1 for a bad key length, a full keyring or no
+// memory.
+int AES_keyring_set(struct AES_keyring* kr, uint32_t id, const uint8_t* key, size_t keylen);
+// Returns 0, or -1 when id has no key.
+int AES_keyring_remove(struct AES_keyring* kr, uint32_t id);
+
+// The keyed context for id, or NULL. It is shared: use it directly only with functions
+// that take a const context (ECB, AES_CMAC_buffer), and copy it for anything that keeps
+// state in the context.
+const struct AES_ctx* AES_keyring_find(struct AES_keyring* kr, uint32_t id);
+// Copies the keyed context for id into ctx, which is then ready to use as if
+// AES_init_ctx() had run. Returns 0, or -1 (ctx untouched) when id has no key.
+int AES_keyring_load(struct AES_keyring* kr, uint32_t id, struct AES_ctx* ctx);
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+int AES_keyring_load_iv(struct AES_keyring* kr, uint32_t id, struct AES_ctx* ctx, const uint8_t* iv);
+#endif
+
+#if defined(CBC) && (CBC == 1)
+// Sets ctx of every job to the schedule of its key_id, for AES_CBC_encrypt_batch() and
+// AES_CBC_decrypt_batch(). A job whose key_id has no key gets ctx NULL and must be taken
+// out before the batch runs. Returns the number of such jobs.
+size_t AES_keyring_bind(struct AES_keyring* kr, struct AES_batch_job* jobs, size_t count);
+#endif
+
+// Lookups that found a key and lookups that did not, since AES_keyring_new().
+void AES_keyring_stats(struct AES_keyring* kr, uint64_t* hits, uint64_t* misses);
+
+#endif // _AES_KEYRING_H_
@@ -0,0 +1,351 @@
+/*
+
+CTR keystream cache, see aes_keystream.h.
+
+Every stream has a ring of keystream blocks, indexed by absolute block number modulo the
+ring size. Blocks [Tail, Head) are ready: the producer computes blocks from Head up to
+Tail + ring size and publishes them by moving Head with release ordering; the consumer
+XORs from blocks at or after Tail and moves Tail past what it no longer needs. Each
+index is written by one side only, so the ring needs no lock.
+
+The producer picks the stream with the most free space, fills at most a quarter of its
+ring and picks again, so one busy link cannot starve the others. When every ring is
+full it sleeps for REFILL_NS and then tops them up again. Consumers do not wake it in
+the normal case: a futex call on the frame path is exactly the kind of latency spike
+the cache is there to remove. Only a consumer that finds its ring less than a quarter
+full signals, so a link that is faster than the refill period still gets served. The
+Sleeping flag and Tail are both sequentially consistent, so either the producer sees
+the new Tail before it sleeps or the consumer sees the flag and signals.
+
+To build, add aes_keystream.c to the sources and link with -pthread.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aes_keystream.h"
+#include "aes_internal.h"
+
+#if defined(CTR) && (CTR == 1)
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define CACHE_LINE 64
+#define MIN_BLOCKS 64
+// Head is published after every FILL_BLOCKS, so a frame that arrives while a ring is
+// being refilled can already use the first part.
+#define FILL_BLOCKS 64
+// How long the producer sleeps while all rings are full. A stream should not consume
+// more than three quarters of its ring in this time.
+#define REFILL_NS 1000000
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+struct AES_keystream
+{
+  struct AES_ctx Ctx;
+  struct AES_keystream_cache* Cache;
+  uint8_t* Ring;                              // Cache->Blocks blocks
+  struct AES_keystream* Next;                 // on the cache's list, under Lock
+  int Busy;                                   // being filled, under Lock
+  uint64_t Pos;                               // where AES_keystream_xcrypt() goes on
+  alignas(CACHE_LINE) _Atomic uint64_t Head;  // written by the producer
+  alignas(CACHE_LINE) _Atomic uint64_t Tail;  // written by the consumer
+};
+
+struct AES_keystream_cache
+{
+  size_t Blocks;                              // ring size, a power of two
+  struct AES_keystream* Streams;              // under Lock
+  int Stop;                                   // under Lock
+  pthread_t Producer;
+  pthread_mutex_t Lock;
+  pthread_cond_t Work;                        // the producer waits here for free space
+  pthread_cond_t Idle;                        // AES_keystream_close() waits here for Busy
+  _Atomic int Sleeping;
+  alignas(CACHE_LINE) _Atomic uint64_t Hits;
+  alignas(CACHE_LINE) _Atomic uint64_t Misses;
+};
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+// Free blocks in the ring of ks, and in *from the first block to compute. A consumer
+// that skipped ahead of Head leaves nothing worth keeping.
+static size_t FreeBlocks(const struct AES_keystream* ks, uint64_t* from)
+{
+  uint64_t head = atomic_load_explicit(&ks->Head, memory_order_relaxed);
+  uint64_t tail = atomic_load(&ks->Tail);
+
+  if (head < tail)
+  {
+    head = tail;
+  }
+  *from = head;
+  return (size_t)(tail + ks->Cache->Blocks - head);
+}
+
+// The stream with the most free space, if any has FILL_BLOCKS free.
+static struct AES_keystream* Neediest(struct AES_keystream_cache* cache)
+{
+  struct AES_keystream* best = NULL;
+  size_t most = FILL_BLOCKS - 1;
+  uint64_t from;
+
+  for (struct AES_keystream* ks = cache->Streams; ks != NULL; ks = ks->Next)
+  {
+    size_t n = FreeBlocks(ks, &from);
+    if (n > most)
+    {
+      most = n;
+      best = ks;
+    }
+  }
+  return best;
+}
+
+static void Fill(struct AES_keystream* ks)
+{
+  const size_t blocks = ks->Cache->Blocks;
+  size_t budget = blocks / 4, n, slot;
+  uint64_t from;
+
+  for (n = FreeBlocks(ks, &from); n > 0 && budget > 0; n = FreeBlocks(ks, &from))
+  {
+    slot = (size_t)from & (blocks - 1);
+    n = (n < budget) ? n : budget;
+    n = (n < FILL_BLOCKS) ? n : FILL_BLOCKS;
+    n = (n < blocks - slot) ? n : blocks - slot;
+    // The keystream is what CTR makes of zeros.
+    memset(ks->Ring + slot * AES_BLOCKLEN, 0, n * AES_BLOCKLEN);
+    AES_CTR_xcrypt_at(&ks->Ctx, from * AES_BLOCKLEN, ks->Ring + slot * AES_BLOCKLEN, ks->Ring + slot * AES_BLOCKLEN,
+                      n * AES_BLOCKLEN);
+    atomic_store_explicit(&ks->Head, from + n, memory_order_release);
+    budget -= n;
+  }
+}
+
+static void* Producer(void* arg)
+{
+  struct AES_keystream_cache* cache = arg;
+  struct AES_keystream* ks;
+  struct timespec until;
+
+  pthread_mutex_lock(&cache->Lock);
+  while (!cache->Stop)
+  {
+    ks = Neediest(cache);
+    if (ks == NULL)
+    {
+      atomic_store(&cache->Sleeping, 1);
+      ks = Neediest(cache);
+      if (ks == NULL)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += REFILL_NS;
+        if (until.tv_nsec >= 1000000000L)
+        {
+          until.tv_sec += 1;
+          until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&cache->Work, &cache->Lock, &until);
+      }
+      atomic_store(&cache->Sleeping, 0);
+      continue;
+    }
+    ks->Busy = 1;
+    pthread_mutex_unlock(&cache->Lock);
+    Fill(ks);
+    pthread_mutex_lock(&cache->Lock);
+    ks->Busy = 0;
+    pthread_cond_broadcast(&cache->Idle);
+  }
+  pthread_mutex_unlock(&cache->Lock);
+  return NULL;
+}
+
+static void Wake(struct AES_keystream_cache* cache)
+{
+  pthread_mutex_lock(&cache->Lock);
+  pthread_cond_signal(&cache->Work);
+  pthread_mutex_unlock(&cache->Lock);
+}
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+struct AES_keystream_cache* AES_keystream_cache_new(size_t ahead)
+{
+  struct AES_keystream_cache* cache;
+  size_t blocks = MIN_BLOCKS;
+
+  while (blocks * AES_BLOCKLEN < ahead)
+  {
+    blocks *= 2;
+  }
+  cache = aligned_alloc(CACHE_LINE, (sizeof(*cache) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  if (cache == NULL)
+  {
+    return NULL;
+  }
+  memset(cache, 0, sizeof(*cache));
+  cache->Blocks = blocks;
+  atomic_init(&cache->Sleeping, 0);
+  atomic_init(&cache->Hits, 0);
+  atomic_init(&cache->Misses, 0);
+  if (pthread_mutex_init(&cache->Lock, NULL) != 0)
+  {
+    free(cache);
+    return NULL;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cache->Work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&cache->Idle, NULL);
+  if (pthread_create(&cache->Producer, NULL, Producer, cache) != 0)
+  {
+    pthread_cond_destroy(&cache->Work);
+    pthread_cond_destroy(&cache->Idle);
+    pthread_mutex_destroy(&cache->Lock);
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void AES_keystream_cache_free(struct AES_keystream_cache* cache)
+{
+  if (cache == NULL)
+  {
+    return;
+  }
+  pthread_mutex_lock(&cache->Lock);
+  cache->Stop = 1;
+  pthread_cond_signal(&cache->Work);
+  pthread_mutex_unlock(&cache->Lock);
+  pthread_join(cache->Producer, NULL);
+  pthread_cond_destroy(&cache->Work);
+  pthread_cond_destroy(&cache->Idle);
+  pthread_mutex_destroy(&cache->Lock);
+  free(cache);
+}
+
+struct AES_keystream* AES_keystream_open(struct AES_keystream_cache* cache, const struct AES_ctx* ctx)
+{
+  struct AES_keystream* ks;
+
+  ks = aligned_alloc(CACHE_LINE, (sizeof(*ks) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  if (ks == NULL)
+  {
+    return NULL;
+  }
+  ks->Ring = aligned_alloc(CACHE_LINE, cache->Blocks * AES_BLOCKLEN);
+  if (ks->Ring == NULL)
+  {
+    free(ks);
+    return NULL;
+  }
+  memcpy(&ks->Ctx, ctx, sizeof(ks->Ctx));
+  ks->Cache = cache;
+  ks->Busy = 0;
+  ks->Pos = 0;
+  atomic_init(&ks->Head, 0);
+  atomic_init(&ks->Tail, 0);
+
+  pthread_mutex_lock(&cache->Lock);
+  ks->Next = cache->Streams;
+  cache->Streams = ks;
+  pthread_cond_signal(&cache->Work);
+  pthread_mutex_unlock(&cache->Lock);
+  return ks;
+}
+
+void AES_keystream_close(struct AES_keystream* ks)
+{
+  struct AES_keystream_cache* cache;
+  struct AES_keystream** link;
+
+  if (ks == NULL)
+  {
+    return;
+  }
+  cache = ks->Cache;
+  pthread_mutex_lock(&cache->Lock);
+  for (link = &cache->Streams; *link != ks; link = &(*link)->Next)
+  {
+  }
+  *link = ks->Next;
+  while (ks->Busy)
+  {
+    pthread_cond_wait(&cache->Idle, &cache->Lock);
+  }
+  pthread_mutex_unlock(&cache->Lock);
+
+  AES_secure_zero(ks->Ring, cache->Blocks * AES_BLOCKLEN);
+  AES_secure_zero(&ks->Ctx, sizeof(ks->Ctx));
+  free(ks->Ring);
+  free(ks);
+}
+
+void AES_keystream_xcrypt_at(struct AES_keystream* ks, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length)
+{
+  struct AES_keystream_cache* cache = ks->Cache;
+  const size_t ring_len = cache->Blocks * AES_BLOCKLEN;
+  const uint64_t end = offset + length;
+  uint64_t tail = atomic_load_explicit(&ks->Tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&ks->Head, memory_order_acquire);
+  size_t n = 0, at, first;
+
+  if (offset / AES_BLOCKLEN >= tail && offset < head * AES_BLOCKLEN)
+  {
+    n = (head * AES_BLOCKLEN - offset < length) ? (size_t)(head * AES_BLOCKLEN - offset) : length;
+    at = (size_t)(offset & (ring_len - 1));
+    first = (n < ring_len - at) ? n : ring_len - at;
+    AES_xor_keystream(out, in, ks->Ring + at, first);
+    AES_xor_keystream(out + first, in + first, ks->Ring, n - first);
+    atomic_fetch_add_explicit(&cache->Hits, n, memory_order_relaxed);
+  }
+  if (n < length)
+  {
+    AES_CTR_xcrypt_at(&ks->Ctx, offset + n, out + n, in + n, length - n);
+    atomic_fetch_add_explicit(&cache->Misses, length - n, memory_order_relaxed);
+  }
+
+  // The block that end falls into may still be needed by the next frame.
+  if (end / AES_BLOCKLEN > tail)
+  {
+    tail = end / AES_BLOCKLEN;
+    atomic_store(&ks->Tail, tail);
+    head = (head > tail) ? head : tail;
+    if (head - tail < cache->Blocks / 4 && atomic_load(&cache->Sleeping))
+    {
+      Wake(cache);
+    }
+  }
+  ks->Pos = end;
+}
+
+void AES_keystream_xcrypt(struct AES_keystream* ks, uint8_t* out, const uint8_t* in, size_t length)
+{
+  AES_keystream_xcrypt_at(ks, ks->Pos, out, in, length);
+}
+
+void AES_keystream_cache_stats(struct AES_keystream_cache* cache, uint64_t* hit_bytes, uint64_t* miss_bytes)
+{
+  *hit_bytes = atomic_load_explicit(&cache->Hits, memory_order_relaxed);
+  *miss_bytes = atomic_load_explicit(&cache->Misses, memory_order_relaxed);
+}
+
+#endif // #if defined(CTR) && (CTR == 1)
@@ -0,0 +1,53 @@
+#ifndef _AES_KEYSTREAM_H_
+#define _AES_KEYSTREAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "aes.h"
+
+// CTR keystream computed ahead of the data. The counter blocks of a link are known
+// before the pass starts, so a producer thread can run the cipher while the link is
+// idle and keep a ring of keystream per open stream filled ahead of the read position.
+// When a frame arrives only the XOR is left, which takes the AES rounds off the path
+// from frame arrival to plaintext. Frames whose keystream is not in the ring (the
+// producer fell behind, or the frame is older than the ring) are handled by
+// AES_CTR_xcrypt_at() on the spot, so the output is always the same as plain CTR.
+//
+// One producer thread per cache serves all of its streams. While their rings are full it
+// sleeps and tops them up about once a millisecond; the consumers do not wake it unless
+// a ring drops below a quarter, which keeps system calls off the frame path. Size ahead
+// so a stream uses no more than three quarters of it per millisecond (64 KiB holds a
+// 48 MB/s link). Each stream must be used by one thread at a time. Needs CTR; compile
+// it only where pthreads exist, like aes_keyring.c.
+
+#if defined(CTR) && (CTR == 1)
+
+struct AES_keystream_cache;
+struct AES_keystream;
+
+// Starts the producer thread. ahead is the keystream kept per stream in bytes, rounded
+// up to a power of two blocks. Returns NULL when out of memory or threads.
+struct AES_keystream_cache* AES_keystream_cache_new(size_t ahead);
+// Stops the producer and frees the cache. Close the streams first.
+void AES_keystream_cache_free(struct AES_keystream_cache* cache);
+
+// Opens a stream whose counter block 0 is ctx->Iv; ctx is copied, so it can be reused
+// at once. The producer starts on it right away. Returns NULL when out of memory.
+struct AES_keystream* AES_keystream_open(struct AES_keystream_cache* cache, const struct AES_ctx* ctx);
+// Waits for the producer to let go of the stream, then clears and frees it.
+void AES_keystream_close(struct AES_keystream* ks);
+
+// Encrypts/decrypts the length bytes at byte offset of the stream, as
+// AES_CTR_xcrypt_at() would. Keystream before the end of the range is dropped, so the
+// ring moves on with the data; frames may skip ahead (lost frames cost nothing), but a
+// frame older than the last one is computed on the spot.
+void AES_keystream_xcrypt_at(struct AES_keystream* ks, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length);
+// Continues where the last call on the stream ended, like AES_CTR_xcrypt_buffer_to().
+void AES_keystream_xcrypt(struct AES_keystream* ks, uint8_t* out, const uint8_t* in, size_t length);
+
+// Bytes served from the rings and bytes computed on the spot, over all streams.
+void AES_keystream_cache_stats(struct AES_keystream_cache* cache, uint64_t* hit_bytes, uint64_t* miss_bytes);
+
+#endif // #if defined(CTR) && (CTR == 1)
+
+#endif // _AES_KEYSTREAM_H_
@@ -0,0 +1,202 @@
+/*
+
+Multi-threaded wrappers around the TinyAES modes of operation.
+
+Each thread gets its own copy of struct AES_ctx, so the round keys are shared by value
+and the caller's context is only touched before the threads start and after they join.
+
+To build, add aes_parallel.c to the sources and link with -pthread.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "aes_parallel.h"
+#include "aes_internal.h"
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+
+struct Job
+{
+  struct AES_ctx ctx;
+  uint8_t* out;
+  const uint8_t* in;
+  size_t length;
+  uint64_t offset; // stream position of in, for CTR
+};
+
+static unsigned ThreadCount(unsigned threads, size_t length)
+{
+  unsigned max;
+
+  if (threads == 0)
+  {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (online > 0) ? (unsigned)online : 1;
+  }
+  // Never hand a thread less than AES_PARALLEL_MIN_LENGTH bytes.
+  max = (unsigned)(length / AES_PARALLEL_MIN_LENGTH);
+  if (threads > max)
+  {
+    threads = max;
+  }
+  if (threads > AES_PARALLEL_MAX_THREADS)
+  {
+    threads = AES_PARALLEL_MAX_THREADS;
+  }
+  return (threads == 0) ? 1 : threads;
+}
+
+// Runs job[0] on the calling thread and the others on new threads. A job whose thread
+// cannot be created is run inline instead, so the result never depends on thread limits.
+static void RunJobs(struct Job* jobs, unsigned count, void* (*worker)(void*))
+{
+  pthread_t tid[AES_PARALLEL_MAX_THREADS];
+  uint8_t started[AES_PARALLEL_MAX_THREADS];
+  unsigned i;
+
+  for (i = 1; i < count; ++i)
+  {
+    started[i] = (pthread_create(&tid[i], NULL, worker, &jobs[i]) == 0);
+  }
+  worker(&jobs[0]);
+  for (i = 1; i < count; ++i)
+  {
+    if (started[i])
+    {
+      pthread_join(tid[i], NULL);
+    }
+    else
+    {
+      worker(&jobs[i]);
+    }
+  }
+}
+
+#endif // #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+#if defined(CBC) && (CBC == 1)
+
+static void* CbcDecryptWorker(void* arg)
+{
+  struct Job* job = (struct Job*)arg;
+  AES_CBC_decrypt_buffer_to(&job->ctx, job->out, job->in, job->length);
+  return NULL;
+}
+
+void AES_CBC_decrypt_buffer_mt(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length, unsigned threads)
+{
+  struct Job jobs[AES_PARALLEL_MAX_THREADS];
+  const size_t blocks = length / AES_BLOCKLEN;
+  size_t offset = 0;
+  unsigned count, i;
+
+  count = ThreadCount(threads, length);
+  if (count == 1)
+  {
+    AES_CBC_decrypt_buffer_to(ctx, out, in, length);
+    return;
+  }
+
+  // Every chunk's IV is the ciphertext block just before it. They are all captured
+  // here, before any thread runs, because in-place decryption overwrites them.
+  for (i = 0; i < count; ++i)
+  {
+    const size_t chunk = ((blocks / count) + (i < blocks % count)) * AES_BLOCKLEN;
+    jobs[i].ctx = *ctx;
+    if (i > 0)
+    {
+      AES_ctx_set_iv(&jobs[i].ctx, in + offset - AES_BLOCKLEN);
+    }
+    jobs[i].out = out + offset;
+    jobs[i].in = in + offset;
+    jobs[i].length = chunk;
+    offset += chunk;
+  }
+  AES_ctx_set_iv(ctx, in + offset - AES_BLOCKLEN);
+
+  RunJobs(jobs, count, CbcDecryptWorker);
+}
+
+#endif // #if defined(CBC) && (CBC == 1)
+
+#if defined(CTR) && (CTR == 1)
+
+static void* CtrWorker(void* arg)
+{
+  struct Job* job = (struct Job*)arg;
+  AES_CTR_xcrypt_at(&job->ctx, job->offset, job->out, job->in, job->length);
+  return NULL;
+}
+
+void AES_CTR_xcrypt_at_mt(const struct AES_ctx* ctx, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length, unsigned threads)
+{
+  struct Job jobs[AES_PARALLEL_MAX_THREADS];
+  const size_t blocks = length / AES_BLOCKLEN;
+  size_t done = 0;
+  unsigned count, i;
+
+  count = ThreadCount(threads, length);
+  if (count == 1)
+  {
+    AES_CTR_xcrypt_at(ctx, offset, out, in, length);
+    return;
+  }
+
+  // Whole blocks per thread; the last one also takes the bytes after the last block.
+  for (i = 0; i < count; ++i)
+  {
+    size_t chunk = ((blocks / count) + (i < blocks % count)) * AES_BLOCKLEN;
+    if (i == count - 1)
+    {
+      chunk = length - done;
+    }
+    jobs[i].ctx = *ctx;
+    jobs[i].out = out + done;
+    jobs[i].in = in + done;
+    jobs[i].length = chunk;
+    jobs[i].offset = offset + done;
+    done += chunk;
+  }
+
+  RunJobs(jobs, count, CtrWorker);
+}
+
+void AES_CTR_xcrypt_buffer_mt(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length, unsigned threads)
+{
+  size_t blocks;
+
+  if (ThreadCount(threads, length) == 1)
+  {
+    AES_CTR_xcrypt_buffer_to(ctx, out, in, length);
+    return;
+  }
+
+  // Finish the block started by the previous call, as AES_CTR_xcrypt_buffer_to() would.
+  while (length > 0 && ctx->KeystreamOffset < AES_BLOCKLEN)
+  {
+    *out++ = *in++ ^ ctx->Keystream[ctx->KeystreamOffset++];
+    --length;
+  }
+
+  // ctx->Iv is the counter of the next block, so the whole blocks start at offset 0.
+  blocks = length / AES_BLOCKLEN;
+  AES_CTR_xcrypt_at_mt(ctx, 0, out, in, blocks * AES_BLOCKLEN, threads);
+  AES_ctr_counter_add(ctx->Iv, blocks);
+
+  // The partial last block, whose unused keystream stays in ctx.
+  AES_CTR_xcrypt_buffer_to(ctx, out + (blocks * AES_BLOCKLEN), in + (blocks * AES_BLOCKLEN), length - (blocks * AES_BLOCKLEN));
+}
+
+#endif // #if defined(CTR) && (CTR == 1)
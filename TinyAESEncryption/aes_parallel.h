@@ -0,0 +1,39 @@
+#ifndef _AES_PARALLEL_H_
+#define _AES_PARALLEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "aes.h"
+
+// Multi-threaded variants of the modes in aes.h for large buffers on the ground side.
+// They split the buffer into one contiguous chunk per thread (POSIX threads) and fall back
+// to the single-threaded functions for buffers below AES_PARALLEL_MIN_LENGTH.
+// This file is not needed for flight builds; compile it only where pthreads exist.
+//
+// threads == 0 uses one thread per online CPU.
+
+#ifndef AES_PARALLEL_MIN_LENGTH
+  #define AES_PARALLEL_MIN_LENGTH (256 * 1024)
+#endif
+
+#ifndef AES_PARALLEL_MAX_THREADS
+  #define AES_PARALLEL_MAX_THREADS 64
+#endif
+
+#if defined(CBC) && (CBC == 1)
+// Same contract as AES_CBC_decrypt_buffer_to(): in and out are the same buffer or do not
+// overlap, length is a multiple of AES_BLOCKLEN, and ctx->Iv is left at the last
+// ciphertext block so calls can be chained.
+void AES_CBC_decrypt_buffer_mt(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length, unsigned threads);
+#endif // #if defined(CBC) && (CBC == 1)
+
+#if defined(CTR) && (CTR == 1)
+// AES_CTR_xcrypt_at() with the range split into one run of whole blocks per thread. ctx is
+// only read, so calls for different ranges can share it.
+void AES_CTR_xcrypt_at_mt(const struct AES_ctx* ctx, uint64_t offset, uint8_t* out, const uint8_t* in, size_t length, unsigned threads);
+// Same contract as AES_CTR_xcrypt_buffer_to(): continues the stream from ctx->Iv and any
+// buffered keystream, and leaves ctx ready for the next call.
+void AES_CTR_xcrypt_buffer_mt(struct AES_ctx* ctx, uint8_t* out, const uint8_t* in, size_t length, unsigned threads);
+#endif // #if defined(CTR) && (CTR == 1)
+
+#endif // _AES_PARALLEL_H_
@@ -0,0 +1,708 @@
+// Known-answer tests. Exits non-zero on a failure.
+// To build, gcc -DAES_RUNTIME_KEYLEN=1 -DGCM=1 -DCMAC=1 test.c aes.c aes_parallel.c aes_keystream.c -o test -pthread
+// Run it for every backend that ships: the default build (AES-NI where the CPU has it),
+// -DAES_NI=0, -DAES_NI=0 -DAES_FAST_TABLES=1 for the T-tables, which must give the same
+// output as the byte-wise code, and -DAES_NI=0 -DAES_BITSLICE=1. Without AES_RUNTIME_KEYLEN only the key size of
+// aes.h is tested.
+
+#include "aes.h"
+#include "aes_parallel.h"
+#include "aes_keystream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+// Decodes a hex string into out and returns its length in bytes.
+static size_t unhex(uint8_t *out, const char *hex) {
+    size_t n = 0;
+
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned v;
+        sscanf(hex, "%2x", &v);
+        out[n++] = (uint8_t)v;
+    }
+    return n;
+}
+
+static void check(const char *name, int ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// Keys the context with a key of keylen bytes. Returns -1 when the build cannot.
+static int init_key(struct AES_ctx *ctx, const uint8_t *key, size_t keylen) {
+#if defined(AES_RUNTIME_KEYLEN) && (AES_RUNTIME_KEYLEN == 1)
+    return AES_init_ctx_keylen(ctx, key, keylen);
+#else
+    if (keylen != AES_KEYLEN)
+        return -1;
+    AES_init_ctx(ctx, key);
+    return 0;
+#endif
+}
+
+// The examples of NIST SP 800-38A, appendix F; all use the same four plaintext blocks.
+static const char sp_plain[] =
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+static const char sp_cbc_iv[] = "000102030405060708090a0b0c0d0e0f";
+static const char sp_ctr_iv[] = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const struct sp_case {
+    unsigned bits;
+    const char *key, *ecb, *cbc, *ctr;
+} sp_cases[] = {
+    { 128, "2b7e151628aed2a6abf7158809cf4f3c",
+      "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+      "43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4",
+      "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+      "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7",
+      "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+      "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" },
+    { 192, "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+      "bd334f1d6e45f25ff712a214571fa5cc974104846d0ad3ad7734ecb3ecee4eef"
+      "ef7afd2270e2e60adce0ba2face6444e9a4b41ba738d6c72fb16691603c18e0e",
+      "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a"
+      "571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd",
+      "1abc932417521ca24f2b0459fe7e6e0b090339ec0aa6faefd5ccc2c6f4ce8e94"
+      "1e36b26bd1ebc670d1bd1d665620abf74f78a7f6d29809585a97daec58c6b050" },
+    { 256, "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870"
+      "b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7",
+      "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+      "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b",
+      "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+      "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6" },
+};
+
+static void test_sp800_38a(const struct sp_case *t) {
+    uint8_t key[32], pt[64], iv[16], expected[64], buf[64];
+    size_t keylen = unhex(key, t->key);
+    struct AES_ctx ctx;
+    char name[64];
+
+    unhex(pt, sp_plain);
+    if (init_key(&ctx, key, keylen) != 0) {
+        printf("AES-%u tests skipped, build with -DAES_RUNTIME_KEYLEN=1\n", t->bits);
+        return;
+    }
+
+#if defined(ECB) && (ECB == 1)
+    unhex(expected, t->ecb);
+    memcpy(buf, pt, sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i += AES_BLOCKLEN)
+        AES_ECB_encrypt(&ctx, buf + i);
+    snprintf(name, sizeof(name), "ECB-AES%u encrypt", t->bits);
+    check(name, memcmp(buf, expected, sizeof(buf)) == 0);
+    for (size_t i = 0; i < sizeof(buf); i += AES_BLOCKLEN)
+        AES_ECB_decrypt(&ctx, buf + i);
+    snprintf(name, sizeof(name), "ECB-AES%u decrypt", t->bits);
+    check(name, memcmp(buf, pt, sizeof(buf)) == 0);
+#endif
+
+#if defined(CBC) && (CBC == 1)
+    unhex(expected, t->cbc);
+    unhex(iv, sp_cbc_iv);
+    AES_ctx_set_iv(&ctx, iv);
+    AES_CBC_encrypt_buffer_to(&ctx, buf, pt, sizeof(buf));
+    snprintf(name, sizeof(name), "CBC-AES%u encrypt", t->bits);
+    check(name, memcmp(buf, expected, sizeof(buf)) == 0);
+    AES_ctx_set_iv(&ctx, iv);
+    AES_CBC_decrypt_buffer(&ctx, buf, sizeof(buf));
+    snprintf(name, sizeof(name), "CBC-AES%u decrypt", t->bits);
+    check(name, memcmp(buf, pt, sizeof(buf)) == 0);
+    // Fewer blocks than the bitsliced engine takes at once.
+    int cbc_ok = 1;
+    for (size_t n = 1; n < 4; ++n) {
+        memcpy(buf, expected, n * AES_BLOCKLEN);
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CBC_decrypt_buffer(&ctx, buf, n * AES_BLOCKLEN);
+        cbc_ok &= memcmp(buf, pt, n * AES_BLOCKLEN) == 0;
+    }
+    snprintf(name, sizeof(name), "CBC-AES%u decrypt, 1-3 blocks", t->bits);
+    check(name, cbc_ok);
+#endif
+
+#if defined(CTR) && (CTR == 1)
+    // CTR is its own inverse, so one direction covers both.
+    unhex(expected, t->ctr);
+    unhex(iv, sp_ctr_iv);
+    AES_ctx_set_iv(&ctx, iv);
+    memcpy(buf, pt, sizeof(buf));
+    AES_CTR_xcrypt_buffer(&ctx, buf, sizeof(buf));
+    snprintf(name, sizeof(name), "CTR-AES%u", t->bits);
+    check(name, memcmp(buf, expected, sizeof(buf)) == 0);
+    int ctr_ok = 1;
+    for (size_t n = 1; n < 4; ++n) {
+        memcpy(buf, pt, n * AES_BLOCKLEN);
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CTR_xcrypt_buffer(&ctx, buf, n * AES_BLOCKLEN);
+        ctr_ok &= memcmp(buf, expected, n * AES_BLOCKLEN) == 0;
+    }
+    snprintf(name, sizeof(name), "CTR-AES%u, 1-3 blocks", t->bits);
+    check(name, ctr_ok);
+#endif
+}
+
+#if defined(ECB) && (ECB == 1)
+
+// Adds n to a big-endian 128-bit counter.
+static void counter_add(uint8_t *ctr, unsigned n) {
+    for (int i = AES_BLOCKLEN - 1; i >= 0 && n > 0; --i) {
+        n += ctr[i];
+        ctr[i] = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+// CBC decryption and CTR over 1 to 9 blocks, i.e. whole and partial groups of the
+// bitsliced engine, against the same blocks done one at a time with ECB, whose single
+// blocks the vectors above cover.
+static void test_block_counts(void) {
+    uint8_t key[AES_KEYLEN], iv[AES_BLOCKLEN], in[9 * AES_BLOCKLEN], out[sizeof(in)], ref[sizeof(in)];
+    struct AES_ctx ctx;
+    int cbc_ok = 1, ctr_ok = 1;
+
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (uint8_t)(i * 7 + 1);
+    for (size_t i = 0; i < sizeof(in); ++i)
+        in[i] = (uint8_t)(i * 13 + 5);
+    unhex(iv, sp_ctr_iv);
+    AES_init_ctx(&ctx, key);
+
+    for (size_t n = 1; n <= 9; ++n) {
+        size_t len = n * AES_BLOCKLEN;
+#if defined(CBC) && (CBC == 1)
+        for (size_t b = 0; b < n; ++b) {
+            memcpy(ref + b * AES_BLOCKLEN, in + b * AES_BLOCKLEN, AES_BLOCKLEN);
+            AES_ECB_decrypt(&ctx, ref + b * AES_BLOCKLEN);
+            for (size_t i = 0; i < AES_BLOCKLEN; ++i)
+                ref[b * AES_BLOCKLEN + i] ^= (b == 0) ? iv[i] : in[(b - 1) * AES_BLOCKLEN + i];
+        }
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CBC_decrypt_buffer_to(&ctx, out, in, len);
+        cbc_ok &= memcmp(out, ref, len) == 0;
+#endif
+#if defined(CTR) && (CTR == 1)
+        uint8_t counter[AES_BLOCKLEN];
+        memcpy(counter, iv, sizeof(counter));
+        for (size_t b = 0; b < n; ++b) {
+            memcpy(ref + b * AES_BLOCKLEN, counter, AES_BLOCKLEN);
+            AES_ECB_encrypt(&ctx, ref + b * AES_BLOCKLEN);
+            for (size_t i = 0; i < AES_BLOCKLEN; ++i)
+                ref[b * AES_BLOCKLEN + i] ^= in[b * AES_BLOCKLEN + i];
+            counter_add(counter, 1);
+        }
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CTR_xcrypt_buffer_to(&ctx, out, in, len);
+        ctr_ok &= memcmp(out, ref, len) == 0;
+#endif
+    }
+#if defined(CBC) && (CBC == 1)
+    check("CBC decrypt, 1-9 blocks", cbc_ok);
+#endif
+#if defined(CTR) && (CTR == 1)
+    check("CTR, 1-9 blocks", ctr_ok);
+#endif
+}
+
+#endif // #if defined(ECB) && (ECB == 1)
+
+#if defined(CBC) && (CBC == 1)
+
+// Decrypts the n blocks of ct with ctx keyed and set to iv, in place, out of place, in two
+// chained calls split at block split, and with AES_CBC_decrypt_buffer_mt() on threads
+// threads (in place and out of place), and checks every result against pt.
+static int cbc_decrypt_all_ways(struct AES_ctx *ctx, const uint8_t *iv, const uint8_t *ct, const uint8_t *pt,
+                                size_t n, size_t split, unsigned threads, uint8_t *buf) {
+    const size_t len = n * AES_BLOCKLEN;
+    const uint8_t *last = ct + len - AES_BLOCKLEN;
+    int ok = 1;
+
+    AES_ctx_set_iv(ctx, iv);
+    AES_CBC_decrypt_buffer_to(ctx, buf, ct, len);
+    ok &= memcmp(buf, pt, len) == 0 && memcmp(ctx->Iv, last, AES_BLOCKLEN) == 0;
+
+    memcpy(buf, ct, len);
+    AES_ctx_set_iv(ctx, iv);
+    AES_CBC_decrypt_buffer(ctx, buf, len);
+    ok &= memcmp(buf, pt, len) == 0 && memcmp(ctx->Iv, last, AES_BLOCKLEN) == 0;
+
+    memcpy(buf, ct, len);
+    AES_ctx_set_iv(ctx, iv);
+    AES_CBC_decrypt_buffer(ctx, buf, split * AES_BLOCKLEN);
+    AES_CBC_decrypt_buffer(ctx, buf + split * AES_BLOCKLEN, len - split * AES_BLOCKLEN);
+    ok &= memcmp(buf, pt, len) == 0;
+
+    AES_ctx_set_iv(ctx, iv);
+    AES_CBC_decrypt_buffer_mt(ctx, buf, ct, len, threads);
+    ok &= memcmp(buf, pt, len) == 0 && memcmp(ctx->Iv, last, AES_BLOCKLEN) == 0;
+
+    memcpy(buf, ct, len);
+    AES_ctx_set_iv(ctx, iv);
+    AES_CBC_decrypt_buffer_mt(ctx, buf, buf, len, threads);
+    ok &= memcmp(buf, pt, len) == 0 && memcmp(ctx->Iv, last, AES_BLOCKLEN) == 0;
+    return ok;
+}
+
+// The interleaved decryption saves the ciphertext of each group before it overwrites it
+// in place, and the threaded one takes the IV of every chunk from the block before it;
+// both are checked at lengths that leave a partial group, and the threaded one at
+// lengths that give each thread a different, unaligned share.
+static void test_cbc_decrypt(void) {
+    static const size_t short_blocks[] = { 1, 3, 7, 9, 15, 17, 31 };
+    const size_t big_blocks = 3 * (AES_PARALLEL_MIN_LENGTH / AES_BLOCKLEN) + 13;
+    uint8_t key[AES_KEYLEN], iv[AES_BLOCKLEN];
+    uint8_t *pt = malloc(big_blocks * AES_BLOCKLEN);
+    uint8_t *ct = malloc(big_blocks * AES_BLOCKLEN);
+    uint8_t *buf = malloc(big_blocks * AES_BLOCKLEN);
+    struct AES_ctx ctx;
+    int ok = 1;
+
+    if (!pt || !ct || !buf) {
+        check("CBC decrypt paths (out of memory)", 0);
+        goto out;
+    }
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (uint8_t)(i * 29 + 3);
+    for (size_t i = 0; i < sizeof(iv); ++i)
+        iv[i] = (uint8_t)(0xA0 + i);
+    for (size_t i = 0; i < big_blocks * AES_BLOCKLEN; ++i)
+        pt[i] = (uint8_t)((i * 2654435761u) >> 13);
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CBC_encrypt_buffer_to(&ctx, ct, pt, big_blocks * AES_BLOCKLEN);
+
+    for (size_t i = 0; i < sizeof(short_blocks) / sizeof(short_blocks[0]); ++i)
+        ok &= cbc_decrypt_all_ways(&ctx, iv, ct, pt, short_blocks[i], short_blocks[i] / 2, 1, buf);
+    check("CBC decrypt, in and out of place", ok);
+
+    ok = 1;
+    for (unsigned threads = 2; threads <= 4; ++threads)
+        ok &= cbc_decrypt_all_ways(&ctx, iv, ct, pt, big_blocks, 5, threads, buf);
+    check("CBC decrypt, 2-4 threads", ok);
+
+out:
+    free(pt);
+    free(ct);
+    free(buf);
+}
+
+// More jobs than AES_BATCH_LANES, so lanes are refilled, with empty and one-block
+// messages, every key size the build has, and every other job in place; each job must
+// give what AES_CBC_encrypt_buffer_to()/AES_CBC_decrypt_buffer_to() give on its own.
+static void test_cbc_batch(void) {
+    static const size_t blocks[] = { 0, 1, 2, 5, 1, 0, 17, 3, 8, 1, 33, 4, 0, 9, 2, 64, 1, 7, 12, 3 };
+    enum { JOBS = sizeof(blocks) / sizeof(blocks[0]), TOTAL = 256 * AES_BLOCKLEN };
+    static uint8_t pt[TOTAL], ref[TOTAL], buf[TOTAL], ivs[JOBS][AES_BLOCKLEN];
+    static const size_t keylens[] = { 16, 24, 32 };
+    struct AES_ctx ctxs[3], ctx;
+    struct AES_batch_job jobs[JOBS];
+    uint8_t key[32];
+    size_t nctx = 0, off = 0;
+    int ok = 1;
+
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (uint8_t)(i * 17 + 5);
+    for (size_t k = 0; k < 3; ++k)
+        nctx += init_key(&ctxs[nctx], key, keylens[k]) == 0;
+    for (size_t i = 0; i < TOTAL; ++i)
+        pt[i] = (uint8_t)((i * 2654435761u) >> 9);
+
+    for (size_t j = 0; j < JOBS; ++j) {
+        const size_t len = blocks[j] * AES_BLOCKLEN;
+        for (size_t i = 0; i < AES_BLOCKLEN; ++i)
+            ivs[j][i] = (uint8_t)(j * 31 + i);
+        jobs[j].ctx = &ctxs[j % nctx];
+        jobs[j].key_id = 0;
+        jobs[j].iv = ivs[j];
+        jobs[j].length = len;
+        jobs[j].out = buf + off;
+        jobs[j].in = (j % 2) ? buf + off : pt + off;
+        ctx = ctxs[j % nctx];
+        AES_ctx_set_iv(&ctx, ivs[j]);
+        AES_CBC_encrypt_buffer_to(&ctx, ref + off, pt + off, len);
+        off += len;
+    }
+
+    memcpy(buf, pt, off);
+    AES_CBC_encrypt_batch(jobs, JOBS);
+    ok &= memcmp(buf, ref, off) == 0;
+
+    // Decrypt the same messages back: in place from buf, or from ref into buf.
+    for (size_t j = 0; j < JOBS; ++j)
+        if (!(j % 2))
+            jobs[j].in = ref + (jobs[j].out - buf);
+    AES_CBC_decrypt_batch(jobs, JOBS);
+    ok &= memcmp(buf, pt, off) == 0;
+    check("CBC batch, mixed lengths and keys", ok);
+}
+
+#endif // #if defined(CBC) && (CBC == 1)
+
+#if defined(CTR) && (CTR == 1)
+
+// A fixed sequence of pseudo-random numbers, so that a failure can be reproduced.
+static uint64_t next_random(uint64_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return *state >> 17;
+}
+
+// Random access to the CTR stream of iv, with AES_CTR_xcrypt_at() and the threaded
+// functions, against the same stream produced in one sequential pass. The stream is long
+// enough for the threaded functions to split it, and iv puts the lower half of the
+// counter close enough to its end that it wraps in the middle.
+static void test_ctr_random_access(const char *label, const uint8_t *iv, size_t wrap_block) {
+    const size_t len = 3 * AES_PARALLEL_MIN_LENGTH + 1000;
+    uint8_t key[AES_KEYLEN];
+    uint8_t *in = malloc(len), *ref = malloc(len), *out = malloc(len);
+    uint64_t random = 1;
+    struct AES_ctx ctx;
+    char name[64];
+    int ok = 1;
+
+    if (!in || !ref || !out) {
+        check("CTR random access (out of memory)", 0);
+        goto out;
+    }
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (uint8_t)(i * 11 + 2);
+    for (size_t i = 0; i < len; ++i)
+        in[i] = (uint8_t)((i * 2654435761u) >> 11);
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CTR_xcrypt_buffer_to(&ctx, ref, in, len);
+    AES_ctx_set_iv(&ctx, iv);
+
+#if defined(ECB) && (ECB == 1)
+    // The blocks on both sides of the wrap, one at a time, as the sequential pass should
+    // have done them.
+    for (size_t b = wrap_block - 2; b < wrap_block + 2; ++b) {
+        uint8_t block[AES_BLOCKLEN];
+        memcpy(block, iv, sizeof(block));
+        counter_add(block, (unsigned)b);
+        AES_ECB_encrypt(&ctx, block);
+        for (size_t i = 0; i < AES_BLOCKLEN; ++i)
+            ok &= (block[i] ^ in[b * AES_BLOCKLEN + i]) == ref[b * AES_BLOCKLEN + i];
+    }
+    snprintf(name, sizeof(name), "CTR %s, sequential", label);
+    check(name, ok);
+#endif
+
+    ok = 1;
+    for (int i = 0; i < 500; ++i) {
+        size_t offset = next_random(&random) % len;
+        size_t n = next_random(&random) % 2048;
+        if (i % 10 == 0)
+            offset = wrap_block * AES_BLOCKLEN - 1 - next_random(&random) % 40;
+        if (n > len - offset)
+            n = len - offset;
+        AES_CTR_xcrypt_at(&ctx, offset, out, in + offset, n);
+        ok &= memcmp(out, ref + offset, n) == 0;
+    }
+    snprintf(name, sizeof(name), "CTR %s, random offsets", label);
+    check(name, ok);
+
+    ok = 1;
+    for (unsigned threads = 2; threads <= 4; ++threads) {
+        const size_t offset = threads * 5;
+        memset(out, 0, len);
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CTR_xcrypt_at_mt(&ctx, offset, out, in + offset, len - offset, threads);
+        ok &= memcmp(out, ref + offset, len - offset) == 0;
+
+        // A sequential start and end around the threaded middle, chained through ctx.
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CTR_xcrypt_buffer_to(&ctx, out, in, offset);
+        AES_CTR_xcrypt_buffer_mt(&ctx, out + offset, in + offset, len - offset - 9, threads);
+        AES_CTR_xcrypt_buffer_to(&ctx, out + len - 9, in + len - 9, 9);
+        ok &= memcmp(out, ref, len) == 0;
+    }
+    snprintf(name, sizeof(name), "CTR %s, 2-4 threads", label);
+    check(name, ok);
+
+out:
+    free(in);
+    free(ref);
+    free(out);
+}
+
+// The cached keystream of iv against AES_CTR_xcrypt_at(), byte for byte, for frames
+// that mostly move forward but also skip ahead, step back and straddle the ring's end.
+static void test_keystream(const char *label, const uint8_t *iv, size_t wrap_block) {
+    const size_t len = 64 * 1024;
+    const uint64_t start = (wrap_block - 100) * AES_BLOCKLEN;
+    uint8_t key[AES_KEYLEN];
+    uint8_t *in = malloc(len), *ref = malloc(len), *out = malloc(len);
+    struct AES_keystream_cache *cache = AES_keystream_cache_new(4096);
+    struct AES_keystream *ks = NULL;
+    uint64_t random = 7, offset = start;
+    struct AES_ctx ctx;
+    char name[64];
+    int ok = 1;
+
+    if (!in || !ref || !out || !cache) {
+        check("keystream (out of memory)", 0);
+        goto out;
+    }
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (uint8_t)(i * 5 + 9);
+    for (size_t i = 0; i < len; ++i)
+        in[i] = (uint8_t)((i * 40503u) >> 7);
+    AES_init_ctx_iv(&ctx, key, iv);
+    ks = AES_keystream_open(cache, &ctx);
+    if (!ks) {
+        check("keystream (out of memory)", 0);
+        goto out;
+    }
+
+    for (int i = 0; i < 400; ++i) {
+        size_t n = next_random(&random) % 1500;
+        if (i % 17 == 0)
+            offset += next_random(&random) % 20000; // lost frames
+        else if (i % 23 == 0 && offset > start + 3000)
+            offset -= next_random(&random) % 3000; // a late frame
+        if (n > len)
+            n = len;
+        AES_CTR_xcrypt_at(&ctx, offset, ref, in, n);
+        AES_keystream_xcrypt_at(ks, offset, out, in, n);
+        ok &= memcmp(out, ref, n) == 0;
+        offset += n;
+    }
+    snprintf(name, sizeof(name), "keystream %s, xcrypt_at", label);
+    check(name, ok);
+
+    // The whole buffer in uneven pieces from where the last frame ended.
+    AES_CTR_xcrypt_at(&ctx, offset, ref, in, len);
+    for (size_t done = 0, n; done < len; done += n) {
+        n = next_random(&random) % 3000;
+        if (n > len - done)
+            n = len - done;
+        AES_keystream_xcrypt(ks, out + done, in + done, n);
+    }
+    snprintf(name, sizeof(name), "keystream %s, xcrypt", label);
+    check(name, memcmp(out, ref, len) == 0);
+
+out:
+    AES_keystream_close(ks);
+    if (cache)
+        AES_keystream_cache_free(cache);
+    free(in);
+    free(ref);
+    free(out);
+}
+
+static void test_ctr(void) {
+    const size_t wrap_block = 20000;
+    const uint64_t lo = (uint64_t)0 - wrap_block;
+    uint8_t iv[AES_BLOCKLEN];
+
+    // The lower 64 bits wrap after wrap_block blocks and carry into the upper half.
+    memset(iv, 0x5A, 8);
+    for (int i = 0; i < 8; ++i)
+        iv[15 - i] = (uint8_t)(lo >> (8 * i));
+    test_ctr_random_access("carry into bit 64", iv, wrap_block);
+    test_keystream("carry into bit 64", iv, wrap_block);
+
+    // The whole 128-bit counter wraps.
+    memset(iv, 0xFF, 8);
+    test_ctr_random_access("128-bit wrap", iv, wrap_block);
+}
+
+#endif // #if defined(CTR) && (CTR == 1)
+
+// The block cipher code this build runs on this CPU.
+static const char *backend(void) {
+#if defined(AES_NI) && (AES_NI == 1)
+    struct AES_ctx ctx;
+    uint8_t key[AES_KEYLEN] = { 0 };
+
+    AES_init_ctx(&ctx, key);
+    if (ctx.AesNi)
+        return "AES-NI";
+#endif
+#if defined(AES_BITSLICE) && (AES_BITSLICE == 1)
+    return "bitsliced";
+#elif defined(AES_FAST_TABLES) && (AES_FAST_TABLES == 1)
+    return "T-tables";
+#else
+    return "byte-wise";
+#endif
+}
+
+#if defined(GCM) && (GCM == 1)
+
+// The AES-128 test cases of the GCM specification (McGrew and Viega), as used in NIST's
+// GCM validation.
+struct gcm_case {
+    const char *name, *key, *iv, *aad, *pt, *ct, *tag;
+};
+
+static const struct gcm_case gcm_cases[] = {
+    { "GCM test case 1",
+      "00000000000000000000000000000000", "000000000000000000000000", "", "", "",
+      "58e2fccefa7e3061367f1d57a4e7455a" },
+    { "GCM test case 2",
+      "00000000000000000000000000000000", "000000000000000000000000", "",
+      "00000000000000000000000000000000",
+      "0388dace60b6a392f328c2b971b2fe78",
+      "ab6e47d42cec13bdf53a67b21257bddf" },
+    { "GCM test case 3",
+      "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+      "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+      "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+      "4d5c2af327cd64a62cf35abd2ba6fab4" },
+    { "GCM test case 4",
+      "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+      "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+      "5bc94fbc3221a5db94fae95ae7121a47" },
+    { "GCM test case 5 (8-byte IV)",
+      "feffe9928665731c6d6a8f9467308308", "cafebabefacedbad",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c7423"
+      "73806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+      "3612d2e79e3b0785561be14aaca2fccb" },
+    { "GCM test case 6 (60-byte IV)",
+      "feffe9928665731c6d6a8f9467308308",
+      "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728"
+      "c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+      "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca7"
+      "01e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+      "619cc5aefffe0bfa462af43c1699d050" },
+};
+
+static void test_gcm(const struct gcm_case *t) {
+    uint8_t key[16], iv[64], aad[32], pt[64], ct[64], tag[16], out[64], got[16];
+    size_t iv_len = unhex(iv, t->iv), aad_len = unhex(aad, t->aad);
+    size_t len = unhex(pt, t->pt);
+    struct AES_ctx ctx;
+    char name[64];
+    int ok;
+
+    unhex(key, t->key);
+    unhex(ct, t->ct);
+    unhex(tag, t->tag);
+    AES_init_ctx(&ctx, key);
+
+    AES_GCM_start(&ctx, iv, iv_len);
+    AES_GCM_aad(&ctx, aad, aad_len);
+    AES_GCM_encrypt_buffer_to(&ctx, out, pt, len);
+    AES_GCM_finish(&ctx, got, sizeof(got));
+    snprintf(name, sizeof(name), "%s encrypt", t->name);
+    check(name, memcmp(out, ct, len) == 0 && memcmp(got, tag, sizeof(tag)) == 0);
+
+    // The same message again in odd-sized pieces, decrypted in place.
+    memcpy(out, ct, len);
+    AES_GCM_start(&ctx, iv, iv_len);
+    AES_GCM_aad(&ctx, aad, aad_len / 3);
+    AES_GCM_aad(&ctx, aad + aad_len / 3, aad_len - aad_len / 3);
+    AES_GCM_decrypt_buffer_to(&ctx, out, out, len / 3);
+    AES_GCM_decrypt_buffer_to(&ctx, out + len / 3, out + len / 3, len - len / 3);
+    ok = AES_GCM_check_tag(&ctx, tag, sizeof(tag)) == 0;
+    snprintf(name, sizeof(name), "%s decrypt", t->name);
+    check(name, ok && memcmp(out, pt, len) == 0);
+
+    // A tag with one bit flipped must be rejected.
+    tag[sizeof(tag) - 1] ^= 0x01;
+    AES_GCM_start(&ctx, iv, iv_len);
+    AES_GCM_aad(&ctx, aad, aad_len);
+    AES_GCM_decrypt_buffer_to(&ctx, out, ct, len);
+    snprintf(name, sizeof(name), "%s bad tag", t->name);
+    check(name, AES_GCM_check_tag(&ctx, tag, sizeof(tag)) != 0);
+}
+
+#endif // #if defined(GCM) && (GCM == 1)
+
+#if defined(CMAC) && (CMAC == 1)
+
+// The examples of RFC 4493, section 4.
+static const char cmac_key[] = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char cmac_msg[] =
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+static const struct {
+    size_t len;
+    const char *tag;
+} cmac_cases[] = {
+    { 0, "bb1d6929e95937287fa37d129b756746" },
+    { 16, "070a16b46b4d4144f79bdd9dd04a287c" },
+    { 40, "dfa66747de9ae63030ca32611497c827" },
+    { 64, "51f0bebf7e3b9d92fc49741779363cfe" },
+};
+
+static void test_cmac(size_t len, const char *tag_hex) {
+    uint8_t key[16], msg[64], tag[16], got[16];
+    struct AES_ctx ctx;
+    char name[64];
+
+    unhex(key, cmac_key);
+    unhex(msg, cmac_msg);
+    unhex(tag, tag_hex);
+    AES_init_ctx(&ctx, key);
+
+    AES_CMAC_buffer(&ctx, msg, len, got, sizeof(got));
+    snprintf(name, sizeof(name), "CMAC example, %zu bytes", len);
+    check(name, memcmp(got, tag, sizeof(tag)) == 0 && AES_CMAC_check_tag(&ctx, msg, len, tag, sizeof(tag)) == 0);
+
+    // The same message in pieces that do not line up with the blocks.
+    AES_CMAC_start(&ctx);
+    for (size_t i = 0; i < len; i += 7)
+        AES_CMAC_update(&ctx, msg + i, len - i < 7 ? len - i : 7);
+    AES_CMAC_finish(&ctx, got, sizeof(got));
+    snprintf(name, sizeof(name), "CMAC example, %zu bytes, in pieces", len);
+    check(name, memcmp(got, tag, sizeof(tag)) == 0);
+
+    // A tag with one bit flipped must be rejected, also when truncated.
+    tag[0] ^= 0x80;
+    snprintf(name, sizeof(name), "CMAC example, %zu bytes, bad tag", len);
+    check(name, AES_CMAC_check_tag(&ctx, msg, len, tag, sizeof(tag)) != 0 &&
+                AES_CMAC_check_tag(&ctx, msg, len, tag, 8) != 0);
+}
+
+#endif // #if defined(CMAC) && (CMAC == 1)
+
+int main(void) {
+    printf("backend: %s\n", backend());
+#if (defined(AES_FAST_TABLES) && (AES_FAST_TABLES == 1)) || (defined(AES_BITSLICE) && (AES_BITSLICE == 1))
+    if (strcmp(backend(), "AES-NI") == 0)
+        printf("AES-NI is in use, so the portable backend is not tested; build with -DAES_NI=0\n");
+#endif
+    for (size_t i = 0; i < sizeof(sp_cases) / sizeof(sp_cases[0]); ++i)
+        test_sp800_38a(&sp_cases[i]);
+#if defined(ECB) && (ECB == 1)
+    test_block_counts();
+#endif
+#if defined(CBC) && (CBC == 1)
+    test_cbc_decrypt();
+    test_cbc_batch();
+#endif
+#if defined(CTR) && (CTR == 1)
+    test_ctr();
+#endif
+#if defined(GCM) && (GCM == 1)
+    for (size_t i = 0; i < sizeof(gcm_cases) / sizeof(gcm_cases[0]); ++i)
+        test_gcm(&gcm_cases[i]);
+#else
+    printf("GCM tests skipped, build with -DGCM=1\n");
+#endif
+#if defined(CMAC) && (CMAC == 1)
+    for (size_t i = 0; i < sizeof(cmac_cases) / sizeof(cmac_cases[0]); ++i)
+        test_cmac(cmac_cases[i].len, cmac_cases[i].tag);
+#else
+    printf("CMAC tests skipped, build with -DCMAC=1\n");
+#endif
+    printf("%s\n", failures ? "FAILED" : "all tests passed");
+    return failures != 0;
+}